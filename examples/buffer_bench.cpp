@@ -0,0 +1,109 @@
+#include "coros.h"
+#include "malog.h"
+#include <chrono>
+#include <sys/socket.h>
+
+// Length-prefixed frames of 1 byte to 60 KB, parsed as they trickle in.
+// Buffer<N> memmoves the partial frame to the front whenever the next one
+// would run off its end; RingBuffer never moves data.
+static const int kBufferSize = 64 * 1024;
+static const int kMaxFrame = 60 * 1024;
+static const int64_t kTotalBytes = 1LL << 30;
+
+bool done = false;
+coros::Condition done_cond;
+
+void ExitFn(coros::Coroutine* c) {
+}
+
+int FrameLen(uint64_t i) {
+  return 1 + static_cast<int>((i * 2654435761u) % kMaxFrame);
+}
+
+void WriterFn(uv_os_sock_t fd) {
+  coros::Socket s(fd);
+  static char frame[4 + kMaxFrame];
+  int64_t sent = 0;
+  for (uint64_t i = 0; sent < kTotalBytes; i++) {
+    int len = FrameLen(i);
+    memcpy(frame, &len, 4);
+    if (s.WriteExactly(frame, 4 + len) != 4 + len) {
+      break;
+    }
+    sent += 4 + len;
+  }
+  s.Close();
+}
+
+template <typename B>
+void Parse(coros::Socket* s, B* b, const char* name) {
+  auto start = std::chrono::steady_clock::now();
+  int64_t bytes = 0;
+  uint64_t frames = 0;
+  for (;;) {
+    if (b->EnsureData(4) != 4) {
+      break;
+    }
+    int len;
+    memcpy(&len, b->Data(), 4);
+    if (len != FrameLen(frames) || b->EnsureData(4 + len) != 4 + len) {
+      break;
+    }
+    b->Skip(4 + len);
+    bytes += 4 + len;
+    frames ++;
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  MALOG_INFO(name << ": " << frames << " frames, " << (bytes / (elapsed > 0 ? elapsed : 1)) << " MB/s");
+}
+
+void ReaderFn(uv_os_sock_t fd, bool ring) {
+  coros::Socket s(fd);
+  if (ring) {
+    coros::RingBuffer b(&s, kBufferSize);
+    if (b.Valid()) {
+      Parse(&s, &b, "RingBuffer");
+    } else {
+      MALOG_ERROR("RingBuffer: mapping failed");
+    }
+  } else {
+    static coros::Buffer<kBufferSize> b;
+    b.Clear();
+    b.Attach(&s);
+    Parse(&s, &b, "Buffer<N>");
+  }
+  s.Close();
+  done = true;
+  done_cond.NotifyAll();
+}
+
+void Bench(coros::Scheduler* sched, bool ring) {
+  coros::Coroutine* c = coros::Coroutine::Self();
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) != 0) {
+    return;
+  }
+  // Small socket buffers so reads land mid-frame
+  int size = 16 * 1024;
+  setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  coros::Coroutine::Create(sched, std::bind(WriterFn, sv[0]), ExitFn);
+  coros::Coroutine::Create(sched, std::bind(ReaderFn, sv[1], ring), ExitFn);
+  while (!done) {
+    done_cond.Wait(c);
+  }
+  done = false;
+}
+
+void MainFn(coros::Scheduler* sched) {
+  Bench(sched, false);
+  Bench(sched, true);
+  sched->Stop();
+}
+
+int main(int argc, char** argv) {
+  coros::Scheduler sched(true);
+  coros::Coroutine::Create(&sched, std::bind(MainFn, &sched), ExitFn);
+  sched.Run();
+  return 0;
+}
@@ -0,0 +1,127 @@
+#include "coros.h"
+#include "malog.h"
+#include <chrono>
+
+// One producer and one consumer passing ints: a deque under std::mutex with
+// a Condition, against Channel on one scheduler and across two
+static const int kItems = 2000000;
+static const int kCapacity = 1024;
+static const int kBatch = 256;
+
+void ExitFn(coros::Coroutine* c) {
+}
+
+// What pipeline stages did before Channel; one scheduler only
+struct LockedQueue {
+  std::mutex lock;
+  std::deque<int> items;
+  coros::Condition not_empty;
+  coros::Condition not_full;
+};
+
+void LockedProducer(LockedQueue* q, coros::WaitGroup* wg) {
+  coros::Coroutine* c = coros::Coroutine::Self();
+  for (int i = 0; i < kItems; i++) {
+    while (q->items.size() >= kCapacity) {
+      q->not_full.Wait(c);
+    }
+    {
+      std::lock_guard<std::mutex> lock(q->lock);
+      q->items.push_back(i);
+    }
+    q->not_empty.NotifyOne();
+  }
+  wg->Done();
+}
+
+void LockedConsumer(LockedQueue* q, int64_t* sum, coros::WaitGroup* wg) {
+  coros::Coroutine* c = coros::Coroutine::Self();
+  for (int i = 0; i < kItems; i++) {
+    while (q->items.empty()) {
+      q->not_empty.Wait(c);
+    }
+    {
+      std::lock_guard<std::mutex> lock(q->lock);
+      *sum += q->items.front();
+      q->items.pop_front();
+    }
+    q->not_full.NotifyOne();
+  }
+  wg->Done();
+}
+
+void Producer(coros::Channel<int>* ch, coros::WaitGroup* wg) {
+  for (int i = 0; i < kItems; i++) {
+    ch->Send(i);
+  }
+  ch->Close();
+  wg->Done();
+}
+
+void Consumer(coros::Channel<int>* ch, int batch, int64_t* sum, coros::WaitGroup* wg) {
+  int items[kBatch];
+  for (;;) {
+    std::size_t n = (batch > 1) ? ch->RecvMany(items, batch) : (ch->Recv(items[0]) ? 1 : 0);
+    if (n == 0) {
+      break;
+    }
+    for (std::size_t i = 0; i < n; i++) {
+      *sum += items[i];
+    }
+  }
+  wg->Done();
+}
+
+void Report(const char* name, std::chrono::steady_clock::time_point start, int64_t sum) {
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  if (sum != static_cast<int64_t>(kItems) * (kItems - 1) / 2) {
+    MALOG_ERROR(name << ": wrong sum " << sum);
+  }
+  MALOG_INFO(name << ": " << (static_cast<int64_t>(kItems) * 1000000 / (elapsed > 0 ? elapsed : 1)) << " items per second");
+}
+
+void BenchLocked(coros::Scheduler* sched) {
+  LockedQueue q;
+  int64_t sum = 0;
+  coros::WaitGroup wg;
+  wg.Add(2);
+  auto start = std::chrono::steady_clock::now();
+  coros::Coroutine::Create(sched, std::bind(LockedProducer, &q, &wg), ExitFn)->SetPinned(true);
+  coros::Coroutine::Create(sched, std::bind(LockedConsumer, &q, &sum, &wg), ExitFn)->SetPinned(true);
+  wg.Wait();
+  Report("mutex+Condition       ", start, sum);
+}
+
+void Bench(const char* name, coros::Scheduler* from, coros::Scheduler* to, std::size_t capacity, bool local, int batch) {
+  coros::Channel<int> ch(capacity, local);
+  int64_t sum = 0;
+  coros::WaitGroup wg;
+  wg.Add(2);
+  auto start = std::chrono::steady_clock::now();
+  coros::Coroutine::Create(from, std::bind(Producer, &ch, &wg), ExitFn)->SetPinned(true);
+  coros::Coroutine::Create(to, std::bind(Consumer, &ch, batch, &sum, &wg), ExitFn)->SetPinned(true);
+  wg.Wait();
+  Report(name, start, sum);
+}
+
+void MainFn(coros::Scheduler* sched) {
+  coros::Schedulers scheds(2);
+  coros::Scheduler* a = scheds.GetNext();
+  coros::Scheduler* b = scheds.GetNext();
+  BenchLocked(a);
+  Bench("local unbuffered      ", a, a, 0, true, 1);
+  Bench("local bounded         ", a, a, kCapacity, true, 1);
+  Bench("local bounded, batched", a, a, kCapacity, true, kBatch);
+  Bench("cross unbuffered      ", a, b, 0, false, 1);
+  Bench("cross bounded         ", a, b, kCapacity, false, 1);
+  Bench("cross bounded, batched", a, b, kCapacity, false, kBatch);
+  scheds.Stop();
+  sched->Stop();
+}
+
+int main(int argc, char** argv) {
+  coros::Scheduler sched(true);
+  coros::Coroutine::Create(&sched, std::bind(MainFn, &sched), ExitFn);
+  sched.Run();
+  return 0;
+}
@@ -0,0 +1,118 @@
+#include "coros.h"
+#include "malog.h"
+#include <chrono>
+#include <string.h>
+#include <netinet/tcp.h>
+
+// Many coroutines sending small messages to one connection: a WriteExactly
+// per message, taking turns on the socket, against Socket::Enqueue and one
+// flush per loop iteration
+static const int kProducers = 64;
+static const int kMessages = 20000; // per producer
+static const int kLen = 32;
+static const int kBasePort = 9350;
+
+int next_port = kBasePort;
+
+void ExitFn(coros::Coroutine* c) {
+}
+
+void SinkFn(int port, int64_t* received) {
+  coros::Socket l;
+  l.ListenByIp("127.0.0.1", port);
+  coros::Socket s(l.Accept());
+  l.Close();
+  static char buf[256 * 1024];
+  for (;;) {
+    int n = s.ReadSome(buf, sizeof(buf));
+    if (n <= 0) {
+      break;
+    }
+    *received += n;
+  }
+  s.Close();
+}
+
+struct Shared {
+  coros::Socket s;
+  bool queued{ false };
+  bool busy{ false }; // a direct writer holds the socket
+  coros::Condition turn;
+  int done{ 0 };
+  coros::Condition done_cond;
+};
+
+void ProducerFn(Shared* shared) {
+  coros::Coroutine* c = coros::Coroutine::Self();
+  char msg[kLen];
+  memset(msg, 'x', kLen);
+  for (int i = 0; i < kMessages; i++) {
+    if (shared->queued) {
+      if (shared->s.Enqueue(msg, kLen) != kLen) {
+        break;
+      }
+    } else {
+      // One writer at a time, or a blocked write would interleave
+      while (shared->busy) {
+        shared->turn.Wait(c);
+      }
+      shared->busy = true;
+      int n = shared->s.WriteExactly(msg, kLen);
+      shared->busy = false;
+      shared->turn.NotifyOne();
+      if (n != kLen) {
+        break;
+      }
+    }
+    if (i % 16 == 15) {
+      c->Nice(); // let the other producers in, as a real server would
+    }
+  }
+  shared->done ++;
+  shared->done_cond.NotifyAll();
+}
+
+void Bench(coros::Scheduler* sched, const char* name, bool queued) {
+  coros::Coroutine* c = coros::Coroutine::Self();
+  int port = next_port ++;
+  int64_t received = 0;
+  coros::Coroutine::Create(sched, std::bind(SinkFn, port, &received), ExitFn);
+  c->Nice(); // let it listen
+
+  Shared shared;
+  shared.queued = queued;
+  if (!shared.s.ConnectIp("127.0.0.1", port)) {
+    MALOG_ERROR(name << ": connect failed");
+    return;
+  }
+  int on = 1;
+  setsockopt(shared.s.GetSocket(), IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kProducers; i++) {
+    coros::Coroutine::Create(sched, std::bind(ProducerFn, &shared), ExitFn);
+  }
+  while (shared.done < kProducers) {
+    shared.done_cond.Wait(c);
+  }
+  shared.s.Flush();
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  int64_t n = static_cast<int64_t>(kProducers) * kMessages;
+  MALOG_INFO(name << ": " << n << " messages, " << (n * 1000000 / (elapsed > 0 ? elapsed : 1)) << " per second");
+  shared.s.Close();
+  while (received < n * kLen) {
+    c->Wait(1); // the sink drains before the next round
+  }
+}
+
+void MainFn(coros::Scheduler* sched) {
+  Bench(sched, "WriteExactly", false);
+  Bench(sched, "Enqueue     ", true);
+  sched->Stop();
+}
+
+int main(int argc, char** argv) {
+  coros::Scheduler sched(true);
+  coros::Coroutine::Create(&sched, std::bind(MainFn, &sched), ExitFn);
+  sched.Run();
+  return 0;
+}
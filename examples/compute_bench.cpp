@@ -0,0 +1,75 @@
+#include "coros.h"
+#include "malog.h"
+#include <chrono>
+
+static const int kCoros = 8;
+static const long kWorkUs = 200000; // per run, split across sections
+
+int n_running = 0;
+coros::Condition done_cond;
+
+void Spin(long us) {
+  uint64_t until = uv_hrtime() + static_cast<uint64_t>(us) * 1000;
+  while (uv_hrtime() < until) {
+  }
+}
+
+// One instantiation per length, so each is its own BeginCompute call site
+template <long kSectionUs>
+void SectionFn(int sections) {
+  coros::Coroutine* c = coros::Coroutine::Self();
+  for (int i = 0; i < sections; i++) {
+    c->BeginCompute();
+    Spin(kSectionUs);
+    c->EndCompute();
+  }
+  if (-- n_running == 0) {
+    done_cond.NotifyAll();
+  }
+}
+
+void ExitFn(coros::Coroutine* c) {
+}
+
+template <long kSectionUs>
+void Bench(coros::Scheduler* sched, coros::ComputeMode mode, const char* name) {
+  coros::Coroutine* c = coros::Coroutine::Self();
+  sched->SetComputeMode(mode);
+  coros::ComputeStats before = sched->GetComputeStats();
+
+  int sections = static_cast<int>(kWorkUs / kCoros / (kSectionUs > 0 ? kSectionUs : 1));
+  auto start = std::chrono::steady_clock::now();
+  n_running = kCoros;
+  for (int i = 0; i < kCoros; i++) {
+    coros::Coroutine::Create(sched, std::bind(SectionFn<kSectionUs>, sections), ExitFn);
+  }
+  done_cond.Wait(c);
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+  coros::ComputeStats after = sched->GetComputeStats();
+  MALOG_INFO(kSectionUs << "us sections, " << name << ": "
+             << (static_cast<long long>(sections) * kCoros * 1000000 / (elapsed > 0 ? elapsed : 1)) << " sections/s"
+             << ", inlined=" << (after.inlined - before.inlined)
+             << ", offloaded=" << (after.offloaded - before.offloaded));
+}
+
+template <long kSectionUs>
+void Compare(coros::Scheduler* sched) {
+  Bench<kSectionUs>(sched, coros::COMPUTE_OFFLOAD, "offload");
+  Bench<kSectionUs>(sched, coros::COMPUTE_ADAPTIVE, "adaptive");
+}
+
+void MainFn(coros::Scheduler* sched) {
+  Compare<1>(sched);
+  Compare<10>(sched);
+  Compare<100>(sched);
+  Compare<1000>(sched);
+  sched->Stop();
+}
+
+int main(int argc, char** argv) {
+  coros::Scheduler sched(true);
+  coros::Coroutine::Create(&sched, std::bind(MainFn, &sched), ExitFn);
+  sched.Run();
+  return 0;
+}
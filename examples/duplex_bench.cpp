@@ -0,0 +1,133 @@
+#include "coros.h"
+#include "malog.h"
+#include <chrono>
+#include <string.h>
+#include <netinet/tcp.h>
+
+// Pipelined request/response over one connection to an echo server: a
+// single coroutine in lock step or in batches, against a writer and a
+// reader coroutine sharing the Socket
+static const int kMessages = 200000;
+static const int kLen = 64;
+static const int kWindow = 64;
+static const int kBasePort = 9330;
+
+int next_port = kBasePort;
+
+void ExitFn(coros::Coroutine* c) {
+}
+
+// Nagle would hold back the echoes behind delayed ACKs
+void NoDelay(coros::Socket* s) {
+  int on = 1;
+  setsockopt(s->GetSocket(), IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+}
+
+void EchoFn(int port) {
+  coros::Socket l;
+  l.ListenByIp("127.0.0.1", port);
+  coros::Socket s(l.Accept());
+  l.Close();
+  NoDelay(&s);
+  static char buf[64 * 1024];
+  for (;;) {
+    int n = s.ReadSome(buf, sizeof(buf));
+    if (n <= 0 || s.WriteExactly(buf, n) != n) {
+      break;
+    }
+  }
+  s.Close();
+}
+
+// Reads exactly len bytes
+bool ReadAll(coros::Socket* s, char* buf, int len) {
+  int size = 0;
+  while (size < len) {
+    int n = s->ReadSome(buf + size, len - size);
+    if (n <= 0) {
+      return false;
+    }
+    size += n;
+  }
+  return true;
+}
+
+int64_t RunBatched(coros::Socket* s, int window) {
+  static char out[kWindow * kLen];
+  static char in[kWindow * kLen];
+  int64_t done = 0;
+  while (done < kMessages) {
+    int len = window * kLen;
+    if (s->WriteExactly(out, len) != len || !ReadAll(s, in, len)) {
+      break;
+    }
+    done += window;
+  }
+  return done;
+}
+
+int64_t RunDuplex(coros::Socket* s) {
+  coros::Coroutine* c = coros::Coroutine::Self();
+  bool written = false;
+  coros::Condition written_cond;
+  // Same scheduler as the reader: both are woken from the socket's loop
+  coros::Coroutine* writer = coros::Coroutine::Create(c->GetScheduler(), [&]() {
+    static char out[kWindow * kLen];
+    for (int i = 0; i < kMessages; i += kWindow) {
+      if (s->WriteExactly(out, sizeof(out)) != sizeof(out)) {
+        break;
+      }
+    }
+    written = true;
+    written_cond.NotifyAll();
+  }, ExitFn);
+  writer->SetPinned(true);
+
+  static char in[64 * 1024];
+  int64_t received = 0;
+  while (received < static_cast<int64_t>(kMessages) * kLen) {
+    int n = s->ReadSome(in, sizeof(in));
+    if (n <= 0) {
+      break;
+    }
+    received += n;
+  }
+  while (!written) {
+    written_cond.Wait(c);
+  }
+  return received / kLen;
+}
+
+void Bench(coros::Scheduler* sched, const char* name, int window) {
+  coros::Coroutine* c = coros::Coroutine::Self();
+  int port = next_port ++;
+  coros::Coroutine::Create(sched, std::bind(EchoFn, port), ExitFn);
+  c->Nice(); // let it listen
+
+  coros::Socket s;
+  if (!s.ConnectIp("127.0.0.1", port)) {
+    MALOG_ERROR(name << ": connect failed");
+    return;
+  }
+  NoDelay(&s);
+  auto start = std::chrono::steady_clock::now();
+  int64_t n = window > 0 ? RunBatched(&s, window) : RunDuplex(&s);
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  MALOG_INFO(name << ": " << n << " messages, " << (n * 1000000 / (elapsed > 0 ? elapsed : 1)) << " per second");
+  s.Close();
+}
+
+void MainFn(coros::Scheduler* sched) {
+  coros::Coroutine::Self()->SetPinned(true);
+  Bench(sched, "lock step", 1);
+  Bench(sched, "batched  ", kWindow);
+  Bench(sched, "duplex   ", 0);
+  sched->Stop();
+}
+
+int main(int argc, char** argv) {
+  coros::Scheduler sched(true);
+  coros::Coroutine::Create(&sched, std::bind(MainFn, &sched), ExitFn);
+  sched.Run();
+  return 0;
+}
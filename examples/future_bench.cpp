@@ -0,0 +1,87 @@
+#include "coros.h"
+#include "malog.h"
+#include <chrono>
+
+// A request handler fanning out to backends on other schedulers and
+// waiting for every reply: Coroutine::Create with a WaitGroup and a results
+// array, as before Future, against Spawn and WhenAll, and WhenAny for the
+// first reply
+static const int kThreads = 4;
+static const int kRounds = 20000;
+
+void ExitFn(coros::Coroutine* c) {
+}
+
+// Stands in for a backend call; the reply is all that matters here
+int Backend(int i) {
+  return i;
+}
+
+void CallFn(int i, int* result, coros::WaitGroup* wg) {
+  *result = Backend(i);
+  wg->Done();
+}
+
+int64_t FanOutWaitGroup(coros::Schedulers* scheds, int n) {
+  std::vector<int> results(n);
+  coros::WaitGroup wg;
+  wg.Add(n);
+  for (int i = 0; i < n; i++) {
+    coros::Coroutine::Create(scheds->GetNext(), std::bind(CallFn, i, &results[i], &wg), ExitFn);
+  }
+  wg.Wait();
+  int64_t sum = 0;
+  for (int i = 0; i < n; i++) {
+    sum += results[i];
+  }
+  return sum;
+}
+
+int64_t FanOutFutures(coros::Schedulers* scheds, int n, bool any) {
+  std::vector<coros::Future<int> > futures;
+  futures.reserve(n);
+  for (int i = 0; i < n; i++) {
+    futures.push_back(coros::Spawn(scheds, std::bind(Backend, i)));
+  }
+  if (any) {
+    return futures[coros::WhenAny(futures)].Get();
+  }
+  coros::WhenAll(futures);
+  int64_t sum = 0;
+  for (int i = 0; i < n; i++) {
+    sum += futures[i].Get();
+  }
+  return sum;
+}
+
+void Bench(coros::Schedulers* scheds, const char* name, int n, int how) {
+  int64_t expect = static_cast<int64_t>(n) * (n - 1) / 2;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < kRounds; r++) {
+    int64_t sum = how == 0 ? FanOutWaitGroup(scheds, n) : FanOutFutures(scheds, n, how == 2);
+    if (how != 2 && sum != expect) {
+      MALOG_ERROR(name << ": wrong sum " << sum);
+      return;
+    }
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  MALOG_INFO(name << " x" << n << ": " << (static_cast<double>(elapsed) / kRounds) << " us per fan-out");
+}
+
+void MainFn(coros::Scheduler* sched) {
+  coros::Schedulers scheds(kThreads);
+  for (int n : { 10, 50 }) {
+    Bench(&scheds, "Create+WaitGroup", n, 0);
+    Bench(&scheds, "Spawn+WhenAll   ", n, 1);
+    Bench(&scheds, "Spawn+WhenAny   ", n, 2);
+  }
+  scheds.Stop();
+  sched->Stop();
+}
+
+int main(int argc, char** argv) {
+  coros::Scheduler sched(true);
+  coros::Coroutine::Create(&sched, std::bind(MainFn, &sched), ExitFn);
+  sched.Run();
+  return 0;
+}
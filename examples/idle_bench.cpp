@@ -0,0 +1,50 @@
+#include "coros.h"
+#include "malog.h"
+#include <chrono>
+
+static const int kTicks = 10000;
+static const int kIdle[] = { 0, 1000, 10000, 100000 };
+
+coros::Condition idle_cond;
+
+void IdleFn() {
+  coros::Coroutine* c = coros::Coroutine::Self();
+  idle_cond.Wait(c);
+}
+
+void ExitFn(coros::Coroutine* c) {
+}
+
+void Bench(coros::Scheduler* sched, int idle) {
+  coros::Coroutine* c = coros::Coroutine::Self();
+  for (int i = 0; i < idle; i++) {
+    coros::Coroutine::Create(sched, IdleFn, ExitFn, 0, 16 * 1024);
+  }
+  c->Wait(1); // let them all park
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kTicks; i++) {
+    c->Wait(0); // one loop iteration per tick
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  MALOG_INFO(idle << " idle coroutines: " << (elapsed / kTicks) << " ns per loop iteration");
+
+  idle_cond.NotifyAll();
+  c->Wait(1);
+}
+
+void MainFn(coros::Scheduler* sched) {
+  for (auto idle : kIdle) {
+    Bench(sched, idle);
+  }
+  sched->Stop();
+}
+
+int main(int argc, char** argv) {
+  coros::Scheduler sched(true);
+  // 100k guarded stacks would exceed the default vm.max_map_count
+  sched.GetStackPool().SetGuardPages(false);
+  coros::Coroutine::Create(&sched, std::bind(MainFn, &sched), ExitFn);
+  sched.Run();
+  return 0;
+}
@@ -0,0 +1,61 @@
+#include "coros.h"
+#include "malog.h"
+#include <chrono>
+#include <cmath>
+#include <string>
+
+// A CPU-heavy request: one BeginCompute section on a single core, against
+// ParallelReduce over compute pools of 1, 2, 4... threads, up to the
+// hardware's or argv[1]
+static const std::size_t kItems = 20000000;
+static const std::size_t kGrain = 100000;
+
+void ExitFn(coros::Coroutine* c) {
+}
+
+double Work(std::size_t begin, std::size_t end) {
+  double sum = 0;
+  for (std::size_t i = begin; i < end; i++) {
+    sum += std::sqrt(static_cast<double>(i));
+  }
+  return sum;
+}
+
+double Plus(double a, double b) {
+  return a + b;
+}
+
+int64_t Elapsed(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+void MainFn(coros::Scheduler* sched, int max_threads) {
+  coros::Coroutine* c = coros::Coroutine::Self();
+  auto start = std::chrono::steady_clock::now();
+  c->BeginCompute();
+  double expect = Work(0, kItems);
+  c->EndCompute();
+  int64_t single = Elapsed(start);
+  MALOG_INFO("BeginCompute      : " << single / 1000 << " ms");
+
+  for (int n = 1; n <= max_threads; n *= 2) {
+    coros::Executor* pool = coros::Executor::Configure("parallel_bench" + std::to_string(n), n, n);
+    start = std::chrono::steady_clock::now();
+    double sum = coros::ParallelReduce(0, kItems, kGrain, 0.0, Work, Plus, pool);
+    int64_t elapsed = Elapsed(start);
+    if (std::fabs(sum - expect) > expect * 1e-9) {
+      MALOG_ERROR("ParallelReduce: wrong sum " << sum);
+    }
+    MALOG_INFO("ParallelReduce x" << n << ": " << elapsed / 1000 << " ms, "
+               << static_cast<double>(single) / (elapsed > 0 ? elapsed : 1) << "x");
+  }
+  sched->Stop();
+}
+
+int main(int argc, char** argv) {
+  int max_threads = argc > 1 ? atoi(argv[1]) : static_cast<int>(std::thread::hardware_concurrency());
+  coros::Scheduler sched(true);
+  coros::Coroutine::Create(&sched, std::bind(MainFn, &sched, max_threads > 1 ? max_threads : 1), ExitFn);
+  sched.Run();
+  return 0;
+}
@@ -13,6 +13,9 @@ std::string host = "127.0.0.1";
 int port = 9090;
 int clients = 100;
 int threads = 2;
+bool stealing = false;
+coros::IoBackend backend = coros::IO_BACKEND_POLL;
+coros::Placement placement = coros::PLACEMENT_ROUND_ROBIN;
 
 std::string GetId(coros::Coroutine* c) {
   std::stringstream ss;
@@ -87,8 +90,11 @@ void ListenerFn(coros::Schedulers* scheds) {
 }
 
 void usage() {
-  MALOG_INFO("usage: pingpong -c 127.0.0.1 -p 9090 -n 100 -t 2");
-  MALOG_INFO("       pingpong -d -p 9090 -t 2");
+  MALOG_INFO("usage: pingpong -c 127.0.0.1 -p 9090 -n 100 -t 2 [-s] [-u]");
+  MALOG_INFO("       pingpong -d -p 9090 -t 2 [-s] [-u]");
+  MALOG_INFO("       -s: enable work stealing between scheduler threads");
+  MALOG_INFO("       -u: io_uring socket backend (Linux), falls back to poll");
+  MALOG_INFO("       -b rr|ll|p2c: placement, round-robin, least-loaded or power-of-two-choices");
 }
 
 void GuardFn(coros::Schedulers* scheds) {
@@ -104,7 +110,8 @@ void GuardFn(coros::Schedulers* scheds) {
     nsecs ++;
     std::size_t in = in_bytes;
     std::size_t out = out_bytes;
-    MALOG_INFO("in=" << (in / nsecs) << " bytes per second, out=" << (out / nsecs) << " bytes per second");
+    MALOG_INFO("in=" << (in / nsecs) << " bytes per second, out=" << (out / nsecs) << " bytes per second"
+               << ", steals=" << (scheds->GetSteals() / nsecs) << " per second");
   }
 }
 
@@ -138,6 +145,25 @@ int main(int argc, char** argv) {
         usage();
         exit(1);
       }
+    } else if (arg == "-s") {
+      stealing = true;
+    } else if (arg == "-u") {
+      backend = coros::IO_BACKEND_URING;
+    } else if (arg == "-b") {
+      if (argc > i + 1) {
+        i ++;
+        std::string policy = argv[i];
+        if (policy == "ll") {
+          placement = coros::PLACEMENT_LEAST_LOADED;
+        } else if (policy == "p2c") {
+          placement = coros::PLACEMENT_TWO_CHOICES;
+        } else {
+          placement = coros::PLACEMENT_ROUND_ROBIN;
+        }
+      } else {
+        usage();
+        exit(1);
+      }
     } else if (arg == "-t") {
       if (argc > i + 1) {
         i ++;
@@ -150,7 +176,12 @@ int main(int argc, char** argv) {
   }
 
   coros::Scheduler sched(true);
-  coros::Schedulers scheds(threads);
+  if (!sched.SetIoBackend(backend)) {
+    MALOG_INFO("io_uring unavailable, using poll");
+  }
+  coros::Schedulers scheds(threads, backend);
+  scheds.SetStealing(stealing);
+  scheds.SetPlacement(placement);
 
   if (is_server) {
     MALOG_INFO("Start pingpoing server");
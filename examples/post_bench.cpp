@@ -0,0 +1,66 @@
+#include "coros.h"
+#include "malog.h"
+#include <chrono>
+
+static const int kPosts = 200000;
+static const int kWindow = 4096; // bound in-flight coroutines so stacks recycle
+static const int kProducers[] = { 1, 2, 4, 8, 16, 32 };
+
+std::atomic<int> remaining(0);
+std::atomic<int> in_flight(0);
+
+void EmptyFn() {
+}
+
+void DoneFn(coros::Coroutine* c) {
+  in_flight --;
+  remaining --;
+}
+
+void ExitFn(coros::Coroutine* c) {
+}
+
+// Runs on a producer scheduler, creating coroutines that run on `target`
+void ProducerFn(coros::Scheduler* target, int n) {
+  coros::Coroutine* c = coros::Coroutine::Self();
+  c->GetScheduler()->GetStackPool().SetWatermarks(kWindow, 2 * kWindow);
+  for (int i = 0; i < n; i++) {
+    while (in_flight > kWindow) {
+      c->Wait(0);
+    }
+    in_flight ++;
+    coros::Coroutine::Create(target, EmptyFn, DoneFn, 0, 16 * 1024);
+  }
+}
+
+void Bench(coros::Scheduler* sched, int producers) {
+  coros::Coroutine* c = coros::Coroutine::Self();
+  coros::Schedulers scheds(producers);
+  remaining = kPosts;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < producers; i++) {
+    coros::Coroutine::Create(scheds.GetNext(), std::bind(ProducerFn, sched, kPosts / producers + (i < kPosts % producers ? 1 : 0)), ExitFn);
+  }
+  while (remaining > 0) {
+    c->Wait(1);
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  MALOG_INFO(producers << " producers: " << (kPosts * 1000000LL / (elapsed + 1)) << " posts per second");
+
+  scheds.Stop();
+}
+
+void MainFn(coros::Scheduler* sched) {
+  for (auto producers : kProducers) {
+    Bench(sched, producers);
+  }
+  sched->Stop();
+}
+
+int main(int argc, char** argv) {
+  coros::Scheduler sched(true);
+  coros::Coroutine::Create(&sched, std::bind(MainFn, &sched), ExitFn);
+  sched.Run();
+  return 0;
+}
@@ -0,0 +1,102 @@
+#include "coros.h"
+#include "malog.h"
+#include <sys/socket.h>
+#include <sstream>
+
+int listen_port = 9000;
+std::string upstream_ip = "127.0.0.1";
+int upstream_port = 9090;
+int threads = 2;
+
+std::string GetId(coros::Coroutine* c) {
+  std::stringstream ss;
+  ss << "coro[" << c->GetId() << "]";
+  return ss.str();
+}
+
+void ExitFn(coros::Coroutine* c) {
+}
+
+// Upstream to client; client to upstream runs in ConnFn on the same two
+// Sockets, each has a reader in one coroutine and a writer in the other
+void RelayFn(coros::Socket* from, coros::Socket* to, bool* done, coros::Condition* done_cond) {
+  from->Splice(to);
+  shutdown(to->GetSocket(), SHUT_WR); // pass the EOF on
+  *done = true;
+  done_cond->NotifyAll();
+}
+
+void ConnFn(uv_os_sock_t fd) {
+  coros::Coroutine* c = coros::Coroutine::Self();
+  c->SetPinned(true); // stays with the relay on the sockets' loop
+  std::string id = GetId(c);
+
+  coros::Socket client(fd);
+  coros::Socket upstream;
+  if (!upstream.ConnectIp(upstream_ip, upstream_port)) {
+    MALOG_ERROR(id << ": connect upstream " << upstream_ip << ":" << upstream_port << " failed");
+    client.Close();
+    return;
+  }
+  bool relayed = false;
+  coros::Condition relayed_cond;
+  coros::Coroutine* relay = coros::Coroutine::Create(c->GetScheduler(), std::bind(RelayFn, &upstream, &client, &relayed, &relayed_cond), ExitFn);
+  relay->SetPinned(true);
+  int64_t n = client.Splice(&upstream);
+  shutdown(upstream.GetSocket(), SHUT_WR);
+  MALOG_INFO(id << ": relayed " << n << " bytes upstream");
+  while (!relayed) {
+    relayed_cond.Wait(c);
+  }
+  client.Close();
+  upstream.Close();
+}
+
+void ListenerFn(coros::Schedulers* scheds) {
+  coros::Socket s;
+  if (!s.ListenByIp("0.0.0.0", listen_port)) {
+    MALOG_ERROR("listen on " << listen_port << " failed");
+    return;
+  }
+  MALOG_INFO("proxy 0.0.0.0:" << listen_port << " -> " << upstream_ip << ":" << upstream_port);
+  for (;;) {
+    uv_os_sock_t s_new = s.Accept();
+    if (s_new == BAD_SOCKET) {
+      break;
+    }
+    coros::Coroutine::Create(scheds->GetNext(), std::bind(ConnFn, s_new), ExitFn);
+  }
+}
+
+void usage() {
+  MALOG_INFO("usage: proxy -l 9000 -u 127.0.0.1 -p 9090 -t 2");
+}
+
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (argc <= i + 1) {
+      usage();
+      exit(1);
+    }
+    i ++;
+    if (arg == "-l") {
+      listen_port = atoi(argv[i]);
+    } else if (arg == "-u") {
+      upstream_ip = argv[i];
+    } else if (arg == "-p") {
+      upstream_port = atoi(argv[i]);
+    } else if (arg == "-t") {
+      threads = atoi(argv[i]);
+    } else {
+      usage();
+      exit(1);
+    }
+  }
+
+  coros::Scheduler sched(true);
+  coros::Schedulers scheds(threads);
+  coros::Coroutine::Create(&sched, std::bind(ListenerFn, &scheds), ExitFn);
+  sched.Run();
+  return 0;
+}
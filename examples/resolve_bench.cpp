@@ -0,0 +1,263 @@
+#include "coros.h"
+#include "malog.h"
+#include <chrono>
+#include <fstream>
+#include <string>
+#if !defined(_WIN32)
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+// Connects per second by host name against a local listener and a local
+// stub DNS server: getaddrinfo in a compute section, as ConnectHost did
+// before the Resolver, against the Resolver's /etc/hosts lookup, a query
+// per connect (cold cache), cached answers, and bursts of coroutines asking
+// for one name at once. Then the latency of a name whose first address is
+// blackholed, for a few Happy Eyeballs delays.
+static const int kConnects = 1000;
+static const int kBlackholed = 10;
+static const long kDeadlineMs = 1000;
+static const int kBurst = 50;
+static const char* kHostsFile = "resolve_bench.hosts";
+
+void ExitFn(coros::Coroutine* c) {
+}
+
+uv_os_sock_t Bound(int type, int* port) {
+  uv_os_sock_t s = socket(AF_INET, type, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addrlen = sizeof(addr);
+  if (bind(s, (struct sockaddr*)&addr, addrlen) != 0 || getsockname(s, (struct sockaddr*)&addr, &addrlen) != 0) {
+    MALOG_ERROR("bind failed");
+  }
+  fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+  *port = ntohs(addr.sin_port);
+  return s;
+}
+
+// A for every name: 127.0.0.1 for a minute; AAAA: no data
+void StubServer(uv_os_sock_t fd) {
+  coros::Socket s(fd);
+  unsigned char buf[512];
+  try {
+    for (;;) {
+      struct sockaddr_storage from;
+      socklen_t fromlen = sizeof(from);
+      int n = recvfrom(fd, (char*)buf, sizeof(buf), 0, (struct sockaddr*)&from, &fromlen);
+      if (n < 0) {
+        if (s.WaitReadable() != coros::EVENT_READABLE) {
+          break;
+        }
+        continue;
+      }
+      int end = 12;
+      while (end < n && buf[end] != 0) {
+        end += buf[end] + 1;
+      }
+      end += 5; // root label, type and class
+      if (end > n) {
+        continue;
+      }
+      std::string reply((const char*)buf, end);
+      reply[2] = (char)0x81; // response, recursion desired
+      reply[3] = (char)0x80; // recursion available
+      if (buf[end - 3] == 1) { // A
+        const unsigned char answer[] = { 0xc0, 12, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 127, 0, 0, 1 };
+        reply[7] = 1;
+        reply.append((const char*)answer, sizeof(answer));
+      }
+      sendto(fd, reply.data(), reply.size(), 0, (struct sockaddr*)&from, fromlen);
+    }
+  } catch (coros::Unwind&) {
+    s.Close();
+    throw;
+  }
+  s.Close();
+}
+
+// Never accepts and its backlog is full, so SYNs to it are dropped
+uv_os_sock_t Blackhole(int port) {
+  uv_os_sock_t s = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  inet_pton(AF_INET, "127.0.0.2", &addr.sin_addr);
+  if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(s, 0) != 0) {
+    MALOG_ERROR("blackhole bind failed");
+  }
+  for (int i = 0; i < 2; i++) {
+    uv_os_sock_t c = socket(AF_INET, SOCK_STREAM, 0);
+    fcntl(c, F_SETFL, fcntl(c, F_GETFL, 0) | O_NONBLOCK);
+    connect(c, (struct sockaddr*)&addr, sizeof(addr)); // left open, they fill the backlog
+  }
+  return s;
+}
+
+void Acceptor(coros::Socket* listener) {
+  for (;;) {
+    uv_os_sock_t s = listener->Accept();
+    if (s == BAD_SOCKET) {
+      break;
+    }
+    close(s);
+  }
+}
+
+bool ConnectGetaddrinfo(const std::string& host, int port) {
+  struct addrinfo hints, *result;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  coros::Coroutine* self = coros::Coroutine::Self();
+  self->BeginCompute();
+  int rc = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result);
+  self->EndCompute();
+  if (rc != 0) {
+    return false;
+  }
+  char ip[64];
+  inet_ntop(AF_INET, &((struct sockaddr_in*)result->ai_addr)->sin_addr, ip, sizeof(ip));
+  freeaddrinfo(result);
+  coros::Socket s;
+  bool ok = s.ConnectIp(ip, port);
+  s.Close();
+  return ok;
+}
+
+bool ConnectHost(const std::string& host, int port) {
+  coros::Socket s;
+  bool ok = s.ConnectHost(host, port);
+  s.Close();
+  return ok;
+}
+
+void BurstFn(const std::string& host, int port, int* failed, coros::WaitGroup* wg) {
+  if (!ConnectHost(host, port)) {
+    (*failed)++;
+  }
+  wg->Done();
+}
+
+void Bench(coros::Scheduler* sched, const char* name, int port, int how) {
+  coros::Resolver* resolver = coros::Resolver::Default();
+  coros::ResolverStats before = resolver->GetStats();
+  int failed = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kConnects; ) {
+    switch (how) {
+    case 0:
+      failed += !ConnectGetaddrinfo("localhost", port);
+      i++;
+      break;
+    case 1:
+      failed += !ConnectHost("bench.local", port);
+      i++;
+      break;
+    case 2:
+      resolver->Clear();
+      failed += !ConnectHost("bench.test", port);
+      i++;
+      break;
+    case 3:
+      failed += !ConnectHost("bench.test", port);
+      i++;
+      break;
+    default: {
+      resolver->Clear();
+      coros::WaitGroup wg;
+      wg.Add(kBurst);
+      for (int k = 0; k < kBurst; k++) {
+        coros::Coroutine::Create(sched, std::bind(BurstFn, std::string("bench.test"), port, &failed, &wg), ExitFn);
+      }
+      wg.Wait();
+      i += kBurst;
+      break;
+    }
+    }
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  coros::ResolverStats after = resolver->GetStats();
+  if (failed) {
+    MALOG_ERROR(name << ": " << failed << " connects failed");
+  }
+  MALOG_INFO(name << ": " << (static_cast<int64_t>(kConnects) * 1000000 / (elapsed > 0 ? elapsed : 1))
+             << " connects per second, " << (after.queries - before.queries) << " queries");
+}
+
+void BenchBlackholed(int port, long delay_ms) {
+  int failed = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kBlackholed; i++) {
+    coros::Socket s;
+    s.SetDeadlineMs(kDeadlineMs);
+    s.SetConnectDelayMs(delay_ms);
+    failed += !s.ConnectHost("blackholed.local", port);
+    s.Close();
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  MALOG_INFO("blackholed first, delay " << delay_ms << " ms: " << elapsed / kBlackholed / 1000
+             << " ms per connect, " << failed << " of " << kBlackholed << " failed");
+}
+
+void MainFn(coros::Scheduler* sched) {
+  coros::Coroutine* self = coros::Coroutine::Self();
+  self->SetPinned(true);
+
+  int dns_port;
+  coros::Coroutine* stub = coros::Coroutine::Create(sched, std::bind(StubServer, Bound(SOCK_DGRAM, &dns_port)), ExitFn);
+  stub->SetPinned(true);
+  coros::Socket listener;
+  if (!listener.ListenByIp("127.0.0.1", 0)) {
+    MALOG_ERROR("listen failed");
+    sched->Stop();
+    return;
+  }
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  getsockname(listener.GetSocket(), (struct sockaddr*)&addr, &addrlen);
+  int port = ntohs(addr.sin_port);
+  coros::Coroutine::Create(sched, std::bind(Acceptor, &listener), ExitFn)->SetPinned(true);
+
+  Blackhole(port);
+  std::ofstream(kHostsFile) << "127.0.0.1 bench.local\n127.0.0.2 blackholed.local\n127.0.0.1 blackholed.local\n";
+  coros::Resolver* resolver = coros::Resolver::Default();
+  resolver->LoadHosts(kHostsFile);
+  resolver->SetNameservers({ "127.0.0.1:" + std::to_string(dns_port) });
+
+  Bench(sched, "getaddrinfo      ", port, 0);
+  Bench(sched, "Resolver, hosts  ", port, 1);
+  Bench(sched, "Resolver, cold   ", port, 2);
+  Bench(sched, "Resolver, cached ", port, 3);
+  Bench(sched, "Resolver, bursts ", port, 4);
+
+  coros::ResolverStats stats = resolver->GetStats();
+  MALOG_INFO("lookups " << stats.lookups << ", hits " << stats.hits << ", coalesced " << stats.coalesced
+             << ", queries " << stats.queries << ", failures " << stats.failures << ", hit rate "
+             << (stats.hits + stats.coalesced) * 100 / (stats.lookups > 0 ? stats.lookups : 1) << "%");
+
+  // A delay as long as the deadline never gets to the second address
+  BenchBlackholed(port, kDeadlineMs);
+  BenchBlackholed(port, 250);
+  BenchBlackholed(port, 50);
+
+  stub->Cancel();
+  listener.Close();
+  self->Wait(10);
+  unlink(kHostsFile);
+  sched->Stop();
+}
+
+int main(int argc, char** argv) {
+  coros::Scheduler sched(true);
+  coros::Coroutine::Create(&sched, std::bind(MainFn, &sched), ExitFn);
+  sched.Run();
+  return 0;
+}
@@ -0,0 +1,48 @@
+#include "coros.h"
+#include "malog.h"
+#include <chrono>
+#include <vector>
+
+// coros::FindByte against a byte-at-a-time loop, splitting a buffer of
+// lines of a fixed length
+static const int kBufferSize = 1 << 20;
+static const int kRounds = 200;
+
+const char* NaiveFind(const char* p, const char* end, char c) {
+  for (; p < end; p++) {
+    if (*p == c) {
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+template <typename Find>
+void Bench(const std::vector<char>& buf, int line_len, Find find, const char* name) {
+  auto start = std::chrono::steady_clock::now();
+  std::size_t lines = 0;
+  for (int r = 0; r < kRounds; r++) {
+    const char* p = buf.data();
+    const char* end = p + buf.size();
+    while (const char* hit = find(p, end, '\n')) {
+      lines ++;
+      p = hit + 1;
+    }
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  MALOG_INFO(line_len << " byte lines, " << name << ": "
+             << (static_cast<long long>(buf.size()) * kRounds / (elapsed > 0 ? elapsed : 1)) << " MB/s, "
+             << (lines / kRounds) << " lines");
+}
+
+int main(int argc, char** argv) {
+  for (int line_len : { 8, 32, 128, 1024 }) {
+    std::vector<char> buf(kBufferSize, 'x');
+    for (int i = line_len - 1; i < kBufferSize; i += line_len) {
+      buf[i] = '\n';
+    }
+    Bench(buf, line_len, NaiveFind, "naive");
+    Bench(buf, line_len, coros::FindByte, "FindByte");
+  }
+  return 0;
+}
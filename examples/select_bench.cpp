@@ -0,0 +1,99 @@
+#include "coros.h"
+#include "malog.h"
+#include <chrono>
+
+// One consumer taking ints from several producers, each with its own
+// Channel: a forwarding coroutine per channel into one merged Channel, as
+// before Select, against a Select over all of them
+static const int kProducers = 8;
+static const int kItems = 250000; // per producer
+static const int kCapacity = 256;
+
+void ExitFn(coros::Coroutine* c) {
+}
+
+void Producer(coros::Channel<int>* ch) {
+  for (int i = 0; i < kItems; i++) {
+    ch->Send(i);
+  }
+}
+
+void Forwarder(coros::Channel<int>* from, coros::Channel<int>* to) {
+  int item;
+  for (int i = 0; i < kItems && from->Recv(item); i++) {
+    to->Send(item);
+  }
+}
+
+int64_t ConsumeMerged(coros::Channel<int>* merged) {
+  int64_t sum = 0;
+  int item;
+  for (int64_t i = 0; i < static_cast<int64_t>(kProducers) * kItems && merged->Recv(item); i++) {
+    sum += item;
+  }
+  return sum;
+}
+
+int64_t ConsumeSelect(coros::Channel<int>** chs) {
+  coros::Select sel;
+  for (int i = 0; i < kProducers; i++) {
+    sel.Received(chs[i]);
+  }
+  int64_t sum = 0;
+  int64_t left = static_cast<int64_t>(kProducers) * kItems;
+  while (left > 0) {
+    sel.Wait();
+    for (int i = 0; i < kProducers; i++) {
+      int item;
+      while (sel.Fired(i) && chs[i]->TryRecv(item)) {
+        sum += item;
+        left --;
+      }
+    }
+  }
+  return sum;
+}
+
+void Bench(coros::Scheduler* sched, const char* name, coros::Scheduler* producers, bool select) {
+  bool local = producers == sched;
+  coros::Channel<int>* chs[kProducers];
+  for (int i = 0; i < kProducers; i++) {
+    chs[i] = new coros::Channel<int>(kCapacity, local);
+  }
+  coros::Channel<int> merged(kCapacity, local);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kProducers; i++) {
+    coros::Coroutine::Create(producers, std::bind(Producer, chs[i]), ExitFn)->SetPinned(true);
+    if (!select) {
+      coros::Coroutine::Create(sched, std::bind(Forwarder, chs[i], &merged), ExitFn)->SetPinned(true);
+    }
+  }
+  int64_t sum = select ? ConsumeSelect(chs) : ConsumeMerged(&merged);
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  int64_t n = static_cast<int64_t>(kProducers) * kItems;
+  if (sum != kProducers * (static_cast<int64_t>(kItems) * (kItems - 1) / 2)) {
+    MALOG_ERROR(name << ": wrong sum " << sum);
+  }
+  MALOG_INFO(name << ": " << (n * 1000000 / (elapsed > 0 ? elapsed : 1)) << " items per second");
+  for (int i = 0; i < kProducers; i++) {
+    delete chs[i];
+  }
+}
+
+void MainFn(coros::Scheduler* sched) {
+  coros::Coroutine::Self()->SetPinned(true);
+  coros::Schedulers scheds(1);
+  Bench(sched, "local, forwarders", sched, false);
+  Bench(sched, "local, Select     ", sched, true);
+  Bench(sched, "cross, forwarders", scheds.GetNext(), false);
+  Bench(sched, "cross, Select     ", scheds.GetNext(), true);
+  scheds.Stop();
+  sched->Stop();
+}
+
+int main(int argc, char** argv) {
+  coros::Scheduler sched(true);
+  coros::Coroutine::Create(&sched, std::bind(MainFn, &sched), ExitFn);
+  sched.Run();
+  return 0;
+}
@@ -0,0 +1,52 @@
+#include "coros.h"
+#include "malog.h"
+#include <chrono>
+
+static const int kRounds = 200;
+static const int kBatch = 1000;
+
+void TouchFn() {
+  // Touch a few pages like a real connection handler would
+  volatile char buf[16 * 1024];
+  for (std::size_t i = 0; i < sizeof(buf); i += 4096) {
+    buf[i] = 0;
+  }
+}
+
+void ExitFn(coros::Coroutine* c) {
+}
+
+void Bench(coros::Scheduler* sched, bool pooled, unsigned profile_rate) {
+  coros::Coroutine* c = coros::Coroutine::Self();
+  sched->GetStackPool().SetEnabled(pooled);
+  sched->GetStackPool().SetProfileRate(profile_rate);
+  sched->GetStackPool().SetWatermarks(kBatch / 2, kBatch);
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kRounds; i++) {
+    for (int j = 0; j < kBatch; j++) {
+      coros::Coroutine::Create(sched, TouchFn, ExitFn);
+    }
+    c->Nice(); // let the batch run and be destroyed
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+  coros::StackPoolStats stats = sched->GetStackPool().GetStats();
+  MALOG_INFO((pooled ? "pool on:  " : "pool off: ") << (kRounds * kBatch * 1000000LL / (elapsed + 1)) << " create/destroy per second"
+             << ", hits=" << stats.hits << ", misses=" << stats.misses << ", cached=" << stats.cached
+             << ", profiled=" << stats.profiled << ", max stack used=" << stats.max_used);
+}
+
+void MainFn(coros::Scheduler* sched) {
+  Bench(sched, false, 0);
+  Bench(sched, true, 0);
+  Bench(sched, true, 64);
+  sched->Stop();
+}
+
+int main(int argc, char** argv) {
+  coros::Scheduler sched(true);
+  coros::Coroutine::Create(&sched, std::bind(MainFn, &sched), ExitFn);
+  sched.Run();
+  return 0;
+}
@@ -0,0 +1,65 @@
+#include "coros.h"
+#include "malog.h"
+#include <chrono>
+
+// Lock/unlock rates for coros::Mutex against std::mutex, uncontended and
+// with coroutines on several schedulers contending; std::mutex blocks the
+// whole scheduler thread while coros::Mutex parks only the coroutine
+static const int kOps = 2000000;
+static const int kThreads = 4;
+static const int kCoroutines = 64;
+
+void ExitFn(coros::Coroutine* c) {
+}
+
+template<typename M>
+void LockFn(M* m, int64_t* counter, int n, coros::WaitGroup* wg) {
+  for (int i = 0; i < n; i++) {
+    m->lock();
+    (*counter) ++;
+    m->unlock();
+  }
+  wg->Done();
+}
+
+// std::mutex's lowercase names, so LockFn takes either
+struct CorosMutex {
+  coros::Mutex m;
+  void lock() { m.Lock(); }
+  void unlock() { m.Unlock(); }
+};
+
+template<typename M>
+void Bench(coros::Schedulers* scheds, const char* name, int coroutines) {
+  M m;
+  int64_t counter = 0;
+  coros::WaitGroup wg;
+  wg.Add(coroutines);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < coroutines; i++) {
+    coros::Coroutine::Create(scheds->GetNext(), std::bind(LockFn<M>, &m, &counter, kOps / coroutines, &wg), ExitFn);
+  }
+  wg.Wait();
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  if (counter != static_cast<int64_t>(kOps / coroutines) * coroutines) {
+    MALOG_ERROR(name << ": lost updates, " << counter);
+  }
+  MALOG_INFO(name << ": " << (counter * 1000000 / (elapsed > 0 ? elapsed : 1)) << " locks per second");
+}
+
+void MainFn(coros::Scheduler* sched) {
+  coros::Schedulers scheds(kThreads);
+  Bench<std::mutex>(&scheds, "std::mutex   uncontended", 1);
+  Bench<CorosMutex>(&scheds, "coros::Mutex uncontended", 1);
+  Bench<std::mutex>(&scheds, "std::mutex   contended  ", kCoroutines);
+  Bench<CorosMutex>(&scheds, "coros::Mutex contended  ", kCoroutines);
+  scheds.Stop();
+  sched->Stop();
+}
+
+int main(int argc, char** argv) {
+  coros::Scheduler sched(true);
+  coros::Coroutine::Create(&sched, std::bind(MainFn, &sched), ExitFn);
+  sched.Run();
+  return 0;
+}
@@ -0,0 +1,175 @@
+#include "coros.h"
+#include "malog.h"
+#include <chrono>
+#include <unistd.h>
+
+// Socket::SendFile against a pread + WriteExactly loop, and a proxy hop with
+// Socket::Splice against a ReadSome + WriteExactly loop
+static const int64_t kFileSize = 64 << 20;
+static const int kRounds = 4;
+static const int kChunk = 64 * 1024;
+static const int kBasePort = 9310;
+
+int file_fd = -1;
+int next_port = kBasePort;
+int64_t received = 0;
+bool done = false;
+coros::Condition done_cond;
+
+void ExitFn(coros::Coroutine* c) {
+}
+
+void Finish(int64_t n) {
+  received = n;
+  done = true;
+  done_cond.NotifyAll();
+}
+
+// Reads to EOF and discards
+int64_t Drain(coros::Socket* s) {
+  static char buf[kChunk];
+  int64_t total = 0;
+  for (;;) {
+    int n = s->ReadSome(buf, kChunk);
+    if (n <= 0) {
+      break;
+    }
+    total += n;
+  }
+  return total;
+}
+
+void ReceiverFn(int port) {
+  coros::Socket s;
+  if (s.ConnectIp("127.0.0.1", port)) {
+    Finish(Drain(&s));
+  } else {
+    Finish(0);
+  }
+  s.Close();
+}
+
+void SinkFn(int port) {
+  coros::Socket l;
+  l.ListenByIp("127.0.0.1", port);
+  coros::Socket s(l.Accept());
+  l.Close();
+  Finish(Drain(&s));
+  s.Close();
+}
+
+void ProxyFn(int port, int sink_port, bool use_splice) {
+  coros::Socket l;
+  l.ListenByIp("127.0.0.1", port);
+  coros::Socket in(l.Accept());
+  l.Close();
+  coros::Socket out;
+  if (out.ConnectIp("127.0.0.1", sink_port)) {
+    if (use_splice) {
+      in.Splice(&out);
+    } else {
+      static char buf[kChunk];
+      for (;;) {
+        int n = in.ReadSome(buf, kChunk);
+        if (n <= 0 || out.WriteExactly(buf, n) != n) {
+          break;
+        }
+      }
+    }
+  }
+  in.Close();
+  out.Close();
+}
+
+void Report(const char* name, std::chrono::steady_clock::time_point start) {
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  MALOG_INFO(name << ": " << received << " bytes, " << (received / (elapsed > 0 ? elapsed : 1)) << " MB/s");
+}
+
+void WaitDone(coros::Coroutine* c) {
+  while (!done) {
+    done_cond.Wait(c);
+  }
+  done = false;
+}
+
+void BenchSendFile(coros::Scheduler* sched, bool use_sendfile) {
+  coros::Coroutine* c = coros::Coroutine::Self();
+  int port = next_port ++;
+  coros::Socket l;
+  l.ListenByIp("127.0.0.1", port);
+  coros::Coroutine::Create(sched, std::bind(ReceiverFn, port), ExitFn);
+  coros::Socket s(l.Accept());
+
+  auto start = std::chrono::steady_clock::now();
+  static char buf[kChunk];
+  for (int r = 0; r < kRounds; r++) {
+    if (use_sendfile) {
+      s.SendFile(file_fd, 0, kFileSize);
+    } else {
+      for (int64_t off = 0; off < kFileSize; off += kChunk) {
+        int n = static_cast<int>(pread(file_fd, buf, kChunk, off));
+        if (n <= 0 || s.WriteExactly(buf, n) != n) {
+          break;
+        }
+      }
+    }
+  }
+  s.Close();
+  WaitDone(c);
+  Report(use_sendfile ? "sendfile" : "pread+write", start);
+  l.Close();
+}
+
+void BenchProxy(coros::Scheduler* sched, bool use_splice) {
+  coros::Coroutine* c = coros::Coroutine::Self();
+  int sink_port = next_port ++;
+  int proxy_port = next_port ++;
+  coros::Coroutine::Create(sched, std::bind(SinkFn, sink_port), ExitFn);
+  coros::Coroutine::Create(sched, std::bind(ProxyFn, proxy_port, sink_port, use_splice), ExitFn);
+  c->Nice(); // let both listen
+
+  coros::Socket s;
+  s.ConnectIp("127.0.0.1", proxy_port);
+  auto start = std::chrono::steady_clock::now();
+  static char buf[kChunk];
+  for (int64_t sent = 0; sent < kFileSize * kRounds; sent += kChunk) {
+    if (s.WriteExactly(buf, kChunk) != kChunk) {
+      break;
+    }
+  }
+  s.Close();
+  WaitDone(c);
+  Report(use_splice ? "proxy splice" : "proxy copy", start);
+}
+
+void MainFn(coros::Scheduler* sched) {
+  char path[] = "/tmp/transfer_bench.XXXXXX";
+  file_fd = mkstemp(path);
+  if (file_fd < 0) {
+    MALOG_ERROR("mkstemp failed");
+    sched->Stop();
+    return;
+  }
+  unlink(path);
+  static char buf[kChunk];
+  for (int64_t off = 0; off < kFileSize; off += kChunk) {
+    if (write(file_fd, buf, kChunk) != kChunk) {
+      break;
+    }
+  }
+
+  BenchSendFile(sched, false);
+  BenchSendFile(sched, true);
+  BenchProxy(sched, false);
+  BenchProxy(sched, true);
+  close(file_fd);
+  sched->Stop();
+}
+
+int main(int argc, char** argv) {
+  coros::Scheduler sched(true);
+  coros::Coroutine::Create(&sched, std::bind(MainFn, &sched), ExitFn);
+  sched.Run();
+  return 0;
+}
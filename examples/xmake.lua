@@ -18,3 +18,67 @@ target("echo")
 target("pingpong")
     set_kind("binary")
     add_files("pingpong.cpp")
+
+target("stack_bench")
+    set_kind("binary")
+    add_files("stack_bench.cpp")
+
+target("idle_bench")
+    set_kind("binary")
+    add_files("idle_bench.cpp")
+
+target("post_bench")
+    set_kind("binary")
+    add_files("post_bench.cpp")
+
+target("compute_bench")
+    set_kind("binary")
+    add_files("compute_bench.cpp")
+
+target("proxy")
+    set_kind("binary")
+    add_files("proxy.cpp")
+
+target("transfer_bench")
+    set_kind("binary")
+    add_files("transfer_bench.cpp")
+
+target("buffer_bench")
+    set_kind("binary")
+    add_files("buffer_bench.cpp")
+
+target("scan_bench")
+    set_kind("binary")
+    add_files("scan_bench.cpp")
+
+target("duplex_bench")
+    set_kind("binary")
+    add_files("duplex_bench.cpp")
+
+target("coalesce_bench")
+    set_kind("binary")
+    add_files("coalesce_bench.cpp")
+
+target("sync_bench")
+    set_kind("binary")
+    add_files("sync_bench.cpp")
+
+target("channel_bench")
+    set_kind("binary")
+    add_files("channel_bench.cpp")
+
+target("select_bench")
+    set_kind("binary")
+    add_files("select_bench.cpp")
+
+target("future_bench")
+    set_kind("binary")
+    add_files("future_bench.cpp")
+
+target("parallel_bench")
+    set_kind("binary")
+    add_files("parallel_bench.cpp")
+
+target("resolve_bench")
+    set_kind("binary")
+    add_files("resolve_bench.cpp")
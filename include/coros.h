@@ -6,13 +6,20 @@
 #include <uv.h>
 
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <cassert>
 
 #include <atomic>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <map>
+#include <unordered_map>
+#include <memory>
 #include <string>
 #include <mutex>
+#include <type_traits>
 #include <vector>
 #include <thread>
 #include <condition_variable>
@@ -36,6 +43,7 @@ enum State {
   STATE_WAITING = 2,
   STATE_COMPUTE = 3,
   STATE_DONE = 4,
+  STATE_MIGRATING = 5,
 };
 
 enum Event {
@@ -50,12 +58,43 @@ enum Event {
   EVENT_DISCONNECT = 8,
 };
 
+enum Placement {
+  PLACEMENT_ROUND_ROBIN = 0,
+  PLACEMENT_LEAST_LOADED = 1,
+  PLACEMENT_TWO_CHOICES = 2, // least loaded of two random picks
+  PLACEMENT_HASH = 3, // by key, see Schedulers::GetNext(key)
+};
+
+enum ComputeMode {
+  COMPUTE_OFFLOAD = 0, // every section runs on an Executor
+  COMPUTE_ADAPTIVE = 1, // call sites that finish under a threshold run inline
+};
+
+struct ComputeStats {
+  std::size_t inlined{ 0 };
+  std::size_t offloaded{ 0 };
+};
+
+enum IoBackend {
+  IO_BACKEND_POLL = 0, // readiness through the libuv loop
+  IO_BACKEND_URING = 1, // completion-based io_uring, Linux only
+};
+
 class Scheduler;
+class Schedulers;
 class Coroutine;
 class Condition;
+class IoUring;
+struct IoAccept;
+struct IpAddress;
+struct ParallelJob;
 
+// Full duplex: a reader and a writer may block at once, pin both to its scheduler
 class Socket {
+  friend class Coroutine;
   friend class Scheduler;
+  friend class Select;
+  friend class Resolver;
 
 public:
   Socket(uv_os_sock_t s = BAD_SOCKET);
@@ -65,6 +104,12 @@ public:
 
   void SetDeadline(int timeout_secs);
   int GetDeadline();
+  void SetDeadlineMs(long timeout_ms);
+  long GetDeadlineMs();
+  // ConnectHost races the resolved addresses (RFC 8305, Happy Eyeballs):
+  // the next one starts when the earlier have not connected within this
+  // delay or have failed, and the first to connect wins. 250 ms by default.
+  void SetConnectDelayMs(long delay_ms);
 
   bool ListenByHost(const std::string& host, int port, int backlog = 1024);
   bool ListenByIp(const std::string& ip, int port, int backlog = 1024);
@@ -79,16 +124,168 @@ public:
   int WriteSome(const char* buf, int len);
   int WriteExactly(const char* buf, int len);
 
+  // Scatter/gather; one syscall takes at most 64 buffers. WriteAllV consumes
+  // bufs in place (base/len advance), so a caller can resume after an error.
+  int ReadSomeV(uv_buf_t* bufs, int n);
+  int WriteSomeV(const uv_buf_t* bufs, int n);
+  int WriteExactlyV(const uv_buf_t* bufs, int n);
+  int WriteAllV(uv_buf_t* bufs, int n);
+
+  // Kernel-side transfers, both return the bytes moved. SendFile stops short
+  // at end of file; Splice runs until EOF on this socket when len < 0.
+  int64_t SendFile(int fd, int64_t offset, int64_t len);
+  int64_t Splice(Socket* to, int64_t len = -1);
+
+  // MSG_ZEROCOPY for writes of 16 KB and up (Linux), smaller ones are
+  // copied. Without `release` this returns once the kernel is done with the
+  // pages; with it, it returns once queued and release() runs when they are
+  // freed. -1 if the wait is cut short: keep the buffer until WaitZeroCopy()
+  // returns 0.
+  int WriteZeroCopy(const char* buf, int len, std::function<void()> release = nullptr);
+  int WaitZeroCopy();
+
+  // Coalesced writes for many small messages, possibly from several
+  // coroutines on the socket's scheduler. Enqueue copies buf to an outbound
+  // queue without a syscall; the scheduler sends everything queued in a loop
+  // iteration with a few writev calls before it polls. Producers only block
+  // while high_water bytes are queued. Flush() before switching back to
+  // direct writes, Close() sends what is left.
+  int Enqueue(const char* buf, int len);
+  int Flush(); // sends the queue now and waits until it is empty
+  void SetHighWater(std::size_t bytes); // 1 MB by default
+
+  uv_os_sock_t GetSocket() const;
+
   Event WaitReadable(Condition* cond = nullptr);
   Event WaitWritable();
 
+protected:
+  struct ZeroCopy;
+  struct Outbound;
+
+  bool Connect(const struct sockaddr* addr, int addrlen);
+  bool ConnectRace(const std::vector<IpAddress>& addrs, int port);
+  uv_os_sock_t Release(); // stops polling, the descriptor stays open
+  void Link();
+  void Unlink();
+  bool EnableZeroCopy();
+  bool ReapZeroCopy();
+  Event WaitErrQueue();
+  void EnsurePoll();
+  // A Select's case: true if direction is ready now, otherwise self waits
+  // on it as reader_ or writer_ until Unwatch, which tells if it fired
+  bool Watch(int direction, Coroutine* self);
+  bool Unwatch(int direction, Coroutine* self);
+  Outbound* GetOutbound();
+  void SendQueued();
+  void FlushQueued();
+  void DropQueued();
+  Event WaitQueued();
+  bool KeepPoll() const;
+  Event Wait(int direction, Condition* cond);
+  void OnPoll(int status, int events);
+  void UpdatePoll(int interest);
+  void InitPoll();
+  void StopPoll();
+  void ClosePoll();
+  void Rehome();
+
 protected:
   uv_os_sock_t s_;
   uv_poll_t poll_;
-  int timeout_secs_{ 0 };
-  Coroutine* coro_{ nullptr };
+  Scheduler* sched_{ nullptr }; // loop poll_ is registered with
+  long timeout_ms_{ 0 };
+  long connect_delay_ms_{ 250 };
+  Coroutine* coro_{ nullptr }; // the socket is on its list, null once it exits
+  Coroutine* reader_{ nullptr }; // blocked in Wait(UV_READABLE)
+  Coroutine* writer_{ nullptr }; // blocked in Wait(UV_WRITABLE)
+  int ready_{ UV_READABLE | UV_WRITABLE }; // UV_* events seen since the last EAGAIN
+  int interest_{ 0 };
+  bool started_{ false };
+  bool error_{ false };
+  bool poll_inited_{ false }; // not with IO_BACKEND_URING
+  IoAccept* accept_{ nullptr }; // multishot accept, IO_BACKEND_URING only
+  ZeroCopy* zc_{ nullptr }; // after the first WriteZeroCopy
+  Outbound* out_{ nullptr }; // after the first Enqueue
+  Socket* prev_{ nullptr }; // in coro_'s socket list
+  Socket* next_{ nullptr };
+};
+
+// An IPv4 or IPv6 address as the Resolver hands them out
+struct IpAddress {
+  int family{ AF_INET }; // AF_INET or AF_INET6
+  unsigned char bytes[16];
+
+  bool Parse(const std::string& text); // numeric only
+  socklen_t ToSockaddr(int port, struct sockaddr_storage* addr) const;
+  std::string ToString() const;
+};
+
+struct ResolverStats {
+  std::size_t lookups{ 0 };
+  std::size_t hits{ 0 }; // answered from the cache or /etc/hosts
+  std::size_t negative_hits{ 0 }; // cached "no such host"
+  std::size_t coalesced{ 0 }; // waited for another coroutine's query
+  std::size_t queries{ 0 }; // sent to a nameserver, A and AAAA count once
+  std::size_t failures{ 0 }; // timed out or SERVFAIL on every attempt
 };
 
+// Stub resolver for ConnectHost/ListenByHost, shared by all schedulers:
+// /etc/hosts first, then A and AAAA queries over UDP to the nameservers of
+// /etc/resolv.conf, sent and awaited by the calling coroutine on its own
+// loop. Answers are cached for their TTL, missing names for the SOA's
+// negative TTL, and concurrent lookups of one name share a single query.
+class Resolver {
+public:
+  static Resolver* Default();
+
+  Resolver(); // reads /etc/resolv.conf and /etc/hosts
+
+  // IPv6 addresses first, as getaddrinfo tends to; false if there are none
+  bool Resolve(const std::string& host, std::vector<IpAddress>* addrs);
+
+  void SetNameservers(const std::vector<std::string>& servers); // "ip" or "ip:port", "[ip6]:port"
+  void SetTimeoutMs(long timeout_ms); // per attempt
+  void SetAttempts(int attempts);
+  void SetNegativeTtl(int secs); // the most a missing name is cached
+  void SetHostsOnly(bool hosts_only); // no queries, e.g. for tests
+  bool LoadHosts(const std::string& path);
+  void Clear(); // the cache, not /etc/hosts
+
+  ResolverStats GetStats() const;
+
+protected:
+  struct Entry;
+  struct Answer;
+
+  void LoadConfig(const std::string& path);
+  bool Query(const std::string& name, Answer* answer);
+  bool QueryServer(const IpAddress& server, int port, const std::string& name, Answer* answer);
+  static int QueryTcp(const IpAddress& server, int port, uint16_t id, const std::string& name, uint16_t type,
+                      uint64_t deadline, std::vector<IpAddress>* addrs, uint32_t* ttl, bool* nxdomain);
+
+protected:
+  mutable std::mutex lock_;
+  std::vector<std::pair<IpAddress, int> > servers_;
+  std::vector<std::string> search_;
+  int ndots_{ 1 };
+  long timeout_ms_{ 5000 };
+  int attempts_{ 2 };
+  int negative_ttl_{ 30 };
+  bool hosts_only_{ false };
+  std::unordered_map<std::string, std::vector<IpAddress> > hosts_;
+  std::unordered_map<std::string, std::shared_ptr<Entry> > cache_;
+  std::atomic<std::size_t> lookups_{ 0 };
+  std::atomic<std::size_t> hits_{ 0 };
+  std::atomic<std::size_t> negative_hits_{ 0 };
+  std::atomic<std::size_t> coalesced_{ 0 };
+  std::atomic<std::size_t> queries_{ 0 };
+  std::atomic<std::size_t> failures_{ 0 };
+};
+
+// First `c` in [begin, end) or nullptr; AVX2/SSE2 on x86, memchr elsewhere
+const char* FindByte(const char* begin, const char* end, char c);
+
 template<int N>
 class Buffer {
 public:
@@ -101,6 +298,12 @@ public:
   int Size();
   void Skip(int n);
 
+  // Reads until `delim` is buffered and returns the length up to and
+  // including it; the bytes are at Data(), Skip() them when done. 0 on EOF,
+  // -1 on error or when no delimiter fits in the buffer.
+  int ReadUntil(char delim);
+  int ReadLine(); // ReadUntil('\n'), the line keeps its "\r\n" or "\n"
+
   int EnsureSpace(int n);
   char* Space();
   int SpaceSize();
@@ -108,6 +311,7 @@ public:
 
   void Clear();
   int Flush();
+  int Flush(const uv_buf_t* tail, int n); // buffered bytes, then tail
 
   void Compact();
 
@@ -118,6 +322,284 @@ protected:
   Socket* s_{ nullptr };
 };
 
+// Buffer<N>'s interface over a ring whose pages are mapped twice, back to
+// back, so data and free space are always contiguous without Compact().
+// Grows by doubling, copying once, up to max_capacity.
+class RingBuffer {
+public:
+  RingBuffer(Socket* s = nullptr, std::size_t capacity = 64 * 1024, std::size_t max_capacity = 16 << 20);
+  ~RingBuffer();
+
+  bool Valid() const; // false if mapping the ring failed; calls needing room retry it
+  void Attach(Socket* s);
+
+  int EnsureData(int n);
+  char* Data();
+  int Size();
+  void Skip(int n);
+
+  int ReadUntil(char delim); // as Buffer<N>, growing for long lines
+  int ReadLine();
+
+  int EnsureSpace(int n);
+  char* Space();
+  int SpaceSize();
+  void Commit(int n);
+
+  void Clear();
+  int Flush();
+  int Flush(const uv_buf_t* tail, int n); // buffered bytes, then tail
+
+  std::size_t Capacity() const;
+
+protected:
+  RingBuffer(const RingBuffer&) = delete;
+  RingBuffer& operator=(const RingBuffer&) = delete;
+
+  bool Grow(std::size_t need);
+
+protected:
+  char* base_{ nullptr };
+  std::size_t capacity_{ 0 }; // power of 2, at least a page
+  std::size_t max_capacity_;
+  std::size_t head_{ 0 }; // < capacity_
+  std::size_t size_{ 0 };
+  Socket* s_{ nullptr };
+};
+
+struct StackPoolStats {
+  std::size_t hits{ 0 };
+  std::size_t misses{ 0 };
+  std::size_t returned{ 0 };
+  std::size_t released{ 0 };
+  std::size_t cached{ 0 };
+  std::size_t profiled{ 0 };
+  std::size_t max_used{ 0 };
+};
+
+// Per-scheduler cache of coroutine stacks, keyed by power-of-two size class.
+// Stacks are only handed out on the owner scheduler thread; stacks freed on
+// other threads are queued and picked up by the owner on its next miss. A
+// pool outlives its scheduler while stacks it handed out still run on other
+// threads; the last one to come back frees it.
+//
+// On POSIX every stack is an mmap reservation with a PROT_NONE guard page
+// below it, so pages are committed on first touch and an overflow faults
+// instead of running into the neighbouring allocation.
+class StackPool {
+  friend class Scheduler;
+
+public:
+  StackPool(Scheduler* owner);
+  ~StackPool();
+
+  static bool AllocateStack(std::size_t size, boost::context::stack_context& stack, bool guard_page = true);
+  static void DeallocateStack(boost::context::stack_context& stack);
+
+  bool Allocate(std::size_t size, boost::context::stack_context& stack);
+  void Deallocate(boost::context::stack_context& stack);
+
+  void SetEnabled(bool enabled);
+  // A cached stack keeps every page it ever touched committed, so the pool
+  // pins up to `high` times the deepest stack per size class in RSS
+  void SetWatermarks(std::size_t low, std::size_t high);
+  void SetHugePages(bool huge_pages);
+  // Each guard page costs a separate kernel mapping; disable when running
+  // more coroutines than vm.max_map_count / 2
+  void SetGuardPages(bool guard_pages);
+
+  // Paint one in every `rate` stacks with a canary pattern and measure its
+  // peak depth in Coroutine::Destroy(). 0 disables profiling.
+  void SetProfileRate(unsigned rate);
+  bool ShouldProfile();
+  void ReportStackUsed(std::size_t used);
+
+  StackPoolStats GetStats() const;
+
+protected:
+  typedef std::vector<boost::context::stack_context> StackList;
+
+  static std::size_t SizeClass(std::size_t size);
+  bool AllocateSlab(std::size_t cls);
+  bool IsSlabStack(const boost::context::stack_context& stack) const;
+  void Put(boost::context::stack_context& stack);
+  void Release(boost::context::stack_context& stack);
+  void DrainReturned();
+  void Orphan(); // from ~Scheduler
+
+protected:
+  struct Slab {
+    char* base;
+    std::size_t size;
+  };
+
+  Scheduler* owner_;
+  bool enabled_{ true };
+  bool huge_pages_{ false };
+  bool guard_pages_{ true };
+  std::size_t low_watermark_;
+  std::size_t high_watermark_;
+  std::vector<StackList> free_;
+  std::vector<Slab> slabs_;
+  std::mutex lock_;
+  std::atomic<bool> has_returned_{ false };
+  StackList returned_;
+  std::atomic<std::size_t> outstanding_{ 0 }; // handed out, not back yet
+  bool orphaned_{ false }; // under lock_
+  std::atomic<std::size_t> hits_{ 0 };
+  std::atomic<std::size_t> misses_{ 0 };
+  std::atomic<std::size_t> returned_n_{ 0 };
+  std::atomic<std::size_t> released_{ 0 };
+  std::atomic<std::size_t> cached_{ 0 };
+  unsigned profile_rate_{ 0 };
+  unsigned profile_tick_{ 0 };
+  std::atomic<std::size_t> profiled_{ 0 };
+  std::atomic<std::size_t> max_used_{ 0 };
+};
+
+// Intrusive timer node, armed in a Scheduler's TimerWheel. fn is invoked
+// once on expiry, after the timer has been unlinked.
+struct Timer {
+  Timer* prev{ nullptr };
+  Timer* next{ nullptr };
+  uint64_t expire{ 0 };
+  void (*fn)(Timer* t) { nullptr };
+  void* data{ nullptr };
+
+  bool IsArmed() const;
+};
+
+// Hierarchical timing wheel with 1ms ticks: 4 levels of 64 slots cover
+// about 4.6 hours, later deadlines are clamped. Add/Remove are O(1).
+class TimerWheel {
+public:
+  TimerWheel();
+
+  void Add(Timer* t, uint64_t expire); // absolute time in ms
+  void Remove(Timer* t);
+  void Advance(uint64_t now); // fire everything expired at `now`
+
+  // Milliseconds from `now` until Advance() has work, -1 when empty
+  long NextTimeout(uint64_t now) const;
+  bool Empty() const;
+
+protected:
+  static const int kLevels = 4;
+  static const int kBits = 6;
+  static const int kSlots = 1 << kBits;
+
+  void Place(Timer* t);
+  void Cascade(int level);
+  void Fire(Timer& head);
+
+protected:
+  uint64_t now_{ 0 };
+  std::size_t count_{ 0 };
+  Timer due_;
+  Timer slots_[kLevels][kSlots];
+};
+
+// Intrusive unit of work for an Executor. fn runs on a pool thread, or with
+// cancelled = true on the stopping thread for work still queued at Stop().
+struct Task {
+  void (*fn)(Task* t, bool cancelled) { nullptr };
+  void* data{ nullptr };
+  uint64_t queued_at{ 0 };
+};
+
+struct ExecutorStats {
+  std::size_t threads{ 0 };
+  std::size_t queued{ 0 };
+  std::size_t executed{ 0 };
+  std::size_t stolen{ 0 };
+  uint64_t avg_wait_us{ 0 };
+  uint64_t max_wait_us{ 0 };
+};
+
+// Named offload pool that BeginCompute() sections run on. Every worker slot
+// owns a lock-free FIFO ring; idle workers steal from the other slots.
+// Threads are added under backlog up to max_threads and retire after
+// staying idle, down to min_threads.
+class Executor {
+public:
+  static Executor* Get(const std::string& name); // created on first use
+  static Executor* Default();
+  static Executor* Configure(const std::string& name, int min_threads, int max_threads);
+  static void StopAll();
+
+  Executor(const std::string& name, int min_threads, int max_threads);
+  ~Executor();
+
+  void Add(Task* t);
+  void Stop();
+
+  const std::string& GetName() const;
+  ExecutorStats GetStats() const;
+  int GetMaxThreads() const;
+
+protected:
+  struct Worker;
+
+  void SetLimits(int min_threads, int max_threads);
+  void Spawn();
+  void Consume(Worker* w);
+  Task* Pop(Worker* w, bool steal_first);
+  Task* PopOverflow();
+  void Execute(Task* t);
+
+protected:
+  std::string name_;
+  int min_threads_;
+  int max_threads_;
+  std::vector<std::unique_ptr<Worker> > workers_; // max_threads_ slots
+  std::atomic<unsigned> rr_index_{ 0 };
+  std::atomic<int> threads_{ 0 };
+  std::atomic<int> sleepers_{ 0 };
+  std::atomic<bool> stop_{ false };
+  std::mutex lock_; // overflow_, sleeping and spawning
+  std::condition_variable cond_;
+  std::deque<Task*> overflow_;
+  std::atomic<std::size_t> overflowed_{ 0 }; // overflow_.size(), read unlocked
+  std::atomic<std::size_t> queued_{ 0 };
+  std::atomic<std::size_t> executed_{ 0 };
+  std::atomic<std::size_t> stolen_{ 0 };
+  std::atomic<uint64_t> total_wait_ns_{ 0 };
+  std::atomic<uint64_t> max_wait_ns_{ 0 };
+};
+
+// Calls fn(begin, end) for every chunk of grain indices in [first, last)
+// on the executor's threads (the default pool if null). The calling
+// coroutine moves into a compute section and takes chunks too, then
+// resumes on its scheduler once all are done; other threads just take
+// chunks and wait. The first exception from fn is rethrown after the rest
+// ran, later chunks are skipped. Chunks should be worth a task handoff,
+// some tens of microseconds.
+void ParallelFor(std::size_t first, std::size_t last, std::size_t grain,
+                 const std::function<void(std::size_t, std::size_t)>& fn, Executor* executor = nullptr);
+// map(begin, end) -> T per chunk as above, folded in index order with
+// combine(T, T) -> T starting from identity
+template<typename T, typename Map, typename Combine>
+T ParallelReduce(std::size_t first, std::size_t last, std::size_t grain, const T& identity,
+                 Map map, Combine combine, Executor* executor = nullptr);
+
+// Intrusive FIFO of coroutines linked through Coroutine::prev_/next_.
+// A coroutine is a member of at most one queue at a time.
+class CoroutineQueue {
+public:
+  void PushBack(Coroutine* coro);
+  Coroutine* PopFront();
+  void Remove(Coroutine* coro);
+
+  Coroutine* Front() const;
+  bool Empty() const;
+  std::size_t Size() const;
+
+protected:
+  Coroutine* head_{ nullptr };
+  Coroutine* tail_{ nullptr };
+  std::size_t size_{ 0 };
+};
+
 class Coroutine {
 public:
   static Coroutine* Self();
@@ -133,7 +615,7 @@ public:
   void Suspend(State new_state);
 
   void Join(Coroutine* coro);
-  void Cancel();
+  void Cancel(); // on its scheduler; lands after a compute section it is in
   void Wakeup(Event new_event = EVENT_WAKEUP);
 
   State GetState() const;
@@ -143,38 +625,81 @@ public:
 
   void Nice();
   void Wait(long millisecs);
-  void BeginCompute();
+  // Sections are keyed by the BeginCompute call site for COMPUTE_ADAPTIVE,
+  // see Scheduler::SetComputeMode
+  void BeginCompute(Executor* executor = nullptr);
+  void BeginCompute(const std::string& pool);
   void EndCompute();
+  void MoveTo(Scheduler* sched);
+
+  // Pinned coroutines are never stolen by another scheduler. Pin
+  // coroutines that share a Condition or Join with coroutines elsewhere.
+  void SetPinned(bool pinned);
+  bool IsMigratable() const;
 
   void SetTimeout(int seconds);
+  void SetTimeoutMs(long millisecs); // for the next wait only, armed by it
   bool CheckBuget();
 
   void* GetCls() const;
+  std::size_t GetStackUsed() const; // valid in exit_fn when profiled
+
+  Coroutine* Next() const;
 
 private:
   friend class Scheduler;
-  void CheckTimeout();
+  friend class CoroutineQueue;
+  friend class Socket;
+  friend class WaitQueue;
+  friend class Select;
+  friend struct ParallelJob;
+  void PaintStack();
+  std::size_t MeasureStack() const;
+  void BeginComputeAt(Executor* executor, const void* site); // site null: never inline
   static std::size_t NextId();
 
 private:
   boost::context::detail::fcontext_t ctx_{ nullptr };
   boost::context::detail::fcontext_t caller_{ nullptr };
   boost::context::stack_context stack_;
+  StackPool* pool_{ nullptr };
   std::size_t cls_size_{ 0 };
+  bool profiled_{ false };
+  std::size_t stack_used_{ 0 };
   std::function<void()> fn_;
   std::function<void(Coroutine*)> exit_fn_;
   Scheduler* sched_{ nullptr };
   State state_{ STATE_READY };
-  Event event_;
-  int timeout_secs_{ 0 };
+  Event event_{ EVENT_WAKEUP };
+  Timer timer_;
+  long pending_timeout_ms_{ 0 }; // see SetTimeoutMs
   Coroutine* joined_{ nullptr };
+  bool* join_fired_{ nullptr }; // a Select's Joined case
+  bool pinned_{ false };
+  Socket* sockets_{ nullptr }; // polled sockets, stopped when migrating
+  Executor* executor_{ nullptr };
+  Task task_;
+  const void* compute_site_{ nullptr };
+  uint64_t compute_start_{ 0 };
+  bool compute_inline_{ false };
   std::size_t id_{ 0 };
   int buget_{ 0 };
+  Coroutine* prev_{ nullptr };
+  Coroutine* next_{ nullptr };
+  CoroutineQueue* queue_{ nullptr };
+  Coroutine* inbox_next_{ nullptr };
+  bool sync_woken_{ false }; // see WaitQueue
+  bool sync_posted_{ false }; // woken from another thread, for DrainInbox
+  bool sync_parked_{ false }; // in a WaitQueue or Select::Wait(), kept where Wake() posts
+  bool computing_{ false }; // on an executor thread; both on the home thread
+  bool cancel_pending_{ false };
 };
 
 typedef std::vector<Coroutine* > CoroutineList;
 
 class Condition {
+  friend class Select;
+
 public:
   void Wait(Coroutine* coro);
 
@@ -185,7 +710,385 @@ protected:
   CoroutineList waiting_;
 };
 
+// FIFO of coroutines parked on a Mutex, Semaphore, RWLock or WaitGroup. The
+// owner holds its lock around everything but Wake(); Park() drops it while
+// the coroutine is suspended. A waiter is claimed by exactly one of Claim()
+// or its own timeout, so a coroutine is never woken twice.
+class WaitQueue {
+public:
+  struct Waiter {
+    Coroutine* coro{ nullptr };
+    std::atomic<int> state{ 0 };
+    int64_t n{ 0 }; // what the owner grants, e.g. permits
+    uint64_t since{ 0 }; // uv_hrtime() when first queued
+    void* data{ nullptr }; // a Channel item
+    std::atomic<int>* claim{ nullptr }; // one for all of a Select's cases
+    bool queued{ false };
+    bool cancelled{ false };
+    Waiter* prev{ nullptr };
+    Waiter* next{ nullptr };
+  };
+
+  void PushBack(Waiter* w);
+  void PushFront(Waiter* w);
+  Waiter* PopFront(); // nullptr if empty
+  void Remove(Waiter* w);
+  Waiter* Front() const;
+  bool Empty() const;
+
+  // True once claimed; false after timeout_ms (<= 0 waits forever), w is
+  // dequeued then. Returns with the lock released. On a cancel it sets
+  // w->cancelled, the caller passes on anything granted and throws Unwind
+  bool Park(Waiter* w, std::unique_lock<std::mutex>& lock, long timeout_ms);
+  // Park() for a queue only used on the waiter's own scheduler: no lock and
+  // nothing to claim, woken by being dequeued
+  bool ParkLocal(Waiter* w);
+  static bool Claim(Waiter* w); // false if it timed out meanwhile
+  static void Wake(Coroutine* coro); // after Claim, lock released; any thread
+  void WakeAll(); // a queue of claimed waiters, lock released
+
+protected:
+  Waiter* head_{ nullptr };
+  Waiter* tail_{ nullptr };
+};
+
+// Synchronization for coroutines on any scheduler, or plain threads for
+// the non-blocking calls. Waiters park the coroutine, not the thread, and
+// are woken in FIFO order through their own scheduler; uncontended calls
+// take no lock. The For variants give up after timeout_ms and return false.
+//
+// A free Mutex goes to whoever asks first, so a woken waiter may find it
+// taken again and requeue at the front; once the front waiter has waited
+// 1ms the lock is handed to it directly instead.
+class Mutex {
+public:
+  void Lock();
+  bool LockFor(long timeout_ms);
+  bool TryLock();
+  void Unlock();
+
+protected:
+  bool Barge(bool woken);
+  bool LockSlow(long timeout_ms);
+  void UnlockSlow();
+  void PassWakeup();
+
+protected:
+  std::atomic<int> state_{ 0 }; // MUTEX_* bits
+  std::mutex lock_;
+  WaitQueue waiters_;
+};
+
+class Semaphore {
+public:
+  explicit Semaphore(int64_t count = 0);
+
+  void Acquire();
+  bool AcquireFor(long timeout_ms);
+  bool TryAcquire();
+  void Release(int64_t n = 1);
+
+protected:
+  bool Take();
+  bool AcquireSlow(long timeout_ms);
+  void Grant();
+
+protected:
+  std::atomic<int64_t> count_;
+  std::atomic<int64_t> waiting_{ 0 }; // callers in the slow path
+  std::mutex lock_;
+  WaitQueue waiters_;
+};
+
+// Queued writers hold back new readers, so neither side starves
+class RWLock {
+public:
+  void Lock();
+  bool LockFor(long timeout_ms);
+  bool TryLock();
+  void Unlock();
+
+  void LockShared();
+  bool LockSharedFor(long timeout_ms);
+  bool TryLockShared();
+  void UnlockShared();
+
+protected:
+  bool LockSlow(bool shared, long timeout_ms);
+  bool TryAcquire(bool shared);
+  void Grant();
+
+protected:
+  std::atomic<int64_t> state_{ 0 }; // readers, or -1 for a writer
+  std::atomic<int64_t> waiting_{ 0 };
+  std::mutex lock_;
+  WaitQueue waiters_;
+};
+
+class WaitGroup {
+public:
+  void Add(int64_t n = 1);
+  void Done();
+  void Wait();
+  bool WaitFor(long timeout_ms);
+
+protected:
+  bool WaitSlow(long timeout_ms);
+  void NotifyAll();
+
+protected:
+  std::atomic<int64_t> count_{ 0 };
+  std::atomic<int64_t> waiting_{ 0 };
+  std::mutex lock_;
+  WaitQueue waiters_;
+};
+
+// What Channel<T> needs to know beyond T, and what Select uses
+class ChannelBase {
+  friend class Select;
+
+public:
+  virtual ~ChannelBase() {}
+
+protected:
+  explicit ChannelBase(bool local);
+
+  virtual bool Empty() const = 0; // nothing buffered
+  WaitQueue::Waiter* PopWaiter(WaitQueue& queue);
+  void Park(WaitQueue& queue, WaitQueue::Waiter* w, std::unique_lock<std::mutex>& lock);
+  // A Select's case: queues w among the receivers unless a Recv wouldn't
+  // wait. Receivers with no Waiter::data are only woken, not served
+  bool Watch(WaitQueue::Waiter* w);
+  bool Unwatch(WaitQueue::Waiter* w); // true if it was woken
+
+protected:
+  bool local_;
+  bool closed_{ false };
+  std::mutex lock_;
+  WaitQueue senders_; // full: items wait at Waiter::data
+  WaitQueue receivers_; // empty: one item each goes to Waiter::data
+};
+
+// FIFO of T between coroutines on any schedulers. Capacity 0 is unbuffered:
+// a Send completes when a receiver takes the item. After Close sends fail
+// and receivers drain what is buffered. A local channel is only used from
+// one scheduler (pin its coroutines) and skips locking altogether.
+template<typename T>
+class Channel : public ChannelBase {
+public:
+  explicit Channel(std::size_t capacity = 0, bool local = false);
+
+  bool Send(const T& item); // false once closed
+  bool Send(T&& item);
+  bool TrySend(const T& item); // false if full, too
+  bool Recv(T& item); // false once closed and drained
+  bool TryRecv(T& item);
+  // Waits for one item, then takes up to max without waiting again; 0
+  // once closed and drained
+  std::size_t RecvMany(T* items, std::size_t max);
+  void Close();
+
+protected:
+  bool Empty() const override;
+  bool Deliver(T& item, WaitQueue& woken); // to a waiting receiver
+  bool SendItem(T& item, bool wait);
+  std::size_t RecvItems(T* items, std::size_t max, bool wait);
+  void Requeue(T& item);
+
+protected:
+  std::size_t capacity_;
+  std::deque<T> items_;
+};
+
+// Completion of a Spawn()ed coroutine, shared by its Futures; see Future
+class FutureBase : public std::enable_shared_from_this<FutureBase> {
+  friend class Select;
+  template<typename T>
+  friend class Future;
+
+public:
+  virtual ~FutureBase() {}
+
+  bool Done();
+  bool Cancelled(); // Unwind in the child, or cancelled before it ran
+  void Wait(); // cancels the child if the caller is cancelled meanwhile
+  void Cancel();
+
+  // The child's side, see Spawn(); Begin() is false if cancelled already
+  bool Begin(Coroutine* coro);
+  void Finish(bool cancelled, std::exception_ptr error);
+
+protected:
+  void CancelHere(); // on the child's scheduler
+  bool Watch(WaitQueue::Waiter* w); // as ChannelBase
+  bool Unwatch(WaitQueue::Waiter* w);
+
+protected:
+  std::mutex lock_;
+  bool done_{ false };
+  bool cancel_{ false }; // requested
+  bool cancelled_{ false };
+  Coroutine* coro_{ nullptr }; // the child while it runs
+  Scheduler* sched_{ nullptr }; // where it runs, pinned
+  std::exception_ptr error_; // thrown by the child, rethrown by Get()
+  WaitQueue waiters_;
+};
+
+template<typename T>
+class FutureState : public FutureBase {
+public:
+  template<typename F>
+  void Run(F& fn) {
+    value = fn();
+  }
+
+  T value{};
+};
+
+template<>
+class FutureState<void> : public FutureBase {
+public:
+  template<typename F>
+  void Run(F& fn) {
+    fn();
+  }
+};
+
+// Result of a coroutine started with Spawn() on any scheduler. Get() parks
+// the calling coroutine until the child is done; a caller cancelled while
+// waiting cancels the child too, so a tree of fan-outs unwinds together.
+// A cancelled child has no value, Get() returns T() then. Dropping the
+// Future leaves the child running.
+template<typename T>
+class Future {
+  friend class Select;
+
+public:
+  Future() {}
+  explicit Future(const std::shared_ptr<FutureState<T> >& state);
+
+  bool Valid() const;
+  bool Done() const;
+  bool Cancelled() const;
+  void Wait() const;
+  // Waits, then rethrows what the child threw
+  typename std::add_lvalue_reference<T>::type Get() const;
+  void Cancel() const; // the child unwinds at its next wait
+
+protected:
+  std::shared_ptr<FutureState<T> > state_;
+};
+
+// Starts fn() in a new coroutine pinned to sched, or to the next of scheds
+template<typename F>
+Future<typename std::result_of<F()>::type> Spawn(Scheduler* sched, F fn);
+template<typename F>
+Future<typename std::result_of<F()>::type> Spawn(Schedulers* scheds, F fn);
+
+// Wait for all of the futures, or for the first one and return its index.
+// A cancelled caller cancels the children it waited for.
+template<typename T>
+void WhenAll(const std::vector<Future<T> >& futures);
+template<typename T>
+int WhenAny(const std::vector<Future<T> >& futures);
+
+// Waits for the first of several things and returns its index, in the order
+// the cases were added; Fired() tells whether others fired as well. Wait()
+// can be called again on the same cases. Sockets, conditions and joined
+// coroutines belong to the calling coroutine's scheduler (pin it), channels
+// and futures may be used anywhere. A Received case means a Recv would not wait,
+// though another receiver can still get there first.
+class Select {
+public:
+  int Readable(Socket* s);
+  int Writable(Socket* s);
+  int Notified(Condition* cond);
+  int Joined(Coroutine* coro);
+  template<typename T>
+  int Received(Channel<T>* ch);
+  template<typename T>
+  int Completed(const Future<T>& f);
+  int Timeout(long millisecs); // at most one
+
+  int Wait();
+  bool Fired(int i) const;
+
+protected:
+  enum Kind {
+    CASE_READABLE,
+    CASE_WRITABLE,
+    CASE_NOTIFIED,
+    CASE_JOINED,
+    CASE_RECEIVED,
+    CASE_COMPLETED,
+    CASE_TIMEOUT,
+  };
+
+  struct Case {
+    Kind kind;
+    void* target; // Socket, Condition, Coroutine, ChannelBase or FutureBase
+    long millisecs{ 0 };
+    bool armed{ false };
+    bool fired{ false };
+    WaitQueue::Waiter waiter; // CASE_RECEIVED, CASE_COMPLETED
+  };
+
+  int Add(Kind kind, void* target);
+  bool Arm(Case& c, Coroutine* self); // true if it fired already
+  bool Disarm(Case& c, Coroutine* self); // true if it fired
+
+protected:
+  std::deque<Case> cases_; // stable addresses for the waiters
+  std::atomic<int> claim_{ 0 }; // see WaitQueue::Claim
+  uint64_t deadline_{ 0 };
+};
+
+// Completion-based socket I/O on an io_uring owned by one Scheduler (Linux
+// only). SQEs queue up while coroutines run and go to the kernel in one
+// io_uring_enter per loop iteration; completions are reaped when the ring's
+// fd polls readable on the loop. Operations suspend the calling coroutine and
+// return the result or -errno.
+class IoUring {
+public:
+  static IoUring* Create(Scheduler* sched, unsigned entries = 256); // nullptr if unsupported
+  ~IoUring();
+
+  int Recv(uv_os_sock_t fd, void* buf, int len, long timeout_ms);
+  int Send(uv_os_sock_t fd, const void* buf, int len, long timeout_ms);
+  int RecvV(uv_os_sock_t fd, uv_buf_t* bufs, int n, long timeout_ms);
+  int SendV(uv_os_sock_t fd, const uv_buf_t* bufs, int n, long timeout_ms);
+  int Connect(uv_os_sock_t fd, const struct sockaddr* addr, int addrlen, long timeout_ms);
+  int Accept(uv_os_sock_t fd, IoAccept*& accept, long timeout_ms);
+  Event Poll(uv_os_sock_t fd, int direction, long timeout_ms, Condition* cond);
+  static void CloseAccept(IoAccept* accept); // hops to the listener's scheduler
+
+  void Submit();
+  void Reap();
+  void Close();
+
+protected:
+  struct Ring;
+  struct Request;
+
+  IoUring(Scheduler* sched, Ring* ring);
+  int Enter(unsigned submit, unsigned wait, unsigned flags);
+  void* GetSqe();
+  void Cancel(Request* req);
+  Event Await(Request* req, long timeout_ms, Condition* cond);
+  void ArmAccept(uv_os_sock_t fd, IoAccept* accept);
+  static void DisarmAccept(IoAccept* accept); // hops to the listener's scheduler
+
+protected:
+  friend struct IoAccept;
+  Scheduler* sched_;
+  Ring* ring_;
+};
+
 class Scheduler {
+  friend class Coroutine;
+  friend class Socket;
+  friend class IoUring;
+
 public:
   static Scheduler* Get();
 
@@ -196,23 +1099,57 @@ public:
   void PostCoroutine(Coroutine* coro, bool is_compute = false); // for different thread
   void Wait(Coroutine* coro, long millisecs);
   void Wait(Coroutine* coro, Socket& s, int flags);
+  void AddTimer(Timer* t, long millisecs);
+  void RemoveTimer(Timer* t);
   void BeginCompute(Coroutine* coro);
   void Run();
 
   Coroutine* GetCurrent() const;
   uv_loop_t* GetLoop();
   std::size_t GetId() const;
+  StackPool& GetStackPool();
 
   void Stop();
   void SetScheduleParams(int tight_loop, int coro_buget);
 
+  // Work stealing between the schedulers in `peers` (which includes this
+  // one). Only ready, unpinned coroutines migrate; see Coroutine::SetPinned.
+  void SetStealing(std::vector<Scheduler*>* peers, bool enabled);
+  std::size_t GetSteals() const;
+
+  // Ready + waiting coroutines as of the last loop iteration, plus posts
+  // not yet picked up. Cheap to read from any thread.
+  int GetLoad() const;
+
+  // COMPUTE_ADAPTIVE runs a compute section inline on this thread when its
+  // call site has averaged under threshold_us, skipping the two hops through
+  // an Executor. Sites are re-measured on every run either way.
+  void SetComputeMode(ComputeMode mode, long threshold_us = 50);
+  ComputeStats GetComputeStats() const;
+
+  // IO_BACKEND_URING moves socket reads, writes, accepts and connects on
+  // this scheduler to io_uring. Returns false and keeps IO_BACKEND_POLL where
+  // io_uring is unavailable. Call on the scheduler's thread before Run().
+  bool SetIoBackend(IoBackend backend);
+  IoBackend GetIoBackend() const;
+
 protected:
   void Pre();
   void Check();
   void Async();
-  void Sweep();
+  void DrainInbox();
+  void OnTimer();
+  void ScheduleTimer();
   void RunCoros();
-  void Cleanup(CoroutineList& cl);
+  void Ready(Coroutine* coro);
+  void Offer();
+  bool Steal();
+  void Reclaim();
+  void Cleanup();
+  void DetachSockets(Coroutine* coro);
+  void FlushSockets();
+  bool ShouldInline(const void* site);
+  void RecordCompute(const void* site, uint64_t elapsed_ns);
   static std::size_t NextId();
 
 protected:
@@ -223,24 +1160,52 @@ protected:
   uv_prepare_t pre_;
   uv_check_t check_;
   uv_async_t async_;
-  uv_timer_t sweep_timer_;
+  uv_timer_t wheel_timer_;
+  uint64_t wheel_due_{ UINT64_MAX };
+  TimerWheel timers_;
   Coroutine* current_{ nullptr };
-  CoroutineList ready_;
-  CoroutineList waiting_;
-  std::mutex lock_;
-  int outstanding_{ 0 };
-  CoroutineList posted_;
-  CoroutineList compute_done_;
+  CoroutineQueue ready_;
+  CoroutineQueue waiting_;
+  // Lock-free MPSC inbox for PostCoroutine(), a LIFO stack reversed on drain.
+  // awake_ is true while the loop is outside poll; producers skip the async
+  // signal then, and Pre() drains once more after clearing it.
+  std::atomic<Coroutine*> inbox_{ nullptr };
+  std::atomic<bool> awake_{ false };
+  std::atomic<int> outstanding_{ 0 };
+  std::atomic<int> load_{ 0 };
+  std::atomic<int> inbound_{ 0 };
   std::atomic<bool> shutdown_{ false };
+  std::atomic<bool> stealing_{ false };
+  std::atomic<bool> idle_{ false };
+  std::vector<Scheduler*>* peers_{ nullptr };
+  std::size_t steal_index_{ 0 };
+  std::mutex steal_lock_;
+  std::deque<Coroutine*> steal_queue_;
+  std::atomic<std::size_t> steals_{ 0 };
   int tight_loop_{ 512 };
   int coro_buget_{ 32 };
+  StackPool* stack_pool_{ new StackPool(this) }; // see StackPool::Orphan
+  ComputeMode compute_mode_{ COMPUTE_OFFLOAD };
+  uint64_t compute_threshold_ns_{ 50000 };
+  std::unordered_map<const void*, uint64_t> compute_sites_; // EWMA of ns
+  std::atomic<std::size_t> compute_inlined_{ 0 };
+  std::atomic<std::size_t> compute_offloaded_{ 0 };
+  IoUring* uring_{ nullptr };
+  std::vector<Socket*> flushing_; // with output queued this iteration
 };
 
 class Schedulers {
 public:
-  Schedulers(int N);
+  Schedulers(int N, IoBackend backend = IO_BACKEND_POLL);
 
   Scheduler* GetNext();
+  // With PLACEMENT_HASH equal keys (e.g. a hashed client address) always
+  // map to the same scheduler; other policies ignore the key
+  Scheduler* GetNext(std::size_t key);
+
+  void SetPlacement(Placement placement); // safe while GetNext runs elsewhere
+  void SetStealing(bool enabled);
+  std::size_t GetSteals() const;
 
   void Stop();
 
@@ -249,12 +1214,15 @@ protected:
 
 protected:
   int N_;
+  IoBackend backend_;
   std::vector<std::thread> threads_;
   std::vector<Scheduler*> scheds_;
-  int rr_index_{ 0 };
+  std::atomic<Placement> placement_{ PLACEMENT_ROUND_ROBIN };
+  std::atomic<unsigned> rr_index_{ 0 };
   std::mutex lock_;
   std::condition_variable cond_;
   int created_{ 0 };
+  int finished_{ 0 };
 };
 
 inline Socket::Socket(uv_os_sock_t s)
@@ -262,21 +1230,37 @@ inline Socket::Socket(uv_os_sock_t s)
   poll_.data = this;
   coro_ = Coroutine::Self();
   if (s != BAD_SOCKET) {
-    uv_poll_init_socket(Scheduler::Get()->GetLoop(), &poll_, s_);
+    InitPoll();
   }
 }
 
 inline void Socket::Attach(uv_os_sock_t s) {
   s_ = s;
-  uv_poll_init_socket(Scheduler::Get()->GetLoop(), &poll_, s_);
+  InitPoll();
+}
+
+inline uv_os_sock_t Socket::GetSocket() const {
+  return s_;
 }
 
 inline void Socket::SetDeadline(int timeout_secs) {
-  timeout_secs_ = timeout_secs;
+  timeout_ms_ = timeout_secs * 1000L;
 }
 
 inline int Socket::GetDeadline() {
-  return timeout_secs_;
+  return static_cast<int>(timeout_ms_ / 1000);
+}
+
+inline void Socket::SetDeadlineMs(long timeout_ms) {
+  timeout_ms_ = timeout_ms;
+}
+
+inline long Socket::GetDeadlineMs() {
+  return timeout_ms_;
+}
+
+inline void Socket::SetConnectDelayMs(long delay_ms) {
+  connect_delay_ms_ = delay_ms;
 }
 
 inline int Socket::ReadExactly(char* buf, int len) {
@@ -372,6 +1356,29 @@ inline int Buffer<N>::Flush() {
   return size;
 }
 
+// Gathers up to 15 tail buffers into the same write as the buffered bytes,
+// e.g. a header built here and a body held elsewhere
+template<int N>
+inline int Buffer<N>::Flush(const uv_buf_t* tail, int n) {
+  uv_buf_t bufs[16];
+  int head = n < 15 ? n : 15;
+  int size = Size();
+  bufs[0] = uv_buf_init(Data(), size);
+  for (int i = 0; i < head; i++) {
+    bufs[i + 1] = tail[i];
+    size += static_cast<int>(tail[i].len);
+  }
+  int rc = s_->WriteExactlyV(bufs, head + 1);
+  if (rc != size) {
+    return rc;
+  }
+  Clear();
+  if (head < n) {
+    rc += s_->WriteExactlyV(tail + head, n - head); // short on failure, as above
+  }
+  return rc;
+}
+
 template<int N>
 inline int Buffer<N>::EnsureData(int n) {
   assert(n <= N);
@@ -389,24 +1396,109 @@ inline int Buffer<N>::EnsureData(int n) {
   return n;
 }
 
-inline Coroutine* Coroutine::Self() {
-  Scheduler* sched = Scheduler::Get();
-  if (sched) {
-    return sched->GetCurrent();
-  } else {
-    return nullptr;
+// Only bytes that arrived since the last scan are searched
+template<int N>
+inline int Buffer<N>::ReadUntil(char delim) {
+  int scanned = 0;
+  for (;;) {
+    const char* begin = Data();
+    const char* hit = FindByte(begin + scanned, begin + Size(), delim);
+    if (hit) {
+      return static_cast<int>(hit - begin) + 1;
+    }
+    scanned = Size();
+    if (scanned == N) {
+      return -1;
+    }
+    if (SpaceSize() == 0) {
+      Compact();
+    }
+    int rc = s_->ReadSome(Space(), SpaceSize());
+    if (rc <= 0) {
+      return rc;
+    }
+    Commit(rc);
   }
 }
 
-inline void Coroutine::Join(Coroutine* coro) {
-  if (coro->GetState() == STATE_DONE) {
-    return;
+template<int N>
+inline int Buffer<N>::ReadLine() {
+  return ReadUntil('\n');
+}
+
+inline int RingBuffer::ReadLine() {
+  return ReadUntil('\n');
+}
+
+inline void RingBuffer::Attach(Socket* s) {
+  s_ = s;
+}
+
+inline char* RingBuffer::Data() {
+  return base_ + head_;
+}
+
+inline int RingBuffer::Size() {
+  return static_cast<int>(size_);
+}
+
+inline void RingBuffer::Skip(int n) {
+  if (static_cast<std::size_t>(n) >= size_) {
+    Clear();
+  } else {
+    head_ = (head_ + n) & (capacity_ - 1);
+    size_ -= n;
+  }
+}
+
+inline char* RingBuffer::Space() {
+  return base_ + ((head_ + size_) & (capacity_ - 1));
+}
+
+inline int RingBuffer::SpaceSize() {
+  return static_cast<int>(capacity_ - size_);
+}
+
+inline void RingBuffer::Commit(int n) {
+  if (size_ + n <= capacity_) {
+    size_ += n;
+  }
+}
+
+inline void RingBuffer::Clear() {
+  head_ = size_ = 0;
+}
+
+inline std::size_t RingBuffer::Capacity() const {
+  return capacity_;
+}
+
+inline bool RingBuffer::Valid() const {
+  return base_ != nullptr;
+}
+
+inline Coroutine* Coroutine::Self() {
+  Scheduler* sched = Scheduler::Get();
+  if (sched) {
+    return sched->GetCurrent();
+  } else {
+    return nullptr;
+  }
+}
+
+inline void Coroutine::Join(Coroutine* coro) {
+  if (coro->GetState() == STATE_DONE) {
+    return;
   }
   coro->joined_ = this;
   Suspend(STATE_WAITING);
 }
 
 inline void Coroutine::Cancel() {
+  if (computing_) {
+    cancel_pending_ = true; // event_ is the executor thread's now, see DrainInbox
+    return;
+  }
   Wakeup(EVENT_CANCEL);
 }
 
@@ -415,8 +1507,11 @@ inline void Coroutine::Wait(long millisecs) {
 }
 
 inline void Coroutine::Wakeup(Event new_event) {
-  state_ = STATE_READY;
   event_ = new_event;
+  if (state_ == STATE_WAITING) {
+    state_ = STATE_READY;
+    sched_->Ready(this);
+  }
 }
 
 inline State Coroutine::GetState() const {
@@ -439,6 +1534,10 @@ inline void Coroutine::Resume() {
 
 inline void Coroutine::Suspend(State new_state) {
   state_ = new_state;
+  if (pending_timeout_ms_ > 0 && new_state == STATE_WAITING) {
+    sched_->AddTimer(&timer_, pending_timeout_ms_);
+    pending_timeout_ms_ = 0;
+  }
   caller_ = boost::context::detail::jump_fcontext(caller_, (void*)this).fctx;
   if (event_ == EVENT_CANCEL) {
     throw Unwind();
@@ -457,34 +1556,43 @@ inline void Coroutine::Nice() {
   Suspend(STATE_READY);
 }
 
-inline void Coroutine::BeginCompute() {
-  sched_->BeginCompute(this);
+inline void Coroutine::MoveTo(Scheduler* sched) {
+  if (sched != sched_) {
+    sched_ = sched;
+    Suspend(STATE_MIGRATING);
+  }
 }
 
-inline void Coroutine::EndCompute() {
-  Suspend(STATE_READY);
+inline void Coroutine::SetPinned(bool pinned) {
+  pinned_ = pinned;
+}
+
+inline bool Coroutine::IsMigratable() const {
+  return !pinned_ && !joined_ && !sync_parked_;
 }
 
 inline void Coroutine::SetTimeout(int seconds) {
-  timeout_secs_ = seconds;
+  SetTimeoutMs(seconds * 1000L);
 }
 
-inline void Coroutine::CheckTimeout() {
-  if (state_ == STATE_WAITING) {
-    if (timeout_secs_ > 0) {
-      timeout_secs_ --;
-      if (timeout_secs_ == 0) {
-        state_ = STATE_READY;
-        event_ = EVENT_TIMEOUT;
-      }
-    }
-  }
+inline void Coroutine::SetTimeoutMs(long millisecs) {
+  // Armed when the coroutine actually parks, so a wait that completes at
+  // once leaves no timer behind; the last call wins
+  pending_timeout_ms_ = millisecs > 0 ? millisecs : 0;
+}
+
+inline Coroutine* Coroutine::Next() const {
+  return next_;
 }
 
 inline void* Coroutine::GetCls() const {
   return static_cast<char*>(stack_.sp);
 }
 
+inline std::size_t Coroutine::GetStackUsed() const {
+  return stack_used_;
+}
+
 inline void Condition::Wait(Coroutine* coro) {
   waiting_.push_back(coro);
   coro->Suspend(STATE_WAITING);
@@ -505,6 +1613,649 @@ inline void Condition::NotifyAll() {
   waiting_.clear();
 }
 
+inline void WaitQueue::PushBack(Waiter* w) {
+  assert(!w->queued);
+  w->queued = true;
+  w->prev = tail_;
+  w->next = nullptr;
+  if (tail_) {
+    tail_->next = w;
+  } else {
+    head_ = w;
+  }
+  tail_ = w;
+}
+
+inline void WaitQueue::PushFront(Waiter* w) {
+  assert(!w->queued);
+  w->queued = true;
+  w->prev = nullptr;
+  w->next = head_;
+  if (head_) {
+    head_->prev = w;
+  } else {
+    tail_ = w;
+  }
+  head_ = w;
+}
+
+inline WaitQueue::Waiter* WaitQueue::PopFront() {
+  Waiter* w = head_;
+  if (w) {
+    Remove(w);
+  }
+  return w;
+}
+
+inline void WaitQueue::Remove(Waiter* w) {
+  assert(w->queued);
+  if (w->prev) {
+    w->prev->next = w->next;
+  } else {
+    head_ = w->next;
+  }
+  if (w->next) {
+    w->next->prev = w->prev;
+  } else {
+    tail_ = w->prev;
+  }
+  w->queued = false;
+}
+
+inline WaitQueue::Waiter* WaitQueue::Front() const {
+  return head_;
+}
+
+inline bool WaitQueue::Empty() const {
+  return head_ == nullptr;
+}
+
+enum {
+  MUTEX_LOCKED = 1,
+  MUTEX_QUEUED = 2, // Unlock must look at the waiters
+  MUTEX_WOKEN = 4, // a woken waiter is on its way, don't wake another
+};
+
+inline bool Mutex::Barge(bool woken) {
+  int s = state_.load();
+  while (!(s & MUTEX_LOCKED)) {
+    if (state_.compare_exchange_weak(s, (s | MUTEX_LOCKED) & ~(woken ? MUTEX_WOKEN : 0))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+inline bool Mutex::TryLock() {
+  return Barge(false);
+}
+
+inline void Mutex::Lock() {
+  if (!TryLock()) {
+    LockSlow(-1);
+  }
+}
+
+inline bool Mutex::LockFor(long timeout_ms) {
+  return TryLock() || (timeout_ms > 0 && LockSlow(timeout_ms));
+}
+
+inline void Mutex::Unlock() {
+  int s = MUTEX_LOCKED;
+  if (!state_.compare_exchange_strong(s, 0)) {
+    UnlockSlow();
+  }
+}
+
+inline Semaphore::Semaphore(int64_t count)
+  : count_{ count } {
+}
+
+inline bool Semaphore::Take() {
+  int64_t c = count_.load();
+  while (c > 0) {
+    if (count_.compare_exchange_weak(c, c - 1)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Queued waiters go first
+inline bool Semaphore::TryAcquire() {
+  return waiting_.load() == 0 && Take();
+}
+
+inline void Semaphore::Acquire() {
+  if (!TryAcquire()) {
+    AcquireSlow(-1);
+  }
+}
+
+inline bool Semaphore::AcquireFor(long timeout_ms) {
+  return TryAcquire() || (timeout_ms > 0 && AcquireSlow(timeout_ms));
+}
+
+inline void Semaphore::Release(int64_t n) {
+  count_.fetch_add(n);
+  if (waiting_.load() > 0) {
+    Grant();
+  }
+}
+
+inline bool RWLock::TryAcquire(bool shared) {
+  int64_t s = state_.load();
+  if (!shared) {
+    return s == 0 && state_.compare_exchange_strong(s, -1);
+  }
+  while (s >= 0) {
+    if (state_.compare_exchange_weak(s, s + 1)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+inline bool RWLock::TryLock() {
+  return waiting_.load() == 0 && TryAcquire(false);
+}
+
+inline void RWLock::Lock() {
+  if (!TryLock()) {
+    LockSlow(false, -1);
+  }
+}
+
+inline bool RWLock::LockFor(long timeout_ms) {
+  return TryLock() || (timeout_ms > 0 && LockSlow(false, timeout_ms));
+}
+
+inline void RWLock::Unlock() {
+  state_.store(0);
+  if (waiting_.load() > 0) {
+    Grant();
+  }
+}
+
+inline bool RWLock::TryLockShared() {
+  return waiting_.load() == 0 && TryAcquire(true);
+}
+
+inline void RWLock::LockShared() {
+  if (!TryLockShared()) {
+    LockSlow(true, -1);
+  }
+}
+
+inline bool RWLock::LockSharedFor(long timeout_ms) {
+  return TryLockShared() || (timeout_ms > 0 && LockSlow(true, timeout_ms));
+}
+
+inline void RWLock::UnlockShared() {
+  if (state_.fetch_sub(1) == 1 && waiting_.load() > 0) {
+    Grant();
+  }
+}
+
+inline void WaitGroup::Add(int64_t n) {
+  int64_t left = count_.fetch_add(n) + n;
+  assert(left >= 0);
+  if (left == 0 && waiting_.load() > 0) {
+    NotifyAll();
+  }
+}
+
+inline void WaitGroup::Done() {
+  Add(-1);
+}
+
+inline void WaitGroup::Wait() {
+  if (count_.load() != 0) {
+    WaitSlow(-1);
+  }
+}
+
+inline bool WaitGroup::WaitFor(long timeout_ms) {
+  return count_.load() == 0 || (timeout_ms > 0 && WaitSlow(timeout_ms));
+}
+
+inline ChannelBase::ChannelBase(bool local)
+  : local_{ local } {
+}
+
+// The first waiter still there; the caller fills in Waiter::n and wakes it
+inline WaitQueue::Waiter* ChannelBase::PopWaiter(WaitQueue& queue) {
+  WaitQueue::Waiter* w;
+  while ((w = queue.PopFront()) && (!local_ || w->claim) && !WaitQueue::Claim(w)) {
+  }
+  return w;
+}
+
+inline void ChannelBase::Park(WaitQueue& queue, WaitQueue::Waiter* w, std::unique_lock<std::mutex>& lock) {
+  w->coro = Coroutine::Self();
+  queue.PushBack(w);
+  if (local_) {
+    queue.ParkLocal(w);
+  } else {
+    queue.Park(w, lock, -1);
+  }
+  if (w->cancelled) {
+    throw Unwind();
+  }
+}
+
+template<typename T>
+inline Channel<T>::Channel(std::size_t capacity, bool local)
+  : ChannelBase(local), capacity_{ capacity } {
+}
+
+template<typename T>
+inline bool Channel<T>::Send(const T& item) {
+  T copy(item);
+  return SendItem(copy, true);
+}
+
+template<typename T>
+inline bool Channel<T>::Send(T&& item) {
+  return SendItem(item, true);
+}
+
+template<typename T>
+inline bool Channel<T>::TrySend(const T& item) {
+  T copy(item);
+  return SendItem(copy, false);
+}
+
+template<typename T>
+inline bool Channel<T>::Recv(T& item) {
+  return RecvItems(&item, 1, true) == 1;
+}
+
+template<typename T>
+inline bool Channel<T>::TryRecv(T& item) {
+  return RecvItems(&item, 1, false) == 1;
+}
+
+template<typename T>
+inline std::size_t Channel<T>::RecvMany(T* items, std::size_t max) {
+  return RecvItems(items, max, true);
+}
+
+template<typename T>
+inline bool Channel<T>::Empty() const {
+  return items_.empty();
+}
+
+template<typename T>
+bool Channel<T>::Deliver(T& item, WaitQueue& woken) {
+  // A waiting receiver means nothing is buffered
+  WaitQueue::Waiter* w;
+  while ((w = PopWaiter(receivers_)) && !w->data) {
+    w->n = 1; // a Select, told and not served
+    woken.PushBack(w);
+  }
+  if (!w) {
+    return false;
+  }
+  *static_cast<T*>(w->data) = std::move(item);
+  w->n = 1;
+  woken.PushBack(w);
+  return true;
+}
+
+template<typename T>
+bool Channel<T>::SendItem(T& item, bool wait) {
+  std::unique_lock<std::mutex> lock(lock_, std::defer_lock);
+  if (!local_) {
+    lock.lock();
+  }
+  if (closed_) {
+    return false;
+  }
+  WaitQueue woken;
+  bool sent = true;
+  if (Deliver(item, woken)) {
+    // handed over
+  } else if (items_.size() < capacity_) {
+    items_.push_back(std::move(item));
+  } else if (wait) {
+    woken.WakeAll();
+    WaitQueue::Waiter self;
+    self.data = &item;
+    Park(senders_, &self, lock);
+    return self.n != 0;
+  } else {
+    sent = false;
+  }
+  if (lock.owns_lock()) {
+    lock.unlock();
+  }
+  woken.WakeAll();
+  return sent;
+}
+
+template<typename T>
+std::size_t Channel<T>::RecvItems(T* items, std::size_t max, bool wait) {
+  std::unique_lock<std::mutex> lock(lock_, std::defer_lock);
+  if (!local_) {
+    lock.lock();
+  }
+  WaitQueue woken;
+  std::size_t n = 0;
+  while (n < max) {
+    if (!items_.empty()) {
+      items[n++] = std::move(items_.front());
+      items_.pop_front();
+      if (WaitQueue::Waiter* w = PopWaiter(senders_)) {
+        items_.push_back(std::move(*static_cast<T*>(w->data))); // into the room made
+        w->n = 1;
+        woken.PushBack(w);
+      }
+    } else if (WaitQueue::Waiter* w = PopWaiter(senders_)) {
+      items[n++] = std::move(*static_cast<T*>(w->data)); // unbuffered
+      w->n = 1;
+      woken.PushBack(w);
+    } else {
+      break;
+    }
+  }
+  if (n > 0 || closed_ || !wait) {
+    if (lock.owns_lock()) {
+      lock.unlock();
+    }
+    woken.WakeAll();
+    return n;
+  }
+  WaitQueue::Waiter self;
+  self.data = items;
+  try {
+    Park(receivers_, &self, lock);
+  } catch (Unwind&) {
+    if (self.n != 0) {
+      Requeue(items[0]); // granted just before the cancel
+    }
+    throw;
+  }
+  return static_cast<std::size_t>(self.n);
+}
+
+// Gives back an item a cancelled receiver was handed: to the next receiver,
+// or to the front of the buffer, past capacity_ if need be
+template<typename T>
+void Channel<T>::Requeue(T& item) {
+  std::unique_lock<std::mutex> lock(lock_, std::defer_lock);
+  if (!local_) {
+    lock.lock();
+  }
+  WaitQueue woken;
+  if (!Deliver(item, woken)) {
+    items_.push_front(std::move(item));
+  }
+  if (lock.owns_lock()) {
+    lock.unlock();
+  }
+  woken.WakeAll();
+}
+
+template<typename T>
+void Channel<T>::Close() {
+  std::unique_lock<std::mutex> lock(lock_, std::defer_lock);
+  if (!local_) {
+    lock.lock();
+  }
+  closed_ = true;
+  WaitQueue woken;
+  while (WaitQueue::Waiter* w = PopWaiter(receivers_)) {
+    if (!w->data) {
+      w->n = 1; // a Recv won't wait now
+    }
+    woken.PushBack(w);
+  }
+  while (WaitQueue::Waiter* w = PopWaiter(senders_)) {
+    woken.PushBack(w);
+  }
+  if (lock.owns_lock()) {
+    lock.unlock();
+  }
+  woken.WakeAll();
+}
+
+inline int Select::Readable(Socket* s) {
+  return Add(CASE_READABLE, s);
+}
+
+inline int Select::Writable(Socket* s) {
+  return Add(CASE_WRITABLE, s);
+}
+
+inline int Select::Notified(Condition* cond) {
+  return Add(CASE_NOTIFIED, cond);
+}
+
+inline int Select::Joined(Coroutine* coro) {
+  return Add(CASE_JOINED, coro);
+}
+
+template<typename T>
+inline int Select::Received(Channel<T>* ch) {
+  return Add(CASE_RECEIVED, static_cast<ChannelBase*>(ch));
+}
+
+template<typename T>
+inline int Select::Completed(const Future<T>& f) {
+  return Add(CASE_COMPLETED, static_cast<FutureBase*>(f.state_.get()));
+}
+
+inline int Select::Timeout(long millisecs) {
+  int i = Add(CASE_TIMEOUT, nullptr);
+  cases_[i].millisecs = millisecs;
+  return i;
+}
+
+inline bool Select::Fired(int i) const {
+  return cases_[i].fired;
+}
+
+template<typename T>
+inline Future<T>::Future(const std::shared_ptr<FutureState<T> >& state)
+  : state_{ state } {
+}
+
+template<typename T>
+inline bool Future<T>::Valid() const {
+  return state_ != nullptr;
+}
+
+template<typename T>
+inline bool Future<T>::Done() const {
+  return state_->Done();
+}
+
+template<typename T>
+inline bool Future<T>::Cancelled() const {
+  return state_->Cancelled();
+}
+
+template<typename T>
+inline void Future<T>::Wait() const {
+  state_->Wait();
+}
+
+template<typename T>
+inline typename std::add_lvalue_reference<T>::type Future<T>::Get() const {
+  state_->Wait();
+  if (state_->error_) {
+    std::rethrow_exception(state_->error_);
+  }
+  return static_cast<typename std::add_lvalue_reference<T>::type>(state_->value);
+}
+
+template<>
+inline void Future<void>::Get() const {
+  state_->Wait();
+  if (state_->error_) {
+    std::rethrow_exception(state_->error_);
+  }
+}
+
+template<typename T>
+inline void Future<T>::Cancel() const {
+  state_->Cancel();
+}
+
+template<typename F>
+Future<typename std::result_of<F()>::type> Spawn(Scheduler* sched, F fn) {
+  typedef typename std::result_of<F()>::type T;
+  std::shared_ptr<FutureState<T> > state = std::make_shared<FutureState<T> >();
+  Coroutine::Create(sched, [state, fn]() mutable {
+    Coroutine* self = Coroutine::Self();
+    self->SetPinned(true); // for CancelHere
+    if (!state->Begin(self)) {
+      return;
+    }
+    try {
+      state->Run(fn);
+    } catch (Unwind& uw) {
+      state->Finish(true, nullptr);
+      throw;
+    } catch (...) {
+      state->Finish(false, std::current_exception());
+      return;
+    }
+    state->Finish(false, nullptr);
+  }, [](Coroutine* c) {});
+  return Future<T>(state);
+}
+
+template<typename F>
+inline Future<typename std::result_of<F()>::type> Spawn(Schedulers* scheds, F fn) {
+  return Spawn(scheds->GetNext(), fn);
+}
+
+template<typename T>
+void WhenAll(const std::vector<Future<T> >& futures) {
+  std::size_t i = 0;
+  try {
+    for (; i < futures.size(); i++) {
+      futures[i].Wait();
+    }
+  } catch (Unwind& uw) {
+    for (; i < futures.size(); i++) {
+      futures[i].Cancel();
+    }
+    throw;
+  }
+}
+
+template<typename T>
+int WhenAny(const std::vector<Future<T> >& futures) {
+  Select sel;
+  for (auto it = futures.begin(); it != futures.end(); ++it) {
+    sel.Completed(*it);
+  }
+  try {
+    return sel.Wait();
+  } catch (Unwind& uw) {
+    for (auto it = futures.begin(); it != futures.end(); ++it) {
+      it->Cancel();
+    }
+    throw;
+  }
+}
+
+template<typename T, typename Map, typename Combine>
+T ParallelReduce(std::size_t first, std::size_t last, std::size_t grain, const T& identity,
+                 Map map, Combine combine, Executor* executor) {
+  if (last <= first) {
+    return identity;
+  }
+  grain = grain > 0 ? grain : 1;
+  // A deque, not vector<bool>'s shared words, for chunks written in parallel
+  std::deque<T> partial((last - first + grain - 1) / grain, identity);
+  ParallelFor(first, last, grain, [&](std::size_t begin, std::size_t end) {
+    partial[(begin - first) / grain] = map(begin, end);
+  }, executor);
+  T result = identity;
+  for (auto it = partial.begin(); it != partial.end(); ++it) {
+    result = combine(result, *it);
+  }
+  return result;
+}
+
+inline void CoroutineQueue::PushBack(Coroutine* coro) {
+  assert(!coro->queue_);
+  coro->queue_ = this;
+  coro->prev_ = tail_;
+  coro->next_ = nullptr;
+  if (tail_) {
+    tail_->next_ = coro;
+  } else {
+    head_ = coro;
+  }
+  tail_ = coro;
+  size_ ++;
+}
+
+inline Coroutine* CoroutineQueue::PopFront() {
+  Coroutine* coro = head_;
+  if (coro) {
+    Remove(coro);
+  }
+  return coro;
+}
+
+inline void CoroutineQueue::Remove(Coroutine* coro) {
+  assert(coro->queue_ == this);
+  if (coro->prev_) {
+    coro->prev_->next_ = coro->next_;
+  } else {
+    head_ = coro->next_;
+  }
+  if (coro->next_) {
+    coro->next_->prev_ = coro->prev_;
+  } else {
+    tail_ = coro->prev_;
+  }
+  coro->prev_ = coro->next_ = nullptr;
+  coro->queue_ = nullptr;
+  size_ --;
+}
+
+inline Coroutine* CoroutineQueue::Front() const {
+  return head_;
+}
+
+inline bool CoroutineQueue::Empty() const {
+  return head_ == nullptr;
+}
+
+inline std::size_t CoroutineQueue::Size() const {
+  return size_;
+}
+
+inline bool Timer::IsArmed() const {
+  return next != nullptr;
+}
+
+inline bool TimerWheel::Empty() const {
+  return count_ == 0;
+}
+
+inline void Scheduler::RemoveTimer(Timer* t) {
+  if (t->IsArmed()) {
+    timers_.Remove(t);
+  }
+}
+
+inline void Scheduler::Ready(Coroutine* coro) {
+  if (coro->queue_) {
+    coro->queue_->Remove(coro);
+  }
+  RemoveTimer(&coro->timer_);
+  coro->buget_ = coro_buget_;
+  ready_.PushBack(coro);
+}
+
 inline Coroutine* Scheduler::GetCurrent() const {
   return current_;
 }
@@ -517,6 +2268,10 @@ inline std::size_t Scheduler::GetId() const {
   return id_;
 }
 
+inline StackPool& Scheduler::GetStackPool() {
+  return *stack_pool_;
+}
+
 inline void Scheduler::SetScheduleParams(int tight_loop, int coro_buget) {
   tight_loop_ = tight_loop;
   coro_buget_ = coro_buget;
@@ -526,8 +2281,40 @@ inline void Scheduler::BeginCompute(Coroutine* coro) {
   coro->Suspend(STATE_COMPUTE);
 }
 
-inline Scheduler* Schedulers::GetNext() {
-  return scheds_[(rr_index_ ++) % N_];
+inline std::size_t Scheduler::GetSteals() const {
+  return steals_;
+}
+
+inline void Scheduler::SetComputeMode(ComputeMode mode, long threshold_us) {
+  compute_mode_ = mode;
+  compute_threshold_ns_ = static_cast<uint64_t>(threshold_us) * 1000;
+}
+
+inline IoBackend Scheduler::GetIoBackend() const {
+  return uring_ ? IO_BACKEND_URING : IO_BACKEND_POLL;
+}
+
+inline ComputeStats Scheduler::GetComputeStats() const {
+  ComputeStats stats;
+  stats.inlined = compute_inlined_;
+  stats.offloaded = compute_offloaded_;
+  return stats;
+}
+
+inline int Scheduler::GetLoad() const {
+  return load_.load(std::memory_order_relaxed) + inbound_.load(std::memory_order_relaxed);
+}
+
+inline void Schedulers::SetPlacement(Placement placement) {
+  placement_.store(placement, std::memory_order_relaxed);
+}
+
+inline const std::string& Executor::GetName() const {
+  return name_;
+}
+
+inline int Executor::GetMaxThreads() const {
+  return max_threads_;
 }
 
 } // coros
@@ -1,11 +1,21 @@
 #include "coros.h"
 #include <cassert>
 #include <atomic>
+#include <cstdint>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define COROS_CALL_SITE() _ReturnAddress()
+#define COROS_NOINLINE __declspec(noinline)
+#else
+#define COROS_CALL_SITE() __builtin_return_address(0)
+#define COROS_NOINLINE __attribute__((noinline))
+#endif
 
 namespace coros {
 
 #define alignment16(a) (((a)+0x0F)&(~0x0F))
 static const std::size_t kReservedSize = alignment16(sizeof(Coroutine));
+static const uint64_t kStackCanary = 0xC0C0C0C0C0C0C0C0ULL;
 
 Coroutine* Coroutine::Create(Scheduler* sched,
                              const std::function<void()>& fn,
@@ -16,9 +26,17 @@ Coroutine* Coroutine::Create(Scheduler* sched,
     sched = Scheduler::Get();
   }
 
-  boost::context::fixedsize_stack stack_alloc(stack_size);
-  boost::context::stack_context stack = stack_alloc.allocate();
-  if (!stack.sp) {
+  // Stacks come from the pool of the creating thread's scheduler, which is
+  // where they are cheapest to recycle; Destroy() hands them back even when
+  // the coroutine ran elsewhere.
+  StackPool* pool = nullptr;
+  boost::context::stack_context stack;
+  if (Scheduler::Get()) {
+    pool = &Scheduler::Get()->GetStackPool();
+    if (!pool->Allocate(stack_size, stack)) {
+      return nullptr;
+    }
+  } else if (!StackPool::AllocateStack(stack_size, stack)) {
     return nullptr;
   }
 
@@ -29,11 +47,31 @@ Coroutine* Coroutine::Create(Scheduler* sched,
   stack.size -= (kReservedSize + cls_size);
 
   c->stack_ = stack;
+  c->pool_ = pool;
   c->cls_size_ = cls_size;
   c->sched_ = sched;
   c->id_ = NextId();
   c->fn_ = fn;
   c->exit_fn_ = exit_fn;
+  c->timer_.data = c;
+  c->timer_.fn = [](Timer* t) {
+    (reinterpret_cast<Coroutine*>(t->data))->Wakeup(EVENT_TIMEOUT);
+  };
+  c->task_.data = c;
+  c->task_.fn = [](Task* t, bool cancelled) {
+    Coroutine* coro = reinterpret_cast<Coroutine*>(t->data);
+    if (cancelled) {
+      coro->Wakeup(EVENT_CANCEL);
+      coro->Resume();
+      coro->Destroy();
+      return;
+    }
+    coro->Resume();
+    coro->GetScheduler()->PostCoroutine(coro, true);
+  };
+  if (pool && pool->ShouldProfile()) {
+    c->PaintStack();
+  }
   c->ctx_ = boost::context::detail::make_fcontext(stack.sp, stack.size, [](boost::context::detail::transfer_t t) {
     ((Coroutine*)t.data)->caller_ = t.fctx;
     try {
@@ -53,15 +91,84 @@ Coroutine* Coroutine::Create(Scheduler* sched,
 }
 
 void Coroutine::Destroy() {
+  sched_->RemoveTimer(&timer_);
+  if (sockets_ && Scheduler::Get()) {
+    Scheduler::Get()->DetachSockets(this);
+  }
+  // Sockets handed to other coroutines outlive this one
+  while (Socket* s = sockets_) {
+    sockets_ = s->next_;
+    s->prev_ = s->next_ = nullptr;
+    s->coro_ = nullptr;
+  }
   if (joined_) {
+    if (join_fired_) {
+      *join_fired_ = true;
+    }
     joined_->Wakeup(EVENT_JOIN);
   }
+  if (profiled_) {
+    stack_used_ = MeasureStack();
+    pool_->ReportStackUsed(stack_used_);
+  }
   exit_fn_(this);
-  stack_.sp = static_cast<char*>(stack_.sp) + (kReservedSize + cls_size_);
-  stack_.size += (kReservedSize + cls_size_);
+  boost::context::stack_context stack = stack_;
+  stack.sp = static_cast<char*>(stack.sp) + (kReservedSize + cls_size_);
+  stack.size += (kReservedSize + cls_size_);
+  StackPool* pool = pool_;
   this->~Coroutine();
-  boost::context::fixedsize_stack stack_alloc(stack_.size);
-  stack_alloc.deallocate(stack_);
+  if (pool) {
+    pool->Deallocate(stack);
+  } else {
+    StackPool::DeallocateStack(stack);
+  }
+}
+
+void Coroutine::PaintStack() {
+  // Commits every page of the stack, so only done for sampled coroutines
+  uint64_t* p = reinterpret_cast<uint64_t*>(static_cast<char*>(stack_.sp) - stack_.size);
+  uint64_t* end = reinterpret_cast<uint64_t*>(stack_.sp);
+  while (p < end) {
+    *p++ = kStackCanary;
+  }
+  profiled_ = true;
+}
+
+std::size_t Coroutine::MeasureStack() const {
+  const uint64_t* p = reinterpret_cast<const uint64_t*>(static_cast<char*>(stack_.sp) - stack_.size);
+  const uint64_t* end = reinterpret_cast<const uint64_t*>(stack_.sp);
+  while (p < end && *p == kStackCanary) {
+    p++;
+  }
+  return reinterpret_cast<const char*>(end) - reinterpret_cast<const char*>(p);
+}
+
+// Out of line and never inlined so that the return address identifies the
+// caller's BeginCompute call site
+COROS_NOINLINE void Coroutine::BeginCompute(Executor* executor) {
+  BeginComputeAt(executor, COROS_CALL_SITE());
+}
+
+COROS_NOINLINE void Coroutine::BeginCompute(const std::string& pool) {
+  BeginComputeAt(Executor::Get(pool), COROS_CALL_SITE());
+}
+
+void Coroutine::BeginComputeAt(Executor* executor, const void* site) {
+  compute_site_ = site;
+  compute_inline_ = sched_->ShouldInline(site);
+  if (!compute_inline_) {
+    executor_ = executor ? executor : Executor::Default();
+    sched_->BeginCompute(this);
+  }
+  compute_start_ = uv_hrtime();
+}
+
+void Coroutine::EndCompute() {
+  uint64_t elapsed = uv_hrtime() - compute_start_;
+  if (!compute_inline_) {
+    Suspend(STATE_READY);
+  }
+  sched_->RecordCompute(compute_site_, elapsed);
 }
 
 std::size_t Coroutine::NextId() {
@@ -0,0 +1,436 @@
+#include "coros.h"
+#include <cassert>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+
+namespace coros {
+
+static const std::size_t kRingSize = 1024; // per worker, power of 2
+static const unsigned kFairnessInterval = 61;
+static const int kKeepAliveMs = 1000;
+
+static uint64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Bounded MPMC ring (Vyukov): producers are scheduler threads, consumers are
+// the owning worker and thieves.
+struct Executor::Worker {
+  struct Cell {
+    std::atomic<std::size_t> seq;
+    Task* task;
+  };
+
+  Worker() {
+    for (std::size_t i = 0; i < kRingSize; i++) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+      cells_[i].task = nullptr;
+    }
+  }
+
+  bool Push(Task* t) {
+    std::size_t pos = tail_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = cells_[pos & (kRingSize - 1)];
+      std::size_t seq = cell.seq.load(std::memory_order_acquire);
+      intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+      if (dif == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          cell.task = t;
+          cell.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (dif < 0) {
+        return false; // full
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  Task* Pop() {
+    std::size_t pos = head_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = cells_[pos & (kRingSize - 1)];
+      std::size_t seq = cell.seq.load(std::memory_order_acquire);
+      intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (dif == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          Task* t = cell.task;
+          cell.seq.store(pos + kRingSize, std::memory_order_release);
+          return t;
+        }
+      } else if (dif < 0) {
+        return nullptr; // empty
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  Cell cells_[kRingSize];
+  char pad0_[64];
+  std::atomic<std::size_t> head_{ 0 };
+  char pad1_[64];
+  std::atomic<std::size_t> tail_{ 0 };
+  char pad2_[64];
+  std::size_t index_{ 0 };
+  std::thread thread_;
+  unsigned tick_{ 0 };
+};
+
+static std::mutex registry_lock;
+static std::map<std::string, std::unique_ptr<Executor> > registry;
+static std::atomic<Executor*> default_executor{ nullptr };
+
+static int HardwareThreads() {
+  int n = static_cast<int>(std::thread::hardware_concurrency());
+  return n > 0 ? n : 1;
+}
+
+Executor* Executor::Get(const std::string& name) {
+  std::lock_guard<std::mutex> l(registry_lock);
+  std::unique_ptr<Executor>& e = registry[name];
+  if (!e) {
+    e.reset(new Executor(name, 1, HardwareThreads()));
+  }
+  return e.get();
+}
+
+Executor* Executor::Default() {
+  Executor* e = default_executor.load(std::memory_order_acquire);
+  if (!e) {
+    e = Get("default");
+    default_executor.store(e, std::memory_order_release);
+  }
+  return e;
+}
+
+// Worker slots are reserved when a pool is created, so a later Configure()
+// cannot raise max_threads above the original value.
+Executor* Executor::Configure(const std::string& name, int min_threads, int max_threads) {
+  std::lock_guard<std::mutex> l(registry_lock);
+  std::unique_ptr<Executor>& e = registry[name];
+  if (!e) {
+    e.reset(new Executor(name, min_threads, max_threads));
+  } else {
+    e->SetLimits(min_threads, max_threads);
+  }
+  return e.get();
+}
+
+void Executor::StopAll() {
+  std::lock_guard<std::mutex> l(registry_lock);
+  for (auto& i : registry) {
+    i.second->Stop();
+  }
+}
+
+Executor::Executor(const std::string& name, int min_threads, int max_threads)
+  : name_(name) {
+  max_threads = max_threads > 1 ? max_threads : 1;
+  for (int i = 0; i < max_threads; i++) {
+    workers_.emplace_back(new Worker());
+    workers_.back()->index_ = i;
+  }
+  SetLimits(min_threads, max_threads);
+}
+
+Executor::~Executor() {
+  Stop();
+}
+
+void Executor::SetLimits(int min_threads, int max_threads) {
+  std::lock_guard<std::mutex> l(lock_);
+  int slots = static_cast<int>(workers_.size());
+  max_threads_ = max_threads < slots ? max_threads : slots;
+  max_threads_ = max_threads_ > 1 ? max_threads_ : 1;
+  min_threads_ = min_threads < max_threads_ ? min_threads : max_threads_;
+  min_threads_ = min_threads_ > 0 ? min_threads_ : 0;
+  while (!stop_ && threads_ < min_threads_) {
+    Spawn();
+  }
+}
+
+// Called with lock_ held. Running workers always occupy slots [0, threads_).
+void Executor::Spawn() {
+  Worker* w = workers_[threads_].get();
+  if (w->thread_.joinable()) {
+    w->thread_.join(); // retired earlier, already past its last lock_
+  }
+  threads_ ++;
+  w->thread_ = std::thread(std::bind(&Executor::Consume, this, w));
+}
+
+void Executor::Add(Task* t) {
+  if (stop_) {
+    t->fn(t, true);
+    return;
+  }
+  t->queued_at = NowNs();
+  int threads = threads_.load();
+  unsigned index = rr_index_.fetch_add(1, std::memory_order_relaxed);
+  if (threads == 0 || !workers_[index % threads]->Push(t)) {
+    std::lock_guard<std::mutex> l(lock_);
+    overflow_.push_back(t);
+    overflowed_ ++;
+  }
+  std::size_t queued = queued_.fetch_add(1) + 1;
+  if (sleepers_.load() > 0) {
+    std::lock_guard<std::mutex> l(lock_);
+    cond_.notify_one();
+  } else if ((threads = threads_.load()) < max_threads_ && queued > static_cast<std::size_t>(threads)) {
+    // Every worker is busy and the backlog outnumbers them
+    std::lock_guard<std::mutex> l(lock_);
+    if (!stop_ && threads_ < max_threads_ && sleepers_ == 0) {
+      Spawn();
+    }
+  }
+}
+
+Task* Executor::PopOverflow() {
+  if (overflowed_.load(std::memory_order_relaxed) == 0) {
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> l(lock_);
+  if (overflow_.empty()) {
+    return nullptr;
+  }
+  Task* t = overflow_.front();
+  overflow_.pop_front();
+  overflowed_ --;
+  return t;
+}
+
+Task* Executor::Pop(Worker* w, bool steal_first) {
+  Task* t = nullptr;
+  if (steal_first) {
+    // The rings stay busy under sustained load, so fairness ticks also
+    // serve the overflow that is otherwise only drained when all are empty
+    t = PopOverflow();
+  } else {
+    t = w->Pop();
+  }
+  if (!t) {
+    // Scan every slot: producers may have raced a worker retiring
+    std::size_t n = workers_.size();
+    for (std::size_t i = 1; i <= n && !t; i++) {
+      Worker* victim = workers_[(w->index_ + i) % n].get();
+      if (victim != w || steal_first) {
+        t = victim->Pop();
+        if (t && victim != w) {
+          stolen_ ++;
+        }
+      }
+    }
+  }
+  if (!t) {
+    t = PopOverflow();
+  }
+  if (t) {
+    queued_ --;
+  }
+  return t;
+}
+
+void Executor::Execute(Task* t) {
+  uint64_t wait = NowNs() - t->queued_at;
+  total_wait_ns_ += wait;
+  uint64_t max_wait = max_wait_ns_;
+  while (wait > max_wait && !max_wait_ns_.compare_exchange_weak(max_wait, wait)) {
+  }
+  t->fn(t, false);
+  executed_ ++;
+}
+
+void Executor::Consume(Worker* w) {
+  while (!stop_) {
+    // Periodically serve other queues first so no task waits behind a busy
+    // worker's backlog indefinitely
+    bool steal_first = ++ w->tick_ % kFairnessInterval == 0;
+    Task* t = Pop(w, steal_first);
+    if (t) {
+      Execute(t);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> l(lock_);
+    sleepers_ ++;
+    if (stop_ || queued_.load() > 0) {
+      sleepers_ --;
+      continue;
+    }
+    bool timeout = cond_.wait_for(l, std::chrono::milliseconds(kKeepAliveMs)) == std::cv_status::timeout;
+    sleepers_ --;
+    if (timeout && !stop_ && threads_ > min_threads_ && static_cast<int>(w->index_) == threads_ - 1) {
+      // Retire first, then recheck: Add() either sees the lower count and
+      // spawns, or this sees its task
+      threads_ --;
+      if (queued_.load() == 0) {
+        return;
+      }
+      threads_ ++;
+    }
+  }
+}
+
+void Executor::Stop() {
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    if (stop_) {
+      return;
+    }
+    stop_ = true;
+    cond_.notify_all();
+  }
+  for (auto& w : workers_) {
+    if (w->thread_.joinable()) {
+      w->thread_.join();
+    }
+  }
+  threads_ = 0;
+
+  // Anything still queued never started, hand it back as cancelled
+  for (auto& w : workers_) {
+    while (Task* t = w->Pop()) {
+      queued_ --;
+      t->fn(t, true);
+    }
+  }
+  std::deque<Task*> overflow;
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    overflow.swap(overflow_);
+    overflowed_ = 0;
+  }
+  for (auto t : overflow) {
+    queued_ --;
+    t->fn(t, true);
+  }
+}
+
+// One ParallelFor: chunks are claimed from next, so whoever runs takes the
+// next one and a helper task that starts late finds nothing left. Freed
+// by the last of the caller and the helpers.
+struct ParallelJob {
+  ParallelJob(std::size_t first, std::size_t last, std::size_t grain, std::size_t chunks, int helpers,
+              const std::function<void(std::size_t, std::size_t)>* fn)
+    : first(first), last(last), grain(grain), chunks(chunks), fn(fn), tasks(helpers) {
+    left = chunks;
+    refs = helpers + 1;
+    for (auto& t : tasks) {
+      t.data = this;
+      t.fn = [](Task* t, bool cancelled) {
+        ParallelJob* job = static_cast<ParallelJob*>(t->data);
+        if (!cancelled) {
+          job->Work();
+        }
+        job->Release();
+      };
+    }
+  }
+
+  void Work() {
+    std::size_t i;
+    while ((i = next.fetch_add(1)) < chunks) {
+      if (!failed.load(std::memory_order_relaxed)) {
+        std::size_t begin = first + i * grain;
+        try {
+          (*fn)(begin, std::min(begin + grain, last));
+        } catch (...) {
+          std::lock_guard<std::mutex> l(lock);
+          if (!error) {
+            error = std::current_exception();
+          }
+          failed = true;
+        }
+      }
+      if (left.fetch_sub(1) == 1) {
+        done.Done();
+      }
+    }
+  }
+
+  // The caller's share. Always offloaded: the helpers are queued already,
+  // and COMPUTE_ADAPTIVE would time every ParallelFor as one call site
+  void WorkOffloaded(Coroutine* self, Executor* executor) {
+    self->BeginComputeAt(executor, nullptr);
+    Work();
+    self->EndCompute();
+  }
+
+  void Release() {
+    if (refs.fetch_sub(1) == 1) {
+      delete this;
+    }
+  }
+
+  std::size_t first;
+  std::size_t last;
+  std::size_t grain;
+  std::size_t chunks;
+  const std::function<void(std::size_t, std::size_t)>* fn;
+  std::vector<Task> tasks;
+  std::atomic<std::size_t> next{ 0 };
+  std::atomic<std::size_t> left;
+  std::atomic<int> refs;
+  std::atomic<bool> failed{ false };
+  std::mutex lock; // error
+  std::exception_ptr error;
+  WaitGroup done; // once left reaches 0
+};
+
+void ParallelFor(std::size_t first, std::size_t last, std::size_t grain,
+                 const std::function<void(std::size_t, std::size_t)>& fn, Executor* executor) {
+  if (last <= first) {
+    return;
+  }
+  grain = grain > 0 ? grain : 1;
+  executor = executor ? executor : Executor::Default();
+  std::size_t chunks = (last - first + grain - 1) / grain;
+  std::size_t helpers = std::min(chunks - 1, static_cast<std::size_t>(executor->GetMaxThreads()));
+  ParallelJob* job = new ParallelJob(first, last, grain, chunks, static_cast<int>(helpers), &fn);
+  job->done.Add(1);
+  for (auto& t : job->tasks) {
+    executor->Add(&t);
+  }
+  Coroutine* self = Coroutine::Self();
+  if (self) {
+    try {
+      job->WorkOffloaded(self, executor);
+      job->done.Wait(); // the chunks still running elsewhere
+    } catch (Unwind& uw) {
+      job->failed = true;
+      job->Work(); // claims the chunks nobody started, skipping them
+      job->done.Wait(); // the running ones use fn, which lives on this stack
+      job->Release();
+      throw;
+    }
+  } else {
+    // A plain thread or a compute section: help, then wait for the rest
+    job->Work();
+    while (job->left.load() > 0) {
+      std::this_thread::yield();
+    }
+  }
+  std::exception_ptr error = job->error;
+  job->Release();
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+ExecutorStats Executor::GetStats() const {
+  ExecutorStats stats;
+  stats.threads = threads_;
+  stats.queued = queued_;
+  stats.executed = executed_;
+  stats.stolen = stolen_;
+  stats.avg_wait_us = stats.executed > 0 ? total_wait_ns_ / stats.executed / 1000 : 0;
+  stats.max_wait_us = max_wait_ns_ / 1000;
+  return stats;
+}
+
+} // coros
@@ -0,0 +1,106 @@
+#include "coros.h"
+#include <cassert>
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__))
+#include <emmintrin.h>
+#define COROS_SSE2 1
+#if defined(__GNUC__)
+#include <immintrin.h>
+#define COROS_AVX2 1
+#endif
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace coros {
+
+#if defined(COROS_SSE2)
+inline int LowestBit(unsigned mask) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return static_cast<int>(index);
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+static const char* FindByteSse2(const char* p, const char* end, char c) {
+  __m128i needle = _mm_set1_epi8(c);
+  for (; end - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle)));
+    if (mask) {
+      return p + LowestBit(mask);
+    }
+  }
+  for (; p < end; p++) {
+    if (*p == c) {
+      return p;
+    }
+  }
+  return nullptr;
+}
+#endif
+
+#if defined(COROS_AVX2)
+__attribute__((target("avx2")))
+static const char* FindByteAvx2(const char* p, const char* end, char c) {
+  __m256i needle = _mm256_set1_epi8(c);
+  for (; end - p >= 64; p += 64) {
+    // Two vectors per iteration, one branch for both
+    __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), needle);
+    __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32)), needle);
+    if (!_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b))) {
+      unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(a));
+      if (mask) {
+        return p + LowestBit(mask);
+      }
+      return p + 32 + LowestBit(static_cast<unsigned>(_mm256_movemask_epi8(b)));
+    }
+  }
+  if (end - p >= 32) {
+    unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(
+                      _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), needle)));
+    if (mask) {
+      return p + LowestBit(mask);
+    }
+    p += 32;
+  }
+  return FindByteSse2(p, end, c);
+}
+#endif
+
+static const char* FindByteScalar(const char* p, const char* end, char c) {
+  return static_cast<const char*>(memchr(p, c, end - p));
+}
+
+typedef const char* (*FindByteFn)(const char*, const char*, char);
+
+static FindByteFn SelectFindByte() {
+#if defined(COROS_AVX2)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return FindByteAvx2;
+  }
+#endif
+#if defined(COROS_SSE2)
+  return FindByteSse2;
+#else
+  return FindByteScalar;
+#endif
+}
+
+const char* FindByte(const char* begin, const char* end, char c) {
+  static const FindByteFn find_byte = SelectFindByte();
+  if (begin >= end) {
+    return nullptr;
+  }
+  // Short tails are common after a refill and not worth a vector setup
+  if (end - begin < 16) {
+    return FindByteScalar(begin, end, c);
+  }
+  return find_byte(begin, end, c);
+}
+
+} // coros
@@ -0,0 +1,618 @@
+#include "coros.h"
+#include <cassert>
+#include <atomic>
+
+#if defined(__linux__)
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#endif
+
+namespace coros {
+
+#if defined(__linux__)
+
+struct IoUring::Ring {
+  int fd{ -1 };
+  int enter_fd{ -1 }; // registered ring index with IORING_ENTER_REGISTERED_RING
+  unsigned enter_flags{ 0 };
+  void* sq_ptr{ nullptr };
+  std::size_t sq_size{ 0 };
+  void* cq_ptr{ nullptr };
+  std::size_t cq_size{ 0 };
+  struct io_uring_sqe* sqes{ nullptr };
+  std::size_t sqes_size{ 0 };
+  unsigned* sq_head{ nullptr };
+  unsigned* sq_tail{ nullptr };
+  unsigned* sq_flags{ nullptr };
+  unsigned* sq_array{ nullptr };
+  unsigned sq_mask{ 0 };
+  unsigned sq_entries{ 0 };
+  unsigned sq_local_tail{ 0 };
+  unsigned* cq_head{ nullptr };
+  unsigned* cq_tail{ nullptr };
+  unsigned cq_mask{ 0 };
+  struct io_uring_cqe* cqes{ nullptr };
+  bool multishot_accept{ true };
+  uv_poll_t poll;
+};
+
+struct IoUring::Request {
+  Coroutine* coro{ nullptr };
+  int res{ 0 };
+  bool done{ false };
+  IoAccept* accept{ nullptr };
+};
+
+// Accepted sockets from a multishot accept, kept on the listening Socket
+struct IoAccept {
+  IoUring::Request req;
+  IoUring* ring{ nullptr };
+  Scheduler* sched{ nullptr };
+  std::deque<int> fds;
+  int error{ 0 };
+  bool armed{ false };
+  bool multishot{ false };
+};
+
+static int Setup(unsigned entries, struct io_uring_params* p) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int Register(int fd, unsigned opcode, void* arg, unsigned n) {
+  return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, n));
+}
+
+static bool Probe(int fd) {
+  static const int kOps[] = { IORING_OP_RECV, IORING_OP_SEND, IORING_OP_ACCEPT, IORING_OP_CONNECT,
+                              IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_RECVMSG, IORING_OP_SENDMSG };
+  std::size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* probe = static_cast<struct io_uring_probe*>(calloc(1, size));
+  bool ok = probe && Register(fd, IORING_REGISTER_PROBE, probe, 256) >= 0;
+  for (auto op : kOps) {
+    ok = ok && op < probe->ops_len && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  return ok;
+}
+
+IoUring* IoUring::Create(Scheduler* sched, unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+#if defined(IORING_SETUP_SUBMIT_ALL)
+  p.flags |= IORING_SETUP_SUBMIT_ALL;
+#endif
+  p.cq_entries = entries * 4;
+  int fd = Setup(entries, &p);
+  if (fd < 0 && errno == EINVAL) {
+    // Older kernel, retry without the optional flags
+    memset(&p, 0, sizeof(p));
+    fd = Setup(entries, &p);
+  }
+  if (fd < 0) {
+    return nullptr;
+  }
+  if (!Probe(fd)) {
+    close(fd);
+    return nullptr;
+  }
+
+  Ring* ring = new Ring();
+  ring->fd = ring->enter_fd = fd;
+  ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap) {
+    ring->sq_size = ring->cq_size = ring->sq_size > ring->cq_size ? ring->sq_size : ring->cq_size;
+  }
+  ring->sq_ptr = mmap(nullptr, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring->cq_ptr = single_mmap ? ring->sq_ptr :
+                 mmap(nullptr, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(nullptr, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+    if (sqes != MAP_FAILED) {
+      munmap(sqes, ring->sqes_size);
+    }
+    if (ring->cq_ptr != MAP_FAILED && !single_mmap) {
+      munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr != MAP_FAILED) {
+      munmap(ring->sq_ptr, ring->sq_size);
+    }
+    close(fd);
+    delete ring;
+    return nullptr;
+  }
+
+  char* sq = static_cast<char*>(ring->sq_ptr);
+  ring->sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+  ring->sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+  ring->sq_flags = reinterpret_cast<unsigned*>(sq + p.sq_off.flags);
+  ring->sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+  ring->sq_mask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+  ring->sq_entries = p.sq_entries;
+  ring->sq_local_tail = *ring->sq_tail;
+  ring->sqes = static_cast<struct io_uring_sqe*>(sqes);
+  char* cq = static_cast<char*>(ring->cq_ptr);
+  ring->cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+  ring->cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+  ring->cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+  ring->cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+
+#if defined(IORING_ENTER_REGISTERED_RING)
+  // Saves the fd table lookup on every io_uring_enter
+  struct io_uring_rsrc_update update;
+  memset(&update, 0, sizeof(update));
+  update.offset = -1U;
+  update.data = fd;
+  if (Register(fd, IORING_REGISTER_RING_FDS, &update, 1) == 1) {
+    ring->enter_fd = update.offset;
+    ring->enter_flags = IORING_ENTER_REGISTERED_RING;
+  }
+#endif
+
+  IoUring* uring = new IoUring(sched, ring);
+  ring->poll.data = uring;
+  uv_poll_init(sched->GetLoop(), &ring->poll, fd);
+  uv_poll_start(&ring->poll, UV_READABLE, [](uv_poll_t* w, int status, int events) {
+    (reinterpret_cast<IoUring*>(w->data))->Reap();
+  });
+  return uring;
+}
+
+IoUring::IoUring(Scheduler* sched, Ring* ring)
+  : sched_(sched), ring_(ring) {
+}
+
+IoUring::~IoUring() {
+  munmap(ring_->sqes, ring_->sqes_size);
+  if (ring_->cq_ptr != ring_->sq_ptr) {
+    munmap(ring_->cq_ptr, ring_->cq_size);
+  }
+  munmap(ring_->sq_ptr, ring_->sq_size);
+  close(ring_->fd);
+  delete ring_;
+}
+
+void IoUring::Close() {
+  uv_poll_stop(&ring_->poll);
+  uv_close(reinterpret_cast<uv_handle_t*>(&ring_->poll), nullptr);
+}
+
+int IoUring::Enter(unsigned submit, unsigned wait, unsigned flags) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, ring_->enter_fd, submit, wait,
+                                  flags | ring_->enter_flags, nullptr, 0));
+}
+
+void* IoUring::GetSqe() {
+  Ring* r = ring_;
+  while (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+    // Full: push this batch out early, reaping in case the CQ is backed up
+    Submit();
+    Reap();
+  }
+  unsigned index = r->sq_local_tail & r->sq_mask;
+  struct io_uring_sqe* sqe = &r->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[index] = index;
+  r->sq_local_tail ++;
+  return sqe;
+}
+
+void IoUring::Submit() {
+  Ring* r = ring_;
+  unsigned pending = r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  if (pending == 0) {
+    return;
+  }
+  __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+  // Failures (EAGAIN, EBUSY, EINTR) leave the SQEs queued for the next tick
+  Enter(pending, 0, 0);
+}
+
+void IoUring::Reap() {
+  Ring* r = ring_;
+  unsigned head = *r->cq_head;
+  unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    struct io_uring_cqe* cqe = &r->cqes[head & r->cq_mask];
+    Request* req = reinterpret_cast<Request*>(static_cast<uintptr_t>(cqe->user_data));
+    if (!req) {
+      continue; // cancel requests
+    }
+    if (req->accept) {
+      IoAccept* a = req->accept;
+      if (cqe->res >= 0) {
+        a->fds.push_back(cqe->res);
+      } else if (cqe->res == -EINVAL && a->multishot) {
+        r->multishot_accept = false; // pre-5.19 kernel, re-armed single-shot
+      } else if (cqe->res != -ECANCELED) {
+        a->error = cqe->res;
+      }
+      if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        a->armed = false;
+      }
+    } else {
+      req->res = cqe->res;
+      req->done = true;
+    }
+    if (req->coro && req->coro->GetState() == STATE_WAITING) {
+      req->coro->Wakeup();
+    }
+  }
+  __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+  if (__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+    // Completions the kernel held back while the CQ was full
+    Enter(0, 0, IORING_ENTER_GETEVENTS);
+    Reap();
+  }
+}
+
+void IoUring::Cancel(Request* req) {
+  struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(GetSqe());
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = reinterpret_cast<uintptr_t>(req);
+  sqe->user_data = 0;
+}
+
+Event IoUring::Await(Request* req, long timeout_ms, Condition* cond) {
+  Coroutine* coro = req->coro;
+  coro->SetTimeoutMs(timeout_ms);
+  bool unwound = false;
+  try {
+    if (cond) {
+      cond->Wait(coro);
+    } else {
+      coro->Suspend(STATE_WAITING);
+    }
+  } catch (Unwind&) {
+    unwound = true; // Suspend() throws on a cancel, after the cleanup below
+  }
+  if (req->done && !unwound) {
+    return EVENT_WAKEUP;
+  }
+  // Woken by the deadline, a cancel or cond: the kernel may still write into
+  // buffers on this stack, so take the operation back before returning
+  Event ev = coro->GetEvent();
+  if (!req->done) {
+    Cancel(req);
+    Submit();
+  }
+  if (!sched_->shutdown_) {
+    try {
+      while (!req->done) {
+        coro->Suspend(STATE_WAITING); // Reap() wakes it
+      }
+    } catch (Unwind&) {
+      unwound = true;
+    }
+  }
+  // Only with the loop gone or on a second cancel
+  req->coro = nullptr;
+  while (!req->done) {
+    Enter(0, 1, IORING_ENTER_GETEVENTS);
+    Reap();
+  }
+  if (unwound) {
+    throw Unwind();
+  }
+  return ev;
+}
+
+static int Canceled(int res, Event ev) {
+  if (res == -ECANCELED || res == -EINTR) {
+    return ev == EVENT_TIMEOUT ? -ETIMEDOUT : -ECANCELED;
+  }
+  return res;
+}
+
+int IoUring::Recv(uv_os_sock_t fd, void* buf, int len, long timeout_ms) {
+  if (sched_->shutdown_) {
+    return -ECANCELED;
+  }
+  Request req;
+  req.coro = Coroutine::Self();
+  struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(GetSqe());
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uintptr_t>(buf);
+  sqe->len = len;
+  sqe->user_data = reinterpret_cast<uintptr_t>(&req);
+  Event ev = Await(&req, timeout_ms, nullptr);
+  return Canceled(req.res, ev);
+}
+
+int IoUring::Send(uv_os_sock_t fd, const void* buf, int len, long timeout_ms) {
+  if (sched_->shutdown_) {
+    return -ECANCELED;
+  }
+  Request req;
+  req.coro = Coroutine::Self();
+  struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(GetSqe());
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uintptr_t>(buf);
+  sqe->len = len;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = reinterpret_cast<uintptr_t>(&req);
+  Event ev = Await(&req, timeout_ms, nullptr);
+  return Canceled(req.res, ev);
+}
+
+// uv_buf_t has the layout of struct iovec on Linux
+int IoUring::RecvV(uv_os_sock_t fd, uv_buf_t* bufs, int n, long timeout_ms) {
+  if (sched_->shutdown_) {
+    return -ECANCELED;
+  }
+  Request req;
+  req.coro = Coroutine::Self();
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = reinterpret_cast<struct iovec*>(bufs);
+  msg.msg_iovlen = n;
+  struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(GetSqe());
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uintptr_t>(&msg);
+  sqe->len = 1;
+  sqe->user_data = reinterpret_cast<uintptr_t>(&req);
+  Event ev = Await(&req, timeout_ms, nullptr);
+  return Canceled(req.res, ev);
+}
+
+int IoUring::SendV(uv_os_sock_t fd, const uv_buf_t* bufs, int n, long timeout_ms) {
+  if (sched_->shutdown_) {
+    return -ECANCELED;
+  }
+  Request req;
+  req.coro = Coroutine::Self();
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = reinterpret_cast<struct iovec*>(const_cast<uv_buf_t*>(bufs));
+  msg.msg_iovlen = n;
+  struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(GetSqe());
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uintptr_t>(&msg);
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = reinterpret_cast<uintptr_t>(&req);
+  Event ev = Await(&req, timeout_ms, nullptr);
+  return Canceled(req.res, ev);
+}
+
+int IoUring::Connect(uv_os_sock_t fd, const struct sockaddr* addr, int addrlen, long timeout_ms) {
+  if (sched_->shutdown_) {
+    return -ECANCELED;
+  }
+  Request req;
+  req.coro = Coroutine::Self();
+  struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(GetSqe());
+  sqe->opcode = IORING_OP_CONNECT;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uintptr_t>(addr);
+  sqe->off = addrlen;
+  sqe->user_data = reinterpret_cast<uintptr_t>(&req);
+  Event ev = Await(&req, timeout_ms, nullptr);
+  return Canceled(req.res, ev);
+}
+
+Event IoUring::Poll(uv_os_sock_t fd, int direction, long timeout_ms, Condition* cond) {
+  if (sched_->shutdown_) {
+    return EVENT_CANCEL;
+  }
+  Request req;
+  req.coro = Coroutine::Self();
+  // direction 0 waits for POLLERR/POLLHUP only, e.g. the socket error queue
+  unsigned events = 0;
+  if (direction != 0) {
+    // A peer's shutdown(SHUT_WR) only ends reading, writes still go through
+    events = direction == UV_READABLE ? POLLIN | POLLRDHUP : POLLOUT;
+  }
+#if __BYTE_ORDER == __BIG_ENDIAN
+  events = (events << 16) | (events >> 16);
+#endif
+  struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(GetSqe());
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->user_data = reinterpret_cast<uintptr_t>(&req);
+  Event ev = Await(&req, timeout_ms, cond);
+  if (ev != EVENT_WAKEUP) {
+    return ev;
+  }
+  if (req.res < 0) {
+    return EVENT_POLLERR;
+  }
+  if (req.res & (POLLIN | POLLOUT)) {
+    return direction == UV_READABLE ? EVENT_READABLE : EVENT_WRITABLE;
+  }
+  if (req.res & (POLLRDHUP | POLLHUP)) {
+    return EVENT_DISCONNECT;
+  }
+  return EVENT_POLLERR;
+}
+
+void IoUring::ArmAccept(uv_os_sock_t fd, IoAccept* accept) {
+  struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(GetSqe());
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  accept->multishot = ring_->multishot_accept;
+  if (accept->multishot) {
+    sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+  }
+  sqe->user_data = reinterpret_cast<uintptr_t>(&accept->req);
+  accept->armed = true;
+}
+
+// One multishot accept stays armed on the listening socket and queues
+// connections as they complete; without kernel support it is re-armed as a
+// single-shot accept after each one.
+int IoUring::Accept(uv_os_sock_t fd, IoAccept*& accept, long timeout_ms) {
+  if (!accept) {
+    accept = new IoAccept();
+    accept->req.accept = accept;
+    accept->ring = this;
+    accept->sched = sched_;
+  }
+  if (accept->ring != this) {
+    // The listener moved to another scheduler: take the accept back from
+    // the old ring, with the connections it queued, and re-arm it here
+    DisarmAccept(accept);
+    accept->ring = this;
+    accept->sched = sched_;
+  }
+
+  for (;;) {
+    if (!accept->fds.empty()) {
+      int s = accept->fds.front();
+      accept->fds.pop_front();
+      return s;
+    }
+    if (accept->error) {
+      int error = accept->error;
+      accept->error = 0;
+      return error;
+    }
+    if (sched_->shutdown_) {
+      return -ECANCELED;
+    }
+    if (!accept->armed) {
+      ArmAccept(fd, accept);
+    }
+    Coroutine* coro = Coroutine::Self();
+    accept->req.coro = coro;
+    coro->SetTimeoutMs(timeout_ms);
+    try {
+      coro->Suspend(STATE_WAITING);
+    } catch (Unwind&) {
+      if (accept) {
+        accept->req.coro = nullptr; // stays armed, the Socket closes it
+      }
+      throw;
+    }
+    if (!accept) {
+      return -ECANCELED; // the listener was closed
+    }
+    accept->req.coro = nullptr;
+    // The accept itself owns no stack memory, so it stays armed on timeout
+    if (accept->fds.empty() && !accept->error && coro->GetEvent() != EVENT_WAKEUP) {
+      return coro->GetEvent() == EVENT_TIMEOUT ? -ETIMEDOUT : -ECANCELED;
+    }
+  }
+}
+
+void IoUring::DisarmAccept(IoAccept* accept) {
+  // Runs on the listener's scheduler, the only one reaping its completions
+  Coroutine* coro = Coroutine::Self();
+  Scheduler* home = coro->GetScheduler();
+  coro->MoveTo(accept->sched);
+  IoUring* ring = accept->ring;
+  bool unwound = false;
+  if (accept->armed) {
+    ring->Cancel(&accept->req);
+    ring->Submit();
+    Coroutine* waiter = accept->req.coro; // e.g. parked in Accept()
+    if (!accept->sched->shutdown_) {
+      accept->req.coro = coro;
+      try {
+        while (accept->armed) {
+          coro->Suspend(STATE_WAITING); // Reap() wakes it
+        }
+      } catch (Unwind&) {
+        unwound = true;
+      }
+      accept->req.coro = waiter;
+    }
+    while (accept->armed) {
+      ring->Enter(0, 1, IORING_ENTER_GETEVENTS);
+      ring->Reap();
+    }
+    if (waiter && waiter != coro && waiter->GetState() == STATE_WAITING) {
+      waiter->Wakeup();
+    }
+  }
+  coro->MoveTo(home);
+  if (unwound) {
+    throw Unwind();
+  }
+}
+
+void IoUring::CloseAccept(IoAccept* accept) {
+  bool unwound = false;
+  try {
+    DisarmAccept(accept);
+  } catch (Unwind&) {
+    unwound = true;
+  }
+  for (auto fd : accept->fds) {
+    close(fd);
+  }
+  delete accept;
+  if (unwound) {
+    throw Unwind();
+  }
+}
+
+#else
+
+IoUring* IoUring::Create(Scheduler* sched, unsigned entries) {
+  return nullptr;
+}
+
+IoUring::~IoUring() {
+}
+
+int IoUring::Recv(uv_os_sock_t fd, void* buf, int len, long timeout_ms) {
+  return -ENOSYS;
+}
+
+int IoUring::Send(uv_os_sock_t fd, const void* buf, int len, long timeout_ms) {
+  return -ENOSYS;
+}
+
+int IoUring::RecvV(uv_os_sock_t fd, uv_buf_t* bufs, int n, long timeout_ms) {
+  return -ENOSYS;
+}
+
+int IoUring::SendV(uv_os_sock_t fd, const uv_buf_t* bufs, int n, long timeout_ms) {
+  return -ENOSYS;
+}
+
+int IoUring::Connect(uv_os_sock_t fd, const struct sockaddr* addr, int addrlen, long timeout_ms) {
+  return -ENOSYS;
+}
+
+int IoUring::Accept(uv_os_sock_t fd, IoAccept*& accept, long timeout_ms) {
+  return -ENOSYS;
+}
+
+Event IoUring::Poll(uv_os_sock_t fd, int direction, long timeout_ms, Condition* cond) {
+  return EVENT_POLLERR;
+}
+
+void IoUring::CloseAccept(IoAccept* accept) {
+}
+
+void IoUring::Submit() {
+}
+
+void IoUring::Reap() {
+}
+
+void IoUring::Close() {
+}
+
+#endif
+
+} // coros
@@ -0,0 +1,674 @@
+#include "coros.h"
+#include <cassert>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+#if defined(_WIN32)
+#include <ws2tcpip.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#endif
+
+namespace coros {
+
+static const int kDnsPort = 53;
+static const int kMaxMessage = 1232; // EDNS's safe UDP payload
+static const int kMaxTcpMessage = 65535;
+static const uint32_t kMaxTtl = 86400;
+static const uint16_t kTypeA = 1;
+static const uint16_t kTypeSoa = 6;
+static const uint16_t kTypeAaaa = 28;
+static const uint16_t kTypeOpt = 41;
+static const int kRcodeNxDomain = 3;
+
+struct Resolver::Entry {
+  std::vector<IpAddress> addrs; // empty: no such host
+  uint64_t expires{ 0 }; // uv_hrtime()
+  bool pending{ true }; // the first coroutine is still asking
+  WaitGroup done; // the others wait here
+};
+
+struct Resolver::Answer {
+  std::vector<IpAddress> addrs;
+  uint32_t ttl{ kMaxTtl };
+};
+
+bool IpAddress::Parse(const std::string& text) {
+  if (uv_inet_pton(AF_INET, text.c_str(), bytes) == 0) {
+    family = AF_INET;
+    return true;
+  }
+  if (uv_inet_pton(AF_INET6, text.c_str(), bytes) == 0) {
+    family = AF_INET6;
+    return true;
+  }
+  return false;
+}
+
+socklen_t IpAddress::ToSockaddr(int port, struct sockaddr_storage* addr) const {
+  memset(addr, 0, sizeof(*addr));
+  if (family == AF_INET6) {
+    struct sockaddr_in6* a = reinterpret_cast<struct sockaddr_in6*>(addr);
+    a->sin6_family = AF_INET6;
+    a->sin6_port = htons(static_cast<uint16_t>(port));
+    memcpy(&a->sin6_addr, bytes, 16);
+    return sizeof(*a);
+  }
+  struct sockaddr_in* a = reinterpret_cast<struct sockaddr_in*>(addr);
+  a->sin_family = AF_INET;
+  a->sin_port = htons(static_cast<uint16_t>(port));
+  memcpy(&a->sin_addr, bytes, 4);
+  return sizeof(*a);
+}
+
+std::string IpAddress::ToString() const {
+  char text[64];
+  if (uv_inet_ntop(family, bytes, text, sizeof(text)) != 0) {
+    return std::string();
+  }
+  return text;
+}
+
+static bool operator==(const IpAddress& a, const IpAddress& b) {
+  return a.family == b.family && memcmp(a.bytes, b.bytes, a.family == AF_INET6 ? 16 : 4) == 0;
+}
+
+// Lower case, without the root's trailing dot
+static std::string CanonicalName(const std::string& host) {
+  std::string name(host);
+  if (!name.empty() && name.back() == '.') {
+    name.pop_back();
+  }
+  std::transform(name.begin(), name.end(), name.begin(), [](char c) {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+  });
+  return name;
+}
+
+static bool ValidName(const std::string& name) {
+  if (name.empty() || name.size() > 253) {
+    return false;
+  }
+  std::size_t label = 0;
+  for (char c : name) {
+    if (c == '.') {
+      if (label == 0) {
+        return false;
+      }
+      label = 0;
+    } else if (++label > 63) {
+      return false;
+    }
+  }
+  return label > 0;
+}
+
+static bool ParseServer(const std::string& text, IpAddress* ip, int* port) {
+  std::string host(text);
+  *port = kDnsPort;
+  std::size_t colon = text.rfind(':');
+  if (!text.empty() && text[0] == '[') {
+    std::size_t close = text.find(']');
+    if (close == std::string::npos) {
+      return false;
+    }
+    host = text.substr(1, close - 1);
+    if (close + 1 < text.size()) {
+      if (text[close + 1] != ':') {
+        return false;
+      }
+      *port = atoi(text.c_str() + close + 2);
+    }
+  } else if (colon != std::string::npos && text.find(':') == colon) {
+    host = text.substr(0, colon); // one colon: ipv4:port
+    *port = atoi(text.c_str() + colon + 1);
+  }
+  return *port > 0 && *port < 65536 && ip->Parse(host);
+}
+
+// IPv6 first, keeping the order within each family
+static void SortAddresses(std::vector<IpAddress>* addrs) {
+  std::stable_sort(addrs->begin(), addrs->end(), [](const IpAddress& a, const IpAddress& b) {
+    return a.family == AF_INET6 && b.family != AF_INET6;
+  });
+}
+
+static void PutU16(std::string* out, uint16_t v) {
+  out->push_back(static_cast<char>(v >> 8));
+  out->push_back(static_cast<char>(v & 0xff));
+}
+
+static uint16_t GetU16(const unsigned char* p) {
+  return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+static uint32_t GetU32(const unsigned char* p) {
+  return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static std::string BuildQuery(uint16_t id, const std::string& name, uint16_t type) {
+  std::string q;
+  PutU16(&q, id);
+  PutU16(&q, 0x0100); // recursion desired
+  PutU16(&q, 1); // one question
+  PutU16(&q, 0);
+  PutU16(&q, 0);
+  PutU16(&q, 1); // the OPT record
+  std::size_t start = 0;
+  while (start < name.size()) {
+    std::size_t dot = name.find('.', start);
+    if (dot == std::string::npos) {
+      dot = name.size();
+    }
+    q.push_back(static_cast<char>(dot - start));
+    q.append(name, start, dot - start);
+    start = dot + 1;
+  }
+  q.push_back(0);
+  PutU16(&q, type);
+  PutU16(&q, 1); // IN
+  // EDNS0 (RFC 6891): without it servers cut UDP answers at 512 bytes
+  q.push_back(0); // root
+  PutU16(&q, kTypeOpt);
+  PutU16(&q, kMaxMessage); // our UDP payload size
+  PutU16(&q, 0); // extended rcode and version
+  PutU16(&q, 0); // flags
+  PutU16(&q, 0); // no options
+  return q;
+}
+
+// Reads the (possibly compressed) name at `off` into `name`; returns the offset after it, -1 if malformed
+static int ReadName(const unsigned char* msg, int len, int off, std::string* name) {
+  int end = -1;
+  for (int jumps = 0; off < len; ) {
+    int n = msg[off];
+    if (n == 0) {
+      return end < 0 ? off + 1 : end;
+    }
+    if ((n & 0xc0) == 0xc0) {
+      if (off + 1 >= len || ++jumps > 32) {
+        return -1;
+      }
+      if (end < 0) {
+        end = off + 2;
+      }
+      off = ((n & 0x3f) << 8) | msg[off + 1];
+      continue;
+    }
+    if (n > 63 || off + 1 + n > len) {
+      return -1;
+    }
+    if (name) {
+      if (!name->empty()) {
+        name->push_back('.');
+      }
+      name->append(reinterpret_cast<const char*>(msg + off + 1), n);
+    }
+    off += 1 + n;
+  }
+  return -1;
+}
+
+// 1 for an answer (possibly without addresses), 0 for another message, -1 if
+// the server failed, 2 if the answer was truncated and must be asked over TCP
+static int ParseResponse(const unsigned char* msg, int len, uint16_t id, const std::string& name,
+                         uint16_t type, std::vector<IpAddress>* addrs, uint32_t* ttl, bool* nxdomain) {
+  if (len < 12 || GetU16(msg) != id || !(msg[2] & 0x80) || GetU16(msg + 4) != 1) {
+    return 0;
+  }
+  std::string qname;
+  int off = ReadName(msg, len, 12, &qname);
+  if (off < 0 || off + 4 > len || CanonicalName(qname) != name || GetU16(msg + off) != type) {
+    return 0;
+  }
+  off += 4;
+  int rcode = msg[3] & 0x0f;
+  if (msg[2] & 0x02) {
+    return 2;
+  }
+  *nxdomain = rcode == kRcodeNxDomain;
+  if (rcode != 0 && !*nxdomain) {
+    return -1;
+  }
+  int answers = GetU16(msg + 6);
+  int authority = GetU16(msg + 8);
+  uint32_t min_ttl = kMaxTtl;
+  bool found = false;
+  uint32_t soa_ttl = 0;
+  bool soa = false;
+  for (int i = 0; i < answers + authority; i++) {
+    off = ReadName(msg, len, off, nullptr);
+    if (off < 0 || off + 10 > len) {
+      return -1;
+    }
+    uint16_t rtype = GetU16(msg + off);
+    uint32_t rttl = GetU32(msg + off + 4);
+    int rdlength = GetU16(msg + off + 8);
+    off += 10;
+    if (off + rdlength > len) {
+      return -1;
+    }
+    if (i < answers && rtype == type && rdlength == (type == kTypeAaaa ? 16 : 4)) {
+      IpAddress ip;
+      ip.family = type == kTypeAaaa ? AF_INET6 : AF_INET;
+      memcpy(ip.bytes, msg + off, rdlength);
+      addrs->push_back(ip);
+      min_ttl = std::min(min_ttl, rttl);
+      found = true;
+    } else if (i >= answers && rtype == kTypeSoa && rdlength >= 22) {
+      // RFC 2308: the lesser of the SOA's own TTL and its MINIMUM field
+      soa_ttl = std::min(rttl, GetU32(msg + off + rdlength - 4));
+      soa = true;
+    }
+    off += rdlength;
+  }
+  if (found) {
+    *ttl = std::min(*ttl, min_ttl);
+  } else if (soa) {
+    *ttl = std::min(*ttl, soa_ttl);
+  }
+  return 1;
+}
+
+// One question over TCP (RFC 7766), both ways framed by a two-byte length;
+// ParseResponse's result, -1 if the connection failed
+int Resolver::QueryTcp(const IpAddress& server, int port, uint16_t id, const std::string& name, uint16_t type,
+                       uint64_t deadline, std::vector<IpAddress>* addrs, uint32_t* ttl, bool* nxdomain) {
+  uint64_t now = uv_hrtime();
+  if (now >= deadline) {
+    return -1;
+  }
+  std::string q = BuildQuery(id, name, type);
+  std::string framed;
+  PutU16(&framed, static_cast<uint16_t>(q.size()));
+  framed += q;
+  std::vector<unsigned char> msg(2 + kMaxTcpMessage);
+  int rc = -1;
+  Socket s;
+  try {
+    s.SetDeadlineMs(static_cast<long>((deadline - now + 999999) / 1000000));
+    if (s.ConnectRace(std::vector<IpAddress>(1, server), port) && // any family, unlike ConnectIp
+        s.WriteExactly(framed.data(), static_cast<int>(framed.size())) == static_cast<int>(framed.size())) {
+      int size = 0;
+      int need = 2;
+      while (size < need) {
+        int n = s.ReadSome(reinterpret_cast<char*>(&msg[size]), static_cast<int>(msg.size()) - size);
+        if (n <= 0) {
+          break;
+        }
+        size += n;
+        if (need == 2 && size >= 2) {
+          need = 2 + GetU16(&msg[0]);
+        }
+      }
+      if (size >= need && need > 2) {
+        rc = ParseResponse(&msg[2], need - 2, id, name, type, addrs, ttl, nxdomain);
+      }
+    }
+  } catch (Unwind&) {
+    s.Close();
+    throw;
+  }
+  s.Close();
+  return rc == 1 ? 1 : -1;
+}
+
+static uv_os_sock_t CreateUdpSocket(int family) {
+  uv_os_sock_t s = ::socket(family, SOCK_DGRAM, 0);
+  if (s != BAD_SOCKET) {
+#ifdef _WIN32
+    unsigned long on = 1;
+    ioctlsocket(s, FIONBIO, &on);
+#else
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(s, F_SETFD, FD_CLOEXEC);
+#endif
+  }
+  return s;
+}
+
+Resolver* Resolver::Default() {
+  static Resolver resolver;
+  return &resolver;
+}
+
+Resolver::Resolver() {
+#if defined(_WIN32)
+  LoadHosts("C:\\Windows\\System32\\drivers\\etc\\hosts");
+#else
+  LoadConfig("/etc/resolv.conf");
+  LoadHosts("/etc/hosts");
+#endif
+  if (servers_.empty()) {
+    IpAddress local;
+    local.Parse("127.0.0.1");
+    servers_.push_back(std::make_pair(local, kDnsPort));
+  }
+}
+
+void Resolver::LoadConfig(const std::string& path) {
+  std::ifstream in(path.c_str());
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream words(line.substr(0, line.find_first_of("#;")));
+    std::string key, value;
+    words >> key;
+    if (key == "nameserver" && words >> value) {
+      IpAddress ip;
+      int port;
+      if (ParseServer(value, &ip, &port)) {
+        servers_.push_back(std::make_pair(ip, port));
+      }
+    } else if (key == "domain" || key == "search") {
+      search_.clear(); // the last one wins
+      while (words >> value) {
+        search_.push_back(CanonicalName(value));
+      }
+    } else if (key == "options") {
+      while (words >> value) {
+        if (value.compare(0, 6, "ndots:") == 0) {
+          ndots_ = atoi(value.c_str() + 6);
+        } else if (value.compare(0, 8, "timeout:") == 0) {
+          timeout_ms_ = std::max(1, atoi(value.c_str() + 8)) * 1000L;
+        } else if (value.compare(0, 9, "attempts:") == 0) {
+          attempts_ = std::max(1, atoi(value.c_str() + 9));
+        }
+      }
+    }
+  }
+}
+
+bool Resolver::LoadHosts(const std::string& path) {
+  std::ifstream in(path.c_str());
+  if (!in) {
+    return false;
+  }
+  std::unordered_map<std::string, std::vector<IpAddress> > hosts;
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream words(line.substr(0, line.find('#')));
+    std::string addr, name;
+    IpAddress ip;
+    if (!(words >> addr) || !ip.Parse(addr)) {
+      continue;
+    }
+    while (words >> name) {
+      std::vector<IpAddress>& addrs = hosts[CanonicalName(name)];
+      if (std::find(addrs.begin(), addrs.end(), ip) == addrs.end()) {
+        addrs.push_back(ip);
+      }
+    }
+  }
+  for (auto& h : hosts) {
+    SortAddresses(&h.second);
+  }
+  std::lock_guard<std::mutex> l(lock_);
+  hosts_.swap(hosts);
+  return true;
+}
+
+void Resolver::SetNameservers(const std::vector<std::string>& servers) {
+  std::vector<std::pair<IpAddress, int> > parsed;
+  for (auto& text : servers) {
+    IpAddress ip;
+    int port;
+    if (ParseServer(text, &ip, &port)) {
+      parsed.push_back(std::make_pair(ip, port));
+    }
+  }
+  std::lock_guard<std::mutex> l(lock_);
+  servers_.swap(parsed);
+}
+
+void Resolver::SetTimeoutMs(long timeout_ms) {
+  std::lock_guard<std::mutex> l(lock_);
+  timeout_ms_ = timeout_ms;
+}
+
+void Resolver::SetAttempts(int attempts) {
+  std::lock_guard<std::mutex> l(lock_);
+  attempts_ = std::max(1, attempts);
+}
+
+void Resolver::SetNegativeTtl(int secs) {
+  std::lock_guard<std::mutex> l(lock_);
+  negative_ttl_ = std::max(0, secs);
+}
+
+void Resolver::SetHostsOnly(bool hosts_only) {
+  std::lock_guard<std::mutex> l(lock_);
+  hosts_only_ = hosts_only;
+}
+
+void Resolver::Clear() {
+  std::lock_guard<std::mutex> l(lock_);
+  for (auto it = cache_.begin(); it != cache_.end(); ) {
+    if (it->second->pending) {
+      ++it; // its coroutine removes or fills it
+    } else {
+      it = cache_.erase(it);
+    }
+  }
+}
+
+ResolverStats Resolver::GetStats() const {
+  ResolverStats stats;
+  stats.lookups = lookups_;
+  stats.hits = hits_;
+  stats.negative_hits = negative_hits_;
+  stats.coalesced = coalesced_;
+  stats.queries = queries_;
+  stats.failures = failures_;
+  return stats;
+}
+
+bool Resolver::Resolve(const std::string& host, std::vector<IpAddress>* addrs) {
+  lookups_++;
+  addrs->clear();
+  IpAddress ip;
+  if (ip.Parse(host)) {
+    addrs->push_back(ip);
+    return true;
+  }
+  std::string name = CanonicalName(host);
+  if (!ValidName(name)) {
+    return false;
+  }
+
+  std::unique_lock<std::mutex> l(lock_);
+  auto h = hosts_.find(name);
+  if (h != hosts_.end()) {
+    hits_++;
+    *addrs = h->second;
+    return true;
+  }
+  std::shared_ptr<Entry> e;
+  auto it = cache_.find(name);
+  if (it != cache_.end()) {
+    e = it->second;
+    if (e->pending) {
+      coalesced_++;
+      l.unlock();
+      e->done.Wait();
+      *addrs = e->addrs; // fixed once done
+      return !addrs->empty();
+    }
+    if (uv_hrtime() < e->expires) {
+      if (e->addrs.empty()) {
+        negative_hits_++;
+        return false;
+      }
+      hits_++;
+      *addrs = e->addrs;
+      return true;
+    }
+    cache_.erase(it);
+  }
+  if (hosts_only_) {
+    return false;
+  }
+  e = std::make_shared<Entry>();
+  e->done.Add(1);
+  cache_[name] = e;
+  l.unlock();
+
+  Answer answer;
+  bool ok = false;
+  bool unwound = false;
+  try {
+    ok = Query(name, &answer);
+  } catch (Unwind&) {
+    unwound = true; // the waiters see a failure and may ask again
+  }
+  l.lock();
+  it = cache_.find(name);
+  bool cached = it != cache_.end() && it->second == e;
+  if (ok) {
+    e->addrs = answer.addrs;
+    e->expires = uv_hrtime() + static_cast<uint64_t>(answer.ttl) * 1000000000;
+  } else if (cached) {
+    cache_.erase(it); // failures are not cached
+  }
+  e->pending = false;
+  l.unlock();
+  e->done.Done();
+  if (unwound) {
+    throw Unwind();
+  }
+  if (!ok) {
+    failures_++;
+  }
+  *addrs = e->addrs;
+  return !addrs->empty();
+}
+
+// `name` as given when it has ndots dots, after the search domains otherwise
+bool Resolver::Query(const std::string& name, Answer* answer) {
+  std::unique_lock<std::mutex> l(lock_);
+  std::vector<std::pair<IpAddress, int> > servers(servers_);
+  std::vector<std::string> names;
+  bool absolute = std::count(name.begin(), name.end(), '.') >= ndots_;
+  if (absolute) {
+    names.push_back(name);
+  }
+  for (auto& domain : search_) {
+    names.push_back(name + "." + domain);
+  }
+  if (!absolute) {
+    names.push_back(name);
+  }
+  int attempts = attempts_;
+  uint32_t negative_ttl = static_cast<uint32_t>(negative_ttl_);
+  l.unlock();
+  if (servers.empty()) {
+    return false;
+  }
+
+  bool answered = false;
+  answer->ttl = negative_ttl;
+  for (auto& n : names) {
+    if (!ValidName(n)) {
+      continue;
+    }
+    bool done = false;
+    for (std::size_t i = 0; i < servers.size() * attempts && !done; i++) {
+      auto& server = servers[i % servers.size()]; // rotate on timeouts and failures
+      Answer a;
+      done = QueryServer(server.first, server.second, n, &a);
+      if (done) {
+        answered = true;
+        if (!a.addrs.empty()) {
+          *answer = a;
+          return true;
+        }
+        answer->ttl = std::min(answer->ttl, a.ttl);
+      }
+    }
+  }
+  return answered;
+}
+
+// A and AAAA at once over one UDP socket; true once both are answered
+bool Resolver::QueryServer(const IpAddress& server, int port, const std::string& name, Answer* answer) {
+  queries_++;
+  struct sockaddr_storage addr;
+  socklen_t addrlen = server.ToSockaddr(port, &addr);
+  uv_os_sock_t fd = CreateUdpSocket(server.family);
+  if (fd == BAD_SOCKET) {
+    return false;
+  }
+  if (::connect(fd, reinterpret_cast<struct sockaddr*>(&addr), addrlen) != 0) {
+#if defined(_WIN32)
+    ::closesocket(fd);
+#else
+    ::close(fd);
+#endif
+    return false;
+  }
+
+  static std::atomic<uint16_t> next_id{ static_cast<uint16_t>(uv_hrtime()) };
+  uint16_t ids[2] = { next_id.fetch_add(2), 0 };
+  ids[1] = static_cast<uint16_t>(ids[0] + 1);
+  const uint16_t types[2] = { kTypeAaaa, kTypeA };
+  std::vector<IpAddress> addrs[2];
+  bool answered[2] = { false, false };
+  bool nxdomain = false;
+  bool failed = false;
+
+  lock_.lock();
+  long timeout_ms = timeout_ms_;
+  lock_.unlock();
+  uint64_t deadline = uv_hrtime() + static_cast<uint64_t>(timeout_ms) * 1000000;
+  Socket s(fd);
+  try {
+    s.SetDeadlineMs(timeout_ms);
+    for (int i = 0; i < 2 && !failed; i++) {
+      std::string q = BuildQuery(ids[i], name, types[i]);
+      failed = s.WriteSome(q.data(), static_cast<int>(q.size())) != static_cast<int>(q.size());
+    }
+    unsigned char buf[kMaxMessage];
+    while (!failed && !(answered[0] && answered[1]) && !nxdomain) {
+      uint64_t now = uv_hrtime();
+      if (now >= deadline) {
+        failed = true;
+        break;
+      }
+      s.SetDeadlineMs(static_cast<long>((deadline - now + 999999) / 1000000));
+      int n = s.ReadSome(reinterpret_cast<char*>(buf), sizeof(buf));
+      if (n <= 0) {
+        failed = true; // timed out, or ICMP port unreachable
+        break;
+      }
+      for (int i = 0; i < 2; i++) {
+        if (answered[i]) {
+          continue;
+        }
+        int rc = ParseResponse(buf, n, ids[i], name, types[i], &addrs[i], &answer->ttl, &nxdomain);
+        if (rc == 2) {
+          rc = QueryTcp(server, port, ids[i], name, types[i], deadline, &addrs[i], &answer->ttl, &nxdomain);
+        }
+        if (rc != 0) {
+          answered[i] = true;
+          failed = rc < 0;
+          break;
+        }
+      }
+    }
+  } catch (Unwind&) {
+    s.Close();
+    throw;
+  }
+  s.Close();
+  if (failed) {
+    return false;
+  }
+  answer->addrs = addrs[0];
+  answer->addrs.insert(answer->addrs.end(), addrs[1].begin(), addrs[1].end());
+  answer->ttl = std::min(answer->ttl, kMaxTtl);
+  return true;
+}
+
+} // coros
@@ -0,0 +1,216 @@
+#include "coros.h"
+#include <cassert>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace coros {
+
+static std::size_t MapGranularity() {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwAllocationGranularity;
+#else
+  return static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+// Maps `size` bytes twice, the second view right after the first
+static char* MapMirror(std::size_t size) {
+#ifdef _WIN32
+  HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                      static_cast<DWORD>(static_cast<uint64_t>(size) >> 32),
+                                      static_cast<DWORD>(size), NULL);
+  if (!mapping) {
+    return nullptr;
+  }
+  char* base = nullptr;
+  // Another thread can take the range between VirtualFree and the views
+  for (int attempt = 0; attempt < 16 && !base; attempt++) {
+    char* addr = static_cast<char*>(VirtualAlloc(NULL, size * 2, MEM_RESERVE, PAGE_NOACCESS));
+    if (!addr) {
+      break;
+    }
+    VirtualFree(addr, 0, MEM_RELEASE);
+    char* low = static_cast<char*>(MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size, addr));
+    char* high = low ? static_cast<char*>(MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size, addr + size)) : nullptr;
+    if (low == addr && high == addr + size) {
+      base = addr;
+    } else {
+      if (low) {
+        UnmapViewOfFile(low);
+      }
+      if (high) {
+        UnmapViewOfFile(high);
+      }
+    }
+  }
+  CloseHandle(mapping); // the views keep it alive
+  return base;
+#else
+#if defined(__linux__)
+  int fd = memfd_create("coros-ring", MFD_CLOEXEC);
+#else
+  char name[64];
+  snprintf(name, sizeof(name), "/coros-ring-%d-%p", static_cast<int>(getpid()), static_cast<void*>(&name));
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd >= 0) {
+    shm_unlink(name);
+  }
+#endif
+  if (fd < 0) {
+    return nullptr;
+  }
+  char* base = nullptr;
+  if (ftruncate(fd, size) == 0) {
+    void* addr = mmap(nullptr, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr != MAP_FAILED) {
+      char* low = static_cast<char*>(addr);
+      if (mmap(low, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+          mmap(low + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED) {
+        base = low;
+      } else {
+        munmap(addr, size * 2);
+      }
+    }
+  }
+  close(fd); // the mappings keep it alive
+  return base;
+#endif
+}
+
+static void UnmapMirror(char* base, std::size_t size) {
+#ifdef _WIN32
+  UnmapViewOfFile(base);
+  UnmapViewOfFile(base + size);
+#else
+  munmap(base, size * 2);
+#endif
+}
+
+RingBuffer::RingBuffer(Socket* s, std::size_t capacity, std::size_t max_capacity)
+  : max_capacity_(max_capacity), s_(s) {
+  Grow(capacity); // see Valid()
+}
+
+RingBuffer::~RingBuffer() {
+  if (base_) {
+    UnmapMirror(base_, capacity_);
+  }
+}
+
+bool RingBuffer::Grow(std::size_t need) {
+  std::size_t capacity = capacity_ ? capacity_ : MapGranularity();
+  while (capacity < need) {
+    capacity *= 2;
+  }
+  if (capacity == capacity_) {
+    return true;
+  }
+  if (capacity > max_capacity_ && capacity_ != 0) {
+    return false;
+  }
+  char* base = MapMirror(capacity);
+  if (!base) {
+    return false;
+  }
+  if (base_) {
+    memcpy(base, Data(), size_);
+    UnmapMirror(base_, capacity_);
+  }
+  base_ = base;
+  capacity_ = capacity;
+  head_ = 0;
+  return true;
+}
+
+int RingBuffer::EnsureData(int n) {
+  if (Size() >= n) {
+    return n;
+  }
+  // ReadAtLeast wants room beyond the minimum
+  if (static_cast<std::size_t>(n) >= capacity_ && !Grow(n + 1)) {
+    return -1;
+  }
+  int rc = s_->ReadAtLeast(Space(), SpaceSize(), n - Size());
+  if (rc <= 0) {
+    return rc;
+  }
+  Commit(rc);
+  return Size() >= n ? n : -1;
+}
+
+int RingBuffer::ReadUntil(char delim) {
+  int scanned = 0;
+  for (;;) {
+    const char* begin = Data();
+    const char* hit = FindByte(begin + scanned, begin + Size(), delim);
+    if (hit) {
+      return static_cast<int>(hit - begin) + 1;
+    }
+    scanned = Size();
+    if (SpaceSize() == 0 && !Grow(capacity_ * 2)) {
+      return -1;
+    }
+    int rc = s_->ReadSome(Space(), SpaceSize());
+    if (rc <= 0) {
+      return rc;
+    }
+    Commit(rc);
+  }
+}
+
+int RingBuffer::EnsureSpace(int n) {
+  if (SpaceSize() >= n) {
+    return n;
+  }
+  if (Grow(size_ + n)) {
+    return n;
+  }
+  if (capacity_ < static_cast<std::size_t>(n)) {
+    return -1;
+  }
+  // At the cap: make room by writing out what is buffered
+  int rc = Flush();
+  if (rc < 0 || Size() != 0) {
+    return rc;
+  }
+  return n;
+}
+
+int RingBuffer::Flush() {
+  int size = Size();
+  int rc = s_->WriteExactly(Data(), size);
+  if (rc != size) {
+    return rc;
+  }
+  Clear();
+  return size;
+}
+
+int RingBuffer::Flush(const uv_buf_t* tail, int n) {
+  uv_buf_t bufs[16];
+  int head = n < 15 ? n : 15;
+  int size = Size();
+  bufs[0] = uv_buf_init(Data(), size);
+  for (int i = 0; i < head; i++) {
+    bufs[i + 1] = tail[i];
+    size += static_cast<int>(tail[i].len);
+  }
+  int rc = s_->WriteExactlyV(bufs, head + 1);
+  if (rc != size) {
+    return rc;
+  }
+  Clear();
+  if (head < n) {
+    rc += s_->WriteExactlyV(tail + head, n - head); // short on failure, as above
+  }
+  return rc;
+}
+
+} // coros
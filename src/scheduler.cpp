@@ -5,34 +5,15 @@
 
 namespace coros {
 
-static const int kSweepInterval = 1000;
-
 thread_local Scheduler* local_sched = nullptr;
 
-class ComputeThreads {
-public:
-  void Start(int compute_threads_n);
-  void Stop();
-  void Add(Coroutine* coro);
-
-protected:
-  void Consume();
-
-protected:
-  bool stop_{ false };
-  std::vector<std::thread> threads_;
-  std::mutex lock_;
-  std::condition_variable cond_;
-  CoroutineList pending_;
-};
-
-ComputeThreads compute_threads;
-
 Scheduler::Scheduler(bool is_default, int compute_threads_n)
   : is_default_(is_default) {
   if (is_default) {
     loop_ptr_ = uv_default_loop();
-    compute_threads.Start(compute_threads_n);
+    int max_threads = static_cast<int>(std::thread::hardware_concurrency());
+    Executor::Configure("default", compute_threads_n,
+                        max_threads > compute_threads_n ? max_threads : compute_threads_n);
   } else {
     uv_loop_init(&loop_);
     loop_ptr_ = &loop_;
@@ -57,78 +38,153 @@ Scheduler::Scheduler(bool is_default, int compute_threads_n)
     (reinterpret_cast<Scheduler*>(handle->data))->Async();
   });
 
-  sweep_timer_.data = this;
-  uv_timer_init(loop_ptr_, &sweep_timer_);
-  uv_timer_start(&sweep_timer_, [](uv_timer_t* handle) {
-    (reinterpret_cast<Scheduler*>(handle->data))->Sweep();
-  }, kSweepInterval, kSweepInterval);
+  wheel_timer_.data = this;
+  uv_timer_init(loop_ptr_, &wheel_timer_);
 
   local_sched = this;
   id_ = NextId();
 }
 
 void Scheduler::Pre() {
-  Check();
-}
-
-template<typename T>
-inline void FastDelVectorItem(std::vector<T>& v, std::size_t i) {
-  assert(i >= 0 && i < v.size());
-  v[i] = v[v.size() - 1];
-  v.pop_back();
+  // About to poll: from here on producers must signal
+  awake_ = false;
+  DrainInbox();
+  if (stealing_ && ready_.Empty()) {
+    Reclaim();
+    if (ready_.Empty()) {
+      Steal();
+    }
+  }
+  RunCoros();
+  FlushSockets();
+  if (stealing_ && ready_.Empty()) {
+    Reclaim(); // offered while it still had others to run, and not taken since
+    if (!ready_.Empty()) {
+      uv_async_send(&async_);
+    }
+  }
+  idle_ = ready_.Empty();
+  load_.store(static_cast<int>(ready_.Size() + waiting_.Size()), std::memory_order_relaxed);
+  if (uring_) {
+    uring_->Submit(); // everything queued this iteration, in one syscall
+  }
 }
 
 void Scheduler::Check() {
-  for (std::size_t i = 0; i < waiting_.size();) {
-    Coroutine* c = waiting_[i];
-    if (c->GetState() == STATE_READY) {
-      ready_.push_back(c);
-      FastDelVectorItem<Coroutine* >(waiting_, i);
-      continue;
-    }
-    i++;
-  }
+  awake_ = true;
+  idle_ = false;
+  DrainInbox();
   RunCoros();
 }
 
 void Scheduler::Async() {
-  std::lock_guard<std::mutex> l(lock_);
-  if (posted_.size() > 0) {
-    ready_.insert(ready_.end(), posted_.begin(), posted_.end());
-    posted_.clear();
+  DrainInbox();
+  if (stealing_ && ready_.Empty()) {
+    Steal();
   }
-  if (compute_done_.size() > 0) {
-    ready_.insert(ready_.end(), compute_done_.begin(), compute_done_.end());
-    outstanding_ -= compute_done_.size();
-    compute_done_.clear();
+}
+
+void Scheduler::DrainInbox() {
+  Coroutine* c = inbox_.exchange(nullptr);
+  Coroutine* fifo = nullptr;
+  int n = 0;
+  while (c) {
+    Coroutine* next = c->inbox_next_;
+    c->inbox_next_ = fifo;
+    fifo = c;
+    c = next;
+    n ++;
+  }
+  if (n > 0) {
+    inbound_.fetch_sub(n, std::memory_order_relaxed);
+  }
+  while (fifo) {
+    c = fifo;
+    fifo = c->inbox_next_;
+    c->inbox_next_ = nullptr;
+    if (c->GetState() == STATE_DONE) {
+      c->Destroy(); // finished inside a compute section
+    } else if (c->sync_posted_) {
+      // Claimed on a WaitQueue by another thread; it may have been woken
+      // by something else meanwhile and be ready already
+      assert(c->GetScheduler() == this); // sync_parked_ kept it here
+      c->sync_posted_ = false;
+      c->sync_woken_ = true;
+      if (c->GetState() == STATE_WAITING) {
+        c->Wakeup(EVENT_COND);
+      }
+    } else {
+      if (c->computing_) {
+        c->computing_ = false; // back from its compute section
+        if (c->cancel_pending_) {
+          c->cancel_pending_ = false;
+          c->event_ = EVENT_CANCEL; // EndCompute() throws
+        }
+      }
+      Ready(c);
+    }
   }
 }
 
-void Scheduler::Sweep() {
-  for (std::size_t i = 0; i < waiting_.size();) {
-    Coroutine* c = waiting_[i];
-    c->CheckTimeout();
-    if (c->GetState() == STATE_READY) {
-      ready_.push_back(c);
-      FastDelVectorItem<Coroutine* >(waiting_, i);
-      continue;
+void Scheduler::OnTimer() {
+  wheel_due_ = UINT64_MAX;
+  timers_.Advance(uv_now(loop_ptr_));
+  ScheduleTimer();
+}
+
+// Keeps the single uv timer pointed at the wheel's next deadline
+void Scheduler::ScheduleTimer() {
+  uint64_t now = uv_now(loop_ptr_);
+  long timeout = timers_.NextTimeout(now);
+  if (timeout < 0) {
+    if (wheel_due_ != UINT64_MAX) {
+      uv_timer_stop(&wheel_timer_);
+      wheel_due_ = UINT64_MAX;
     }
-    i++;
+    return;
   }
+  if (now + timeout < wheel_due_) {
+    wheel_due_ = now + timeout;
+    uv_timer_start(&wheel_timer_, [](uv_timer_t* handle) {
+      (reinterpret_cast<Scheduler*>(handle->data))->OnTimer();
+    }, timeout, 0);
+  }
+}
+
+// Call before any Socket is opened on this scheduler. Falls back to (and
+// returns false for) IO_BACKEND_POLL when io_uring is unavailable.
+bool Scheduler::SetIoBackend(IoBackend backend) {
+  if (backend == IO_BACKEND_URING && !uring_) {
+    uring_ = IoUring::Create(this);
+  } else if (backend == IO_BACKEND_POLL && uring_) {
+    return false; // the ring's poll handle belongs to the loop now
+  }
+  return GetIoBackend() == backend;
+}
+
+void Scheduler::AddTimer(Timer* t, long millisecs) {
+  uint64_t now = uv_now(loop_ptr_);
+  if (timers_.Empty()) {
+    timers_.Advance(now);
+  }
+  timers_.Add(t, now + (millisecs > 0 ? millisecs : 0));
+  ScheduleTimer();
 }
 
 Scheduler::~Scheduler() {
   local_sched = nullptr;
+  delete uring_;
   uv_loop_close(loop_ptr_);
+  stack_pool_->Orphan(); // last, handles may still live on pooled stacks
 }
 
 void Scheduler::AddCoroutine(Coroutine* coro) {
   switch (coro->GetState()) {
   case STATE_READY:
-    ready_.push_back(coro);
+    Ready(coro);
     break;
   case STATE_WAITING:
-    waiting_.push_back(coro);
+    waiting_.PushBack(coro);
     break;
   case STATE_DONE:
     coro->Destroy();
@@ -145,56 +201,61 @@ inline void CloseNoCb(void* handle) {
 
 void Scheduler::Run() {
   uv_run(loop_ptr_, UV_RUN_DEFAULT);
-  Cleanup(ready_);
-  Cleanup(waiting_);
-  uv_timer_stop(&sweep_timer_);
+  stealing_ = false;
+  Reclaim();
+  Cleanup();
+  uv_timer_stop(&wheel_timer_);
   uv_check_stop(&check_);
   uv_prepare_stop(&pre_);
-  CloseNoCb(&sweep_timer_);
+  CloseNoCb(&wheel_timer_);
   CloseNoCb(&async_);
   CloseNoCb(&check_);
   CloseNoCb(&pre_);
+  if (uring_) {
+    uring_->Close();
+  }
   uv_run(loop_ptr_, UV_RUN_NOWAIT);
 }
 
 void Scheduler::RunCoros() {
-  if (ready_.size() > 0) {
-    int loop = tight_loop_ * ready_.size();
-    for (auto i : ready_) {
-      i->buget_ = coro_buget_;
-    }
-    while (loop > 0 && ready_.size() > 0) {
-      for (std::size_t i = 0; i < ready_.size();) {
-        Coroutine* c = ready_[i];
-        current_ = c;
-        c->Resume();
-        current_ = nullptr;
-        if (c->GetState() == STATE_DONE) {
-          c->Destroy();
-          FastDelVectorItem<Coroutine*>(ready_, i);
-          continue;
-        } else if (c->GetState() == STATE_WAITING) {
-          waiting_.push_back(c);
-          FastDelVectorItem<Coroutine*>(ready_, i);
-          continue;
-        } else if (c->GetState() == STATE_COMPUTE) {
-          FastDelVectorItem<Coroutine*>(ready_, i);
-          outstanding_ ++;
-          compute_threads.Add(c);
-          continue;
-        } else if (c->GetState() == STATE_READY) {
-          c->buget_ = coro_buget_;
-          // fall through to next coroutine
-        }
-        i++;
+  // Each pass resumes the coroutines that were ready when it started; ones
+  // woken or yielding during a pass run in the next one.
+  int loop = tight_loop_ * ready_.Size();
+  while (loop > 0 && !ready_.Empty()) {
+    for (std::size_t n = ready_.Size(); n > 0; n--) {
+      Coroutine* c = ready_.PopFront();
+      current_ = c;
+      c->Resume();
+      current_ = nullptr;
+      if (c->GetState() == STATE_DONE) {
+        c->Destroy();
+      } else if (c->GetState() == STATE_WAITING) {
+        waiting_.PushBack(c);
+      } else if (c->GetState() == STATE_COMPUTE) {
+        c->computing_ = true;
+        outstanding_ ++;
+        c->executor_->Add(&c->task_);
+      } else if (c->GetState() == STATE_MIGRATING) {
+        DetachSockets(c);
+        c->GetScheduler()->PostCoroutine(c);
+      } else if (c->GetState() == STATE_READY) {
+        Ready(c);
       }
-      loop --;
     }
+    if (stealing_ && ready_.Size() > 1) {
+      Offer();
+    }
+    loop --;
+  }
+  if (!ready_.Empty()) {
+    // Out of passes with coroutines still handing off to each other (e.g.
+    // a Mutex): the poll must not block on them
+    uv_async_send(&async_);
   }
 
   if (shutdown_) {
     if (is_default_) {
-      compute_threads.Stop();
+      Executor::StopAll();
     }
     uv_stop(loop_ptr_);
   }
@@ -208,92 +269,171 @@ void Scheduler::Stop() {
 }
 
 void Scheduler::Wait(Coroutine* coro, long millisecs) {
-  uv_timer_t timer;
-  timer.data = coro;
-  uv_timer_init(loop_ptr_, &timer);
-  uv_timer_start(&timer, [](uv_timer_t* w) {
-    uv_timer_stop(w);
-    uv_close(reinterpret_cast<uv_handle_t*>(w), [](uv_handle_t* handle) {
-      (reinterpret_cast<Coroutine*>(handle->data))->Wakeup(EVENT_TIMEOUT);
-    });
-  }, millisecs, 0);
+  coro->pending_timeout_ms_ = 0; // this wait has its own
+  AddTimer(&coro->timer_, millisecs);
   coro->Suspend(STATE_WAITING);
 }
 
-void Scheduler::Cleanup(CoroutineList& cl) {
-  for (auto c : cl) {
+void Scheduler::Cleanup() {
+  // Cancelled coroutines may wake others (e.g. joiners), so drain until
+  // both queues stay empty
+  for (;;) {
+    while (!waiting_.Empty()) {
+      waiting_.Front()->Wakeup(EVENT_CANCEL); // moves it to ready_
+    }
+    Coroutine* c = ready_.PopFront();
+    if (!c) {
+      break;
+    }
     c->Wakeup(EVENT_CANCEL);
     c->Resume();
     c->Destroy();
   }
-  cl.clear();
 }
 
 void Scheduler::PostCoroutine(Coroutine* coro, bool is_compute) {
-  {
-    std::lock_guard<std::mutex> l(lock_);
-    if (is_compute) {
-      compute_done_.push_back(coro);
-    } else {
-      posted_.push_back(coro);
-    }
+  if (is_compute) {
+    outstanding_ --;
+  }
+  inbound_.fetch_add(1, std::memory_order_relaxed);
+  Coroutine* head = inbox_.load(std::memory_order_relaxed);
+  do {
+    coro->inbox_next_ = head;
+  } while (!inbox_.compare_exchange_weak(head, coro));
+  // Only the push that makes the inbox non-empty needs to signal, and not
+  // even that one while the loop is awake
+  if (!head && !awake_) {
+    uv_async_send(&async_);
   }
-  uv_async_send(&async_);
 }
 
 Scheduler* Scheduler::Get() {
   return local_sched;
 }
 
-void ComputeThreads::Start(int compute_threads_n) {
-  for (int i = 0; i < compute_threads_n; i++) {
-    threads_.emplace_back(std::bind(&ComputeThreads::Consume, this));
-  }
+void Scheduler::SetStealing(std::vector<Scheduler*>* peers, bool enabled) {
+  peers_ = peers;
+  stealing_ = enabled;
 }
 
-void ComputeThreads::Stop() {
-  {
-    std::lock_guard<std::mutex> l(lock_);
-    stop_ = true;
-    cond_.notify_all();
+// Publishes half of the surplus ready coroutines for an idle peer to take.
+// Whatever is still unclaimed when we run dry is reclaimed in Pre().
+void Scheduler::Offer() {
+  Scheduler* idle = nullptr;
+  for (auto peer : *peers_) {
+    if (peer != this && peer->idle_) {
+      idle = peer;
+      break;
+    }
+  }
+  if (!idle) {
+    return;
   }
-  for (std::size_t i = 0; i < threads_.size(); i++) {
-    if (threads_[i].joinable()) {
-      threads_[i].join();
+
+  std::lock_guard<std::mutex> l(steal_lock_);
+  if (!steal_queue_.empty()) {
+    return;
+  }
+  std::size_t n = ready_.Size() / 2;
+  Coroutine* next;
+  for (Coroutine* c = ready_.Front(); c && n > 0; c = next) {
+    next = c->Next();
+    if (c->IsMigratable()) {
+      ready_.Remove(c);
+      DetachSockets(c);
+      steal_queue_.push_back(c);
+      n --;
     }
   }
-  threads_.clear();
-  for (auto i : pending_) {
-    i->Wakeup(EVENT_CANCEL);
-    i->Resume();
-    i->Destroy();
+  if (!steal_queue_.empty()) {
+    uv_async_send(&idle->async_);
   }
-  pending_.clear();
 }
 
-inline void ComputeThreads::Add(Coroutine* coro) {
-  std::lock_guard<std::mutex> l(lock_);
-  pending_.push_back(coro);
-  cond_.notify_all();
+bool Scheduler::Steal() {
+  std::size_t n = peers_->size();
+  for (std::size_t i = 0; i < n; i++) {
+    Scheduler* victim = (*peers_)[(steal_index_ + i) % n];
+    if (victim == this) {
+      continue;
+    }
+    std::lock_guard<std::mutex> l(victim->steal_lock_);
+    std::size_t count = (victim->steal_queue_.size() + 1) / 2;
+    if (count == 0) {
+      continue;
+    }
+    for (std::size_t k = 0; k < count; k++) {
+      Coroutine* c = victim->steal_queue_.front();
+      victim->steal_queue_.pop_front();
+      c->sched_ = this;
+      Ready(c);
+    }
+    steals_ += count;
+    steal_index_ = (steal_index_ + i + 1) % n;
+    return true;
+  }
+  return false;
 }
 
-void ComputeThreads::Consume() {
-  Coroutine* coro;
-  while (true) {
-    {
-      std::unique_lock<std::mutex> l(lock_);
-      if (stop_) {
-        break;
-      }
-      if (pending_.size() == 0) {
-        cond_.wait(l);
-        continue;
-      }
-      coro = pending_.back();
-      pending_.pop_back();
+void Scheduler::Reclaim() {
+  std::lock_guard<std::mutex> l(steal_lock_);
+  for (auto c : steal_queue_) {
+    Ready(c);
+  }
+  steal_queue_.clear();
+}
+
+// Stops the polls on this loop of a coroutine that is leaving it, but not
+// those of sockets still in use by others
+void Scheduler::DetachSockets(Coroutine* coro) {
+  for (Socket* s = coro->sockets_; s; s = s->next_) {
+    if (s->sched_ == this && !s->KeepPoll()) {
+      s->StopPoll();
+    }
+  }
+}
+
+// Output Socket::Enqueue()'d by this iteration's coroutines goes out last
+// thing before the loop blocks, one writev per socket in the common case.
+// Producers it unblocks run after a poll that doesn't wait.
+void Scheduler::FlushSockets() {
+  if (flushing_.empty()) {
+    return;
+  }
+  std::size_t ready = ready_.Size();
+  for (auto s : flushing_) {
+    s->FlushQueued();
+  }
+  flushing_.clear();
+  if (ready_.Size() > ready) {
+    uv_async_send(&async_);
+  }
+}
+
+bool Scheduler::ShouldInline(const void* site) {
+  if (compute_mode_ == COMPUTE_ADAPTIVE && site) {
+    auto i = compute_sites_.find(site);
+    if (i != compute_sites_.end() && i->second < compute_threshold_ns_) {
+      compute_inlined_ ++;
+      return true;
     }
-    coro->Resume();
-    coro->GetScheduler()->PostCoroutine(coro, true);
+  }
+  // Unknown sites are offloaded until measured, they may well block
+  compute_offloaded_ ++;
+  return false;
+}
+
+void Scheduler::RecordCompute(const void* site, uint64_t elapsed_ns) {
+  if (compute_mode_ != COMPUTE_ADAPTIVE || !site) {
+    return;
+  }
+  auto i = compute_sites_.find(site);
+  if (i == compute_sites_.end()) {
+    compute_sites_[site] = elapsed_ns;
+  } else {
+    // EWMA with alpha 1/8: one slow run inline is enough to push a site
+    // back to the executor, a few fast ones bring it back
+    i->second = i->second - i->second / 8 + elapsed_ns / 8;
   }
 }
 
@@ -302,6 +442,72 @@ std::size_t Scheduler::NextId() {
   return next_id.fetch_add(1);
 }
 
+static std::size_t MixHash(std::size_t key) {
+  uint64_t x = key;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return static_cast<std::size_t>(x ^ (x >> 31));
+}
+
+static unsigned NextRandom() {
+  thread_local uint32_t state = static_cast<uint32_t>(
+                                  std::hash<std::thread::id>()(std::this_thread::get_id())) | 1;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+Scheduler* Schedulers::GetNext() {
+  switch (placement_.load(std::memory_order_relaxed)) {
+  case PLACEMENT_LEAST_LOADED: {
+    Scheduler* best = scheds_[0];
+    for (int i = 1; i < N_; i++) {
+      if (scheds_[i]->GetLoad() < best->GetLoad()) {
+        best = scheds_[i];
+      }
+    }
+    return best;
+  }
+  case PLACEMENT_TWO_CHOICES: {
+    if (N_ == 1) {
+      return scheds_[0];
+    }
+    unsigned a = NextRandom() % N_;
+    unsigned b = NextRandom() % (N_ - 1);
+    if (b >= a) {
+      b ++;
+    }
+    return scheds_[a]->GetLoad() <= scheds_[b]->GetLoad() ? scheds_[a] : scheds_[b];
+  }
+  case PLACEMENT_ROUND_ROBIN:
+  case PLACEMENT_HASH:
+  default:
+    return scheds_[rr_index_.fetch_add(1, std::memory_order_relaxed) % N_];
+  }
+}
+
+Scheduler* Schedulers::GetNext(std::size_t key) {
+  if (placement_.load(std::memory_order_relaxed) == PLACEMENT_HASH) {
+    return scheds_[MixHash(key) % N_];
+  }
+  return GetNext();
+}
+
+void Schedulers::SetStealing(bool enabled) {
+  for (int i = 0; i < N_; i++) {
+    scheds_[i]->SetStealing(&scheds_, enabled);
+  }
+}
+
+std::size_t Schedulers::GetSteals() const {
+  std::size_t steals = 0;
+  for (int i = 0; i < N_; i++) {
+    steals += scheds_[i]->GetSteals();
+  }
+  return steals;
+}
+
 void Schedulers::Stop() {
   for (int i = 0; i < N_; i++) {
     scheds_[i]->Stop();
@@ -315,6 +521,7 @@ void Schedulers::Stop() {
 
 void Schedulers::Fn(int n) {
   Scheduler sched(false);
+  sched.SetIoBackend(backend_);
   scheds_[n] = &sched;
   {
     std::lock_guard<std::mutex> lock{lock_};
@@ -322,14 +529,18 @@ void Schedulers::Fn(int n) {
     cond_.notify_one();
   }
   sched.Run();
+  // Peers may still be stealing from this scheduler until they stop too
+  std::unique_lock<std::mutex> lock{lock_};
+  finished_ ++;
+  cond_.notify_all();
+  while (finished_ < N_) {
+    cond_.wait(lock);
+  }
 }
 
-Schedulers::Schedulers(int N) : N_(N) {
+Schedulers::Schedulers(int N, IoBackend backend) : N_(N), backend_(backend) {
   scheds_.resize(N);
   threads_.resize(N);
-  for (int i = 0; i < N; i++) {
-    scheds_.push_back(nullptr);
-  }
   for (int i = 0; i < N; i++) {
     threads_[i] = std::thread(std::bind(&Schedulers::Fn, this, i));
   }
@@ -1,9 +1,23 @@
 #include "coros.h"
 #include <cassert>
+#include <algorithm>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
 #include <memory.h>
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define COROS_ZEROCOPY 1
+#endif
+#endif
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <poll.h>
+#endif
 
 namespace coros {
 
@@ -124,53 +138,166 @@ inline bool AcceptRetriable(int e) {
 #endif
 }
 
-bool Socket::ListenByHost(const std::string& host, int port, int backlog) {
-  struct addrinfo hints, *result;
-  memset(&hints, 0, sizeof(struct addrinfo));
+static const int kMaxIov = 64; // per scatter/gather syscall, below IOV_MAX
+static const int kTransferChunk = 1 << 20; // per SendFile/Splice syscall
+static const int kCopyChunk = 64 * 1024; // user space fallback
+static const int kZeroCopyMin = 16 * 1024; // below this pinning costs more than copying
+static const std::size_t kOutboundBlock = 16 * 1024; // small messages share blocks
+static const std::size_t kHighWater = 1 << 20;
 
-  hints.ai_flags = AI_PASSIVE;
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
 
-  char port_string[16];
-  sprintf(port_string, "%d", port);
+// MSG_ZEROCOPY bookkeeping: every successful send gets the next 32-bit id
+// and the kernel reports released id ranges on the error queue, possibly
+// out of order.
+struct Socket::ZeroCopy {
+  bool Released(uint32_t id) const {
+    return static_cast<int32_t>(released - id) > 0;
+  }
 
-  coro_->BeginCompute();
-  int rc = ::getaddrinfo(host.c_str(), port_string, &hints, &result);
-  coro_->EndCompute();
-  if (rc != 0) {
-    return false;
+  void Complete(uint32_t lo, uint32_t hi) {
+    if (lo != released) {
+      ranges[lo] = hi;
+      return;
+    }
+    released = hi + 1;
+    for (auto i = ranges.begin(); i != ranges.end() && i->first == released; i = ranges.erase(i)) {
+      released = i->second + 1;
+    }
+    while (!releases.empty() && Released(releases.front().first)) {
+      std::function<void()> fn = std::move(releases.front().second);
+      releases.pop_front();
+      fn();
+    }
   }
 
-  struct addrinfo* addr = nullptr;
-  for (struct addrinfo* a = result; a && s_ == BAD_SOCKET; a = a->ai_next) {
-    if (a->ai_family == AF_INET6) {
-      s_ = CreateListenSocket(a->ai_family, a->ai_socktype, a->ai_protocol);
-      addr = a;
+  bool enabled{ false };
+  Coroutine* waiter{ nullptr }; // parked in WaitErrQueue
+  uint32_t next{ 0 };
+  uint32_t released{ 0 }; // every id below this is released
+  std::map<uint32_t, uint32_t> ranges; // out of order completions, lo -> hi
+  std::deque<std::pair<uint32_t, std::function<void()> > > releases; // by last id
+  std::size_t copied{ 0 }; // completions where the kernel copied after all
+};
+
+// Enqueue()'d bytes in blocks, sent from the scheduler loop. Producers over
+// the high water mark and Flush() callers park in `blocked` and are woken
+// at half of it.
+struct Socket::Outbound {
+  void Append(const char* data, std::size_t len) {
+    if (blocks.empty() || blocks.back().size() + len > kOutboundBlock) {
+      blocks.emplace_back(std::move(spare));
+      blocks.back().reserve(len > kOutboundBlock ? len : kOutboundBlock);
     }
+    blocks.back().append(data, len);
+    queued += len;
   }
 
-  for (struct addrinfo* a = result; a && s_ == BAD_SOCKET; a = a->ai_next) {
-    if (a->ai_family == AF_INET) {
-      s_ = CreateListenSocket(a->ai_family, a->ai_socktype, a->ai_protocol);
-      addr = a;
+  void Consume(std::size_t len) {
+    queued -= len;
+    while (len > 0) {
+      std::size_t left = blocks.front().size() - offset;
+      if (len < left) {
+        offset += len;
+        return;
+      }
+      len -= left;
+      offset = 0;
+      if (blocks.front().capacity() == kOutboundBlock) {
+        spare.swap(blocks.front()); // saves an allocation per block
+        spare.clear();
+      }
+      blocks.pop_front();
     }
   }
 
-  if (s_ == BAD_SOCKET) {
-    freeaddrinfo(result);
-    return false;
+  void Wakeup(Event ev) {
+    std::vector<Coroutine*> woken;
+    woken.swap(blocked);
+    for (auto c : woken) {
+      c->Wakeup(ev);
+    }
   }
 
-  if (bind(s_, addr->ai_addr, addr->ai_addrlen) || listen(s_, backlog)) {
-    s_ = CloseSocket(s_);
-    freeaddrinfo(result);
+  Scheduler* sched{ nullptr }; // its loop sends the queue
+  std::deque<std::string> blocks; // front() is sent up to offset
+  std::size_t offset{ 0 };
+  std::size_t queued{ 0 };
+  std::size_t high_water{ kHighWater };
+  std::string spare;
+  std::vector<Coroutine*> blocked;
+  bool listed{ false }; // on sched->flushing_
+  bool stalled{ false }; // the kernel pushed back, waiting for UV_WRITABLE
+  bool error{ false };
+};
+
+inline int TotalSize(const uv_buf_t* bufs, int n) {
+  std::size_t size = 0;
+  for (int i = 0; i < n; i++) {
+    size += bufs[i].len;
+  }
+  return static_cast<int>(size);
+}
+
+// Clears the slot once its coroutine is woken
+inline void WakeWaiter(Coroutine** waiter, Event ev) {
+  if (*waiter && (*waiter)->GetState() == STATE_WAITING) {
+    (*waiter)->Wakeup(ev);
+    *waiter = nullptr;
+  }
+}
+
+// Holds a reader_/writer_ slot for one wait, also when a cancel unwinds it
+class WaiterGuard {
+public:
+  WaiterGuard(Coroutine** waiter, Coroutine* self)
+    : waiter_(waiter), self_(self) {
+    *waiter_ = self;
+  }
+  ~WaiterGuard() {
+    if (*waiter_ == self_) {
+      *waiter_ = nullptr;
+    }
+  }
+
+private:
+  Coroutine** waiter_;
+  Coroutine* self_;
+};
+
+// IoUring results are -errno, the socket API reports -1 and errno
+inline int UringResult(int res) {
+  if (res < 0) {
+    errno = -res;
+    return -1;
+  }
+  return res;
+}
+
+bool Socket::ListenByHost(const std::string& host, int port, int backlog) {
+  std::vector<IpAddress> addrs;
+  if (!Resolver::Default()->Resolve(host, &addrs)) {
     return false;
   }
 
-  freeaddrinfo(result);
-  uv_poll_init_socket(coro_->GetScheduler()->GetLoop(), &poll_, s_);
-  return true;
+  // The first address that binds; an IPv6 one also takes IPv4 connections
+  for (auto& a : addrs) {
+    s_ = CreateListenSocket(a.family, SOCK_STREAM, IPPROTO_TCP);
+    if (s_ == BAD_SOCKET) {
+      continue;
+    }
+    struct sockaddr_storage addr;
+    socklen_t addrlen = a.ToSockaddr(port, &addr);
+    if (bind(s_, reinterpret_cast<struct sockaddr*>(&addr), addrlen) || listen(s_, backlog)) {
+      s_ = CloseSocket(s_); // e.g. no IPv6 on this host, try the next
+      continue;
+    }
+    InitPoll();
+    return true;
+  }
+  return false;
 }
 
 bool Socket::ListenByIp(const std::string& ip, int port, int backlog) {
@@ -189,61 +316,334 @@ bool Socket::ListenByIp(const std::string& ip, int port, int backlog) {
     return false;
   }
 
-  uv_poll_init_socket(coro_->GetScheduler()->GetLoop(), &poll_, s_);
+  InitPoll();
   return true;
 }
 
 void Socket::Close() {
+  if (out_) {
+    if (s_ != BAD_SOCKET) {
+      Flush();
+    }
+    if (out_->listed) {
+      std::vector<Socket*>& flushing = out_->sched->flushing_;
+      flushing.erase(std::find(flushing.begin(), flushing.end(), this));
+    }
+    out_->Wakeup(EVENT_POLLERR); // producers blocked on a full queue
+    delete out_;
+    out_ = nullptr;
+  }
+  if (zc_) {
+    // Pages still pinned by unsent data can only be released through this
+    // socket's error queue; on a deadline the release callbacks are dropped
+    if (WaitZeroCopy() == 0) {
+      assert(zc_->releases.empty());
+    }
+    delete zc_;
+    zc_ = nullptr;
+  }
   if (s_ != BAD_SOCKET) {
-    uv_close(reinterpret_cast<uv_handle_t*>(&poll_), [](uv_handle_t* h) {
-      ((Socket*)h->data)->coro_->Wakeup();
-    });
-    coro_->Suspend(STATE_WAITING);
+    // The handle can only be closed from the loop it belongs to
+    Coroutine* self = Coroutine::Self();
+    Scheduler* home = self->GetScheduler();
+    if (poll_inited_) {
+      self->MoveTo(sched_);
+      // Fails coroutines blocked on it, they still use this object on resuming
+      WakeWaiter(&reader_, EVENT_POLLERR);
+      WakeWaiter(&writer_, EVENT_POLLERR);
+      ClosePoll();
+      self->MoveTo(home);
+    }
+#if defined(__linux__)
+    if (reader_ || writer_) {
+      ::shutdown(s_, SHUT_RDWR); // completes their ring operations
+    }
+#endif
+    if (accept_) {
+      IoUring::CloseAccept(accept_);
+      accept_ = nullptr;
+    }
     s_ = CloseSocket(s_);
+    Unlink();
+  }
+}
+
+uv_os_sock_t Socket::Release() {
+  if (poll_inited_) {
+    ClosePoll(); // ConnectRace() calls this on the loop it polled from
+  }
+  uv_os_sock_t s = s_;
+  s_ = BAD_SOCKET;
+  Unlink();
+  return s;
+}
+
+void Socket::Unlink() {
+  if (prev_) {
+    prev_->next_ = next_;
+  } else if (coro_ && coro_->sockets_ == this) {
+    coro_->sockets_ = next_;
+  }
+  if (next_) {
+    next_->prev_ = prev_;
+  }
+  prev_ = next_ = nullptr;
+  ready_ = UV_READABLE | UV_WRITABLE;
+  error_ = false;
+}
+
+void Socket::Link() {
+  if (!coro_) {
+    coro_ = Coroutine::Self();
+  }
+  if (coro_ && !prev_ && coro_->sockets_ != this) {
+    next_ = coro_->sockets_;
+    if (next_) {
+      next_->prev_ = this;
+    }
+    coro_->sockets_ = this;
+  }
+}
+
+void Socket::InitPoll() {
+  sched_ = Scheduler::Get();
+  Link();
+  if (sched_->uring_) {
+    return; // completions arrive through the scheduler's ring
+  }
+  uv_poll_init_socket(sched_->GetLoop(), &poll_, s_);
+  poll_.data = this; // ClosePoll() borrows it
+  poll_inited_ = true;
+  int interest = UV_READABLE;
+  if (!(ready_ & UV_DISCONNECT)) {
+    interest |= UV_DISCONNECT;
   }
+  UpdatePoll(interest);
+}
+
+void Socket::UpdatePoll(int interest) {
+  if (interest == 0 && zc_ && zc_->next != zc_->released) {
+    interest = UV_PRIORITIZED; // completions arrive as POLLERR, see OnPoll()
+  }
+  if (interest == interest_ && started_) {
+    return;
+  }
+  interest_ = interest;
+  if (interest_ != 0) {
+    uv_poll_start(&poll_, interest_, [](uv_poll_t* w, int status, int events) {
+      ((Socket*)w->data)->OnPoll(status, events);
+    });
+    started_ = true;
+  } else {
+    uv_poll_stop(&poll_);
+    started_ = false;
+  }
+}
+
+// Emulated edge triggering: a direction nobody waits on goes to ready_, out of interest_
+void Socket::OnPoll(int status, int events) {
+  if (status != 0) {
+    // libuv has stopped the handle
+    started_ = false;
+    if (zc_ && ReapZeroCopy()) {
+      // POLLERR came from zerocopy completions, not from the socket
+      UpdatePoll(interest_);
+      WakeWaiter(&zc_->waiter, EVENT_WAKEUP);
+      return;
+    }
+    error_ = true;
+    WakeWaiter(&reader_, EVENT_POLLERR);
+    WakeWaiter(&writer_, EVENT_POLLERR);
+    if (out_) {
+      DropQueued();
+    }
+    return;
+  }
+
+  if ((events & UV_PRIORITIZED) && zc_ && ReapZeroCopy()) {
+    // libuv reports POLLERR this way when only UV_PRIORITIZED is watched
+    WakeWaiter(&zc_->waiter, EVENT_WAKEUP);
+  }
+  ready_ |= events;
+  int parked = events & (UV_READABLE | UV_DISCONNECT);
+  if (reader_) {
+    parked &= ~UV_READABLE;
+    if (events & UV_READABLE) {
+      WakeWaiter(&reader_, EVENT_READABLE);
+    } else if (events & UV_DISCONNECT) {
+      WakeWaiter(&reader_, EVENT_DISCONNECT);
+    }
+  }
+  // UV_DISCONNECT (the peer's shutdown(SHUT_WR)) ends reading only
+  if (writer_ && (events & UV_WRITABLE)) {
+    WakeWaiter(&writer_, EVENT_WRITABLE);
+  }
+  // Writes are optimistic, writability is only watched for a blocked writer
+  parked |= events & UV_WRITABLE;
+  if (parked & interest_) {
+    UpdatePoll(interest_ & ~parked);
+  }
+  if (out_ && out_->stalled && (events & UV_WRITABLE)) {
+    out_->stalled = false;
+    SendQueued();
+  }
+}
+
+void Socket::StopPoll() {
+  if (started_) {
+    uv_poll_stop(&poll_);
+    started_ = false;
+  }
+}
+
+void Socket::ClosePoll() {
+  started_ = false;
+  interest_ = 0;
+  poll_inited_ = false;
+  poll_.data = Coroutine::Self();
+  uv_close(reinterpret_cast<uv_handle_t*>(&poll_), [](uv_handle_t* h) {
+    ((Coroutine*)h->data)->Wakeup();
+  });
+  ((Coroutine*)poll_.data)->Suspend(STATE_WAITING);
+}
+
+// Moves poll_ to the loop of the scheduler the coroutine was stolen by
+void Socket::Rehome() {
+  if (poll_inited_) {
+    Coroutine* self = Coroutine::Self();
+    Scheduler* home = self->GetScheduler();
+    self->MoveTo(sched_);
+    ClosePoll();
+    self->MoveTo(home);
+  }
+  InitPoll();
 }
 
 bool Socket::ConnectHost(const std::string& host, int port) {
-  struct addrinfo hints, *result;
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-
-  char port_string[16];
-  sprintf(port_string, "%d", port);
-
-  coro_->BeginCompute();
-  int rc = getaddrinfo(host.c_str(), port_string, &hints, &result);
-  coro_->EndCompute();
-  if (rc != 0) {
+  std::vector<IpAddress> addrs;
+  if (!Resolver::Default()->Resolve(host, &addrs)) {
     return false;
   }
 
-  s_ = CreateSocket(result->ai_family, result->ai_socktype, result->ai_protocol);
+  if (addrs.size() > 1) {
+    return ConnectRace(addrs, port);
+  }
+  s_ = CreateSocket(addrs[0].family, SOCK_STREAM, IPPROTO_TCP);
   if (s_ == BAD_SOCKET) {
-    freeaddrinfo(result);
     return false;
   }
+  struct sockaddr_storage addr;
+  socklen_t addrlen = addrs[0].ToSockaddr(port, &addr);
+  return Connect(reinterpret_cast<struct sockaddr*>(&addr), addrlen);
+}
 
-  rc = ::connect(s_, result->ai_addr, result->ai_addrlen);
-  freeaddrinfo(result);
-  if (rc == 0) {
-    return true;
+// RFC 8305 order: the families take turns, starting with the resolver's first
+static std::vector<IpAddress> Interleave(const std::vector<IpAddress>& addrs) {
+  std::vector<IpAddress> first, second;
+  for (auto& a : addrs) {
+    (a.family == addrs[0].family ? first : second).push_back(a);
   }
-
-  if (!ConnectRetriable(ErrorCode())) {
-    s_ = CloseSocket(s_);
-    return false;
+  std::vector<IpAddress> order;
+  for (std::size_t i = 0; i < first.size() || i < second.size(); i++) {
+    if (i < first.size()) {
+      order.push_back(first[i]);
+    }
+    if (i < second.size()) {
+      order.push_back(second[i]);
+    }
   }
+  return order;
+}
 
-  uv_poll_init_socket(coro_->GetScheduler()->GetLoop(), &poll_, s_);
+// Each attempt is a Socket of its own, watched with a Select until one is
+// writable without SO_ERROR; its descriptor then moves here and the others
+// are closed. The deadline covers the whole race.
+bool Socket::ConnectRace(const std::vector<IpAddress>& addrs, int port) {
+  std::vector<IpAddress> order = Interleave(addrs);
+  uint64_t deadline = timeout_ms_ > 0 ? uv_hrtime() + static_cast<uint64_t>(timeout_ms_) * 1000000 : 0;
+  std::vector<std::unique_ptr<Socket> > attempts;
+  std::size_t next = 0;
+  bool start = true;
+  uv_os_sock_t won = BAD_SOCKET;
+  try {
+    while (won == BAD_SOCKET) {
+      if (start && next < order.size()) {
+        start = false;
+        const IpAddress& a = order[next++];
+        uv_os_sock_t s = CreateSocket(a.family, SOCK_STREAM, IPPROTO_TCP);
+        if (s == BAD_SOCKET) {
+          start = true;
+          continue;
+        }
+        struct sockaddr_storage addr;
+        socklen_t addrlen = a.ToSockaddr(port, &addr);
+        if (::connect(s, reinterpret_cast<struct sockaddr*>(&addr), addrlen) == 0) {
+          won = s;
+          break;
+        }
+        if (!ConnectRetriable(ErrorCode())) {
+          CloseSocket(s);
+          start = true; // e.g. no route, try the next one now
+          continue;
+        }
+        attempts.emplace_back(new Socket(s));
+      }
+      if (attempts.empty()) {
+        if (next == order.size()) {
+          break; // every address failed
+        }
+        start = true;
+        continue;
+      }
 
-  Event ev = WaitWritable();
-  if (ev != EVENT_WRITABLE) {
-    s_ = CloseSocket(s_);
+      long wait_ms = next < order.size() ? connect_delay_ms_ : -1;
+      if (deadline) {
+        uint64_t now = uv_hrtime();
+        if (now >= deadline) {
+          break;
+        }
+        long left = static_cast<long>((deadline - now + 999999) / 1000000);
+        wait_ms = wait_ms < 0 ? left : std::min(wait_ms, left);
+      }
+      Select sel;
+      for (auto& t : attempts) {
+        sel.Writable(t.get());
+      }
+      int timeout = wait_ms >= 0 ? sel.Timeout(std::max(wait_ms, 1L)) : -1;
+      if (sel.Wait() == timeout) {
+        start = true;
+        continue;
+      }
+      for (std::size_t i = attempts.size(); i-- > 0; ) {
+        if (!sel.Fired(static_cast<int>(i))) {
+          continue;
+        }
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(attempts[i]->s_, SOL_SOCKET, SO_ERROR, (char*)&error, &len);
+        if (error == 0) {
+          won = attempts[i]->Release();
+          attempts.erase(attempts.begin() + i);
+          break;
+        }
+        attempts[i]->Close();
+        attempts.erase(attempts.begin() + i);
+        start = true; // refused, the next one need not wait for the delay
+      }
+    }
+  } catch (Unwind&) {
+    for (auto& t : attempts) {
+      t->Close();
+    }
+    throw;
+  }
+  for (auto& t : attempts) {
+    t->Close(); // the losers
+  }
+  if (won == BAD_SOCKET) {
     return false;
   }
-
+  Attach(won);
   return true;
 }
 
@@ -257,21 +657,33 @@ bool Socket::ConnectIp(const std::string& ip, int port) {
   addr.sin_family = AF_INET;
   addr.sin_addr.s_addr = inet_addr(ip.c_str());
   addr.sin_port = htons(port);
-  int rc = ::connect(s_, (struct sockaddr*)&addr, sizeof(addr));
-  if (rc == 0) {
+  return Connect((struct sockaddr*)&addr, sizeof(addr));
+}
+
+bool Socket::Connect(const struct sockaddr* addr, int addrlen) {
+  if (IoUring* uring = Scheduler::Get()->uring_) {
+    InitPoll();
+    if (uring->Connect(s_, addr, addrlen, GetDeadlineMs()) != 0) {
+      Close();
+      return false;
+    }
     return true;
   }
 
-  if (!ConnectRetriable(ErrorCode())) {
+  int rc = ::connect(s_, addr, addrlen);
+  if (rc != 0 && !ConnectRetriable(ErrorCode())) {
     s_ = CloseSocket(s_);
     return false;
   }
 
-  uv_poll_init_socket(coro_->GetScheduler()->GetLoop(), &poll_, s_);
+  InitPoll();
+  if (rc == 0) {
+    return true;
+  }
 
   Event ev = WaitWritable();
   if (ev != EVENT_WRITABLE) {
-    s_ = CloseSocket(s_);
+    Close();
     return false;
   }
 
@@ -279,16 +691,27 @@ bool Socket::ConnectIp(const std::string& ip, int port) {
 }
 
 int Socket::ReadSome(char* data, int len) {
-  if (!coro_->CheckBuget()) {
-    coro_->Nice();
+  Coroutine* self = Coroutine::Self();
+  if (!self->CheckBuget()) {
+    self->Nice();
+  }
+  if (IoUring* uring = self->GetScheduler()->uring_) {
+    WaiterGuard guard(&reader_, self); // for Close() from another coroutine
+    return UringResult(uring->Recv(s_, data, len, GetDeadlineMs()));
   }
   for (;;) {
-    int rc = ::recv(s_, data, len, 0);
-    if (rc >= 0) {
-      return rc;
-    }
-    if (!ReadWriteRetriable(ErrorCode())) {
-      return rc;
+    // After a hangup the socket reads until EOF without another poll
+    if (ready_ & (UV_READABLE | UV_DISCONNECT)) {
+      int rc = ::recv(s_, data, len, 0);
+      if (rc >= 0) {
+        if (rc > 0 && rc < len) {
+          ready_ &= ~UV_READABLE; // drained, skip the EAGAIN next time
+        }
+        return rc;
+      }
+      if (!ReadWriteRetriable(ErrorCode())) {
+        return rc;
+      }
     }
     Event ev = WaitReadable();
     if (ev != EVENT_READABLE) {
@@ -314,19 +737,29 @@ int Socket::ReadAtLeast(char* data, int len, int min_len) {
 }
 
 int Socket::WriteSome(const char* data, int len) {
-  if (!coro_->CheckBuget()) {
-    coro_->Nice();
+  Coroutine* self = Coroutine::Self();
+  if (!self->CheckBuget()) {
+    self->Nice();
   }
 #ifndef MSG_NOSIGNAL
 #define MSG_NOSIGNAL 0
 #endif
+  if (IoUring* uring = self->GetScheduler()->uring_) {
+    WaiterGuard guard(&writer_, self); // for Close() from another coroutine
+    return UringResult(uring->Send(s_, data, len, GetDeadlineMs()));
+  }
   for (;;) {
-    int rc = ::send(s_, data, len, MSG_NOSIGNAL);
-    if (rc > 0) {
-      return rc;
-    }
-    if (!ReadWriteRetriable(ErrorCode())) {
-      return rc;
+    if (ready_ & UV_WRITABLE) {
+      int rc = ::send(s_, data, len, MSG_NOSIGNAL);
+      if (rc > 0) {
+        if (rc < len) {
+          ready_ &= ~UV_WRITABLE; // send buffer is full
+        }
+        return rc;
+      }
+      if (!ReadWriteRetriable(ErrorCode())) {
+        return rc;
+      }
     }
     Event ev = WaitWritable();
     if (ev != EVENT_WRITABLE) {
@@ -347,25 +780,622 @@ int Socket::WriteExactly(const char* data, int len) {
   return size;
 }
 
-uv_os_sock_t Socket::Accept() {
-  if (!coro_->CheckBuget()) {
-    coro_->Nice();
+#ifdef _WIN32
+// uv_buf_t is laid out as WSABUF on Windows
+inline int RecvV(uv_os_sock_t s, uv_buf_t* bufs, int n) {
+  DWORD bytes = 0;
+  DWORD flags = 0;
+  if (WSARecv(s, reinterpret_cast<WSABUF*>(bufs), n, &bytes, &flags, NULL, NULL) != 0) {
+    return -1;
+  }
+  return static_cast<int>(bytes);
+}
+
+inline int SendV(uv_os_sock_t s, const uv_buf_t* bufs, int n, int flags = 0) {
+  DWORD bytes = 0;
+  if (WSASend(s, reinterpret_cast<WSABUF*>(const_cast<uv_buf_t*>(bufs)), n, &bytes, 0, NULL, NULL) != 0) {
+    return -1;
+  }
+  return static_cast<int>(bytes);
+}
+#else
+// and as struct iovec elsewhere
+inline int RecvV(uv_os_sock_t s, uv_buf_t* bufs, int n) {
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = reinterpret_cast<struct iovec*>(bufs);
+  msg.msg_iovlen = n;
+  return static_cast<int>(::recvmsg(s, &msg, 0));
+}
+
+inline int SendV(uv_os_sock_t s, const uv_buf_t* bufs, int n, int flags = 0) {
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = reinterpret_cast<struct iovec*>(const_cast<uv_buf_t*>(bufs));
+  msg.msg_iovlen = n;
+  return static_cast<int>(::sendmsg(s, &msg, MSG_NOSIGNAL | flags));
+}
+#endif
+
+int Socket::ReadSomeV(uv_buf_t* bufs, int n) {
+  Coroutine* self = Coroutine::Self();
+  if (!self->CheckBuget()) {
+    self->Nice();
+  }
+  n = n < kMaxIov ? n : kMaxIov;
+  if (IoUring* uring = self->GetScheduler()->uring_) {
+    WaiterGuard guard(&reader_, self); // for Close() from another coroutine
+    return UringResult(uring->RecvV(s_, bufs, n, GetDeadlineMs()));
   }
   for (;;) {
-    struct sockaddr_storage mem;
-    socklen_t len = sizeof(mem);
-    uv_os_sock_t new_s = BAD_SOCKET;
-#if defined(SOCK_CLOEXEC) && defined(SOCK_NONBLOCK)
-    new_s = accept4(s_, (struct sockaddr*)&mem, &len, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (ready_ & (UV_READABLE | UV_DISCONNECT)) {
+      int rc = RecvV(s_, bufs, n);
+      if (rc >= 0) {
+        if (rc > 0 && rc < TotalSize(bufs, n)) {
+          ready_ &= ~UV_READABLE;
+        }
+        return rc;
+      }
+      if (!ReadWriteRetriable(ErrorCode())) {
+        return rc;
+      }
+    }
+    Event ev = WaitReadable();
+    if (ev != EVENT_READABLE) {
+      return -1;
+    }
+  }
+}
+
+int Socket::WriteSomeV(const uv_buf_t* bufs, int n) {
+  Coroutine* self = Coroutine::Self();
+  if (!self->CheckBuget()) {
+    self->Nice();
+  }
+  n = n < kMaxIov ? n : kMaxIov;
+  if (IoUring* uring = self->GetScheduler()->uring_) {
+    WaiterGuard guard(&writer_, self); // for Close() from another coroutine
+    return UringResult(uring->SendV(s_, bufs, n, GetDeadlineMs()));
+  }
+  for (;;) {
+    if (ready_ & UV_WRITABLE) {
+      int rc = SendV(s_, bufs, n);
+      if (rc > 0) {
+        if (rc < TotalSize(bufs, n)) {
+          ready_ &= ~UV_WRITABLE;
+        }
+        return rc;
+      }
+      if (!ReadWriteRetriable(ErrorCode())) {
+        return rc;
+      }
+    }
+    Event ev = WaitWritable();
+    if (ev != EVENT_WRITABLE) {
+      return -1;
+    }
+  }
+}
+
+int Socket::WriteAllV(uv_buf_t* bufs, int n) {
+  int size = 0;
+  int i = 0;
+  while (i < n) {
+    if (bufs[i].len == 0) {
+      i ++;
+      continue;
+    }
+    int rc = WriteSomeV(bufs + i, n - i);
+    if (rc <= 0) {
+      return size;
+    }
+    size += rc;
+    // Consume what went out, leaving a partially sent buffer at its tail
+    std::size_t left = rc;
+    while (left > 0) {
+      std::size_t len = bufs[i].len;
+      std::size_t sent = left < len ? left : len;
+      bufs[i].base += sent;
+      bufs[i].len -= sent;
+      left -= sent;
+      if (bufs[i].len == 0) {
+        i ++;
+      }
+    }
+  }
+  return size;
+}
+
+int Socket::WriteExactlyV(const uv_buf_t* bufs, int n) {
+  int size = 0;
+  uv_buf_t batch[kMaxIov];
+  for (int i = 0; i < n; i += kMaxIov) {
+    int m = (n - i) < kMaxIov ? (n - i) : kMaxIov;
+    memcpy(batch, bufs + i, m * sizeof(uv_buf_t));
+    int expected = TotalSize(batch, m);
+    int rc = WriteAllV(batch, m);
+    size += rc;
+    if (rc != expected) {
+      break;
+    }
+  }
+  return size;
+}
+
+#if !defined(__linux__)
+inline int ReadFileAt(int fd, char* buf, int len, int64_t offset) {
+#ifdef _WIN32
+  if (_lseeki64(fd, offset, SEEK_SET) < 0) {
+    return -1;
+  }
+  return _read(fd, buf, len);
+#else
+  return static_cast<int>(::pread(fd, buf, len, offset));
+#endif
+}
+#endif
+
+int64_t Socket::SendFile(int fd, int64_t offset, int64_t len) {
+  int64_t size = 0;
+#if defined(__linux__)
+  Coroutine* self = Coroutine::Self();
+  while (size < len) {
+    if (!self->CheckBuget()) {
+      self->Nice();
+    }
+    if (ready_ & UV_WRITABLE) {
+      off_t off = offset + size;
+      std::size_t chunk = (len - size) < kTransferChunk ? (len - size) : kTransferChunk;
+      ssize_t rc = ::sendfile(s_, fd, &off, chunk);
+      if (rc > 0) {
+        size += rc;
+        if (static_cast<std::size_t>(rc) < chunk) {
+          ready_ &= ~UV_WRITABLE;
+        }
+        continue;
+      }
+      if (rc == 0 || !ReadWriteRetriable(ErrorCode())) {
+        break; // end of file or error
+      }
+    }
+    if (WaitWritable() != EVENT_WRITABLE) {
+      break;
+    }
+  }
+#else
+  char buf[kCopyChunk];
+  while (size < len) {
+    int chunk = (len - size) < kCopyChunk ? static_cast<int>(len - size) : kCopyChunk;
+    int rc = ReadFileAt(fd, buf, chunk, offset + size);
+    if (rc <= 0) {
+      break;
+    }
+    int written = WriteExactly(buf, rc);
+    size += written;
+    if (written != rc) {
+      break;
+    }
+  }
+#endif
+  return size;
+}
+
+// Socket to socket through a pipe; the caller is this reader and `to`'s writer
+int64_t Socket::Splice(Socket* to, int64_t len) {
+  int64_t size = 0;
+#if defined(__linux__)
+  int pipe_fds[2];
+  if (pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+    return -1;
+  }
+  int64_t piped = 0; // bytes sitting in the pipe
+  Coroutine* self = Coroutine::Self();
+  bool eof = false;
+  while ((!eof && (len < 0 || size + piped < len)) || piped > 0) {
+    if (!self->CheckBuget()) {
+      self->Nice();
+    }
+    if (!eof && piped == 0 && (len < 0 || size < len)) {
+      if (ready_ & (UV_READABLE | UV_DISCONNECT)) {
+        int64_t want = len < 0 ? kTransferChunk : len - size;
+        std::size_t chunk = want < kTransferChunk ? want : kTransferChunk;
+        ssize_t rc = ::splice(s_, nullptr, pipe_fds[1], nullptr, chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (rc > 0) {
+          piped += rc;
+        } else if (rc == 0) {
+          eof = true;
+          continue;
+        } else if (!ReadWriteRetriable(ErrorCode())) {
+          break;
+        } else {
+          ready_ &= ~UV_READABLE;
+        }
+      }
+      if (piped == 0) {
+        if (WaitReadable() != EVENT_READABLE) {
+          break;
+        }
+        continue;
+      }
+    }
+    if (to->ready_ & UV_WRITABLE) {
+      ssize_t rc = ::splice(pipe_fds[0], nullptr, to->s_, nullptr, piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (rc > 0) {
+        piped -= rc;
+        size += rc;
+        continue;
+      }
+      if (rc == 0 || !ReadWriteRetriable(ErrorCode())) {
+        break;
+      }
+      to->ready_ &= ~UV_WRITABLE;
+    }
+    if (to->WaitWritable() != EVENT_WRITABLE) {
+      break;
+    }
+  }
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+#else
+  char buf[kCopyChunk];
+  while (len < 0 || size < len) {
+    int chunk = (len < 0 || (len - size) >= kCopyChunk) ? kCopyChunk : static_cast<int>(len - size);
+    int rc = ReadSome(buf, chunk);
+    if (rc <= 0) {
+      break;
+    }
+    int written = to->WriteExactly(buf, rc);
+    size += written;
+    if (written != rc) {
+      break;
+    }
+  }
+#endif
+  return size;
+}
+
+#if defined(COROS_ZEROCOPY)
+bool Socket::EnableZeroCopy() {
+  if (!zc_) {
+    zc_ = new ZeroCopy();
+    int one = 1;
+    zc_->enabled = setsockopt(s_, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+  }
+  return zc_->enabled;
+}
+
+bool Socket::ReapZeroCopy() {
+  bool reaped = false;
+  for (;;) {
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (::recvmsg(s_, &msg, MSG_ERRQUEUE) < 0) {
+      break;
+    }
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+          !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+        continue;
+      }
+      struct sock_extended_err* err = reinterpret_cast<struct sock_extended_err*>(CMSG_DATA(cm));
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        zc_->copied += err->ee_data - err->ee_info + 1;
+      }
+      zc_->Complete(err->ee_info, err->ee_data);
+      reaped = true;
+    }
+  }
+  return reaped;
+}
+
+// Completions arrive as POLLERR, which libuv reports by stopping the poll
+// handle; OnPoll reaps them and restarts it
+Event Socket::WaitErrQueue() {
+  Coroutine* self = Coroutine::Self();
+  if (IoUring* uring = self->GetScheduler()->uring_) {
+    Event ev = uring->Poll(s_, 0, GetDeadlineMs(), nullptr);
+    return ev == EVENT_POLLERR && ReapZeroCopy() ? EVENT_WAKEUP : ev;
+  }
+  if (error_) {
+    return EVENT_POLLERR;
+  }
+  if (!poll_inited_ || sched_ != self->GetScheduler()) {
+    Rehome();
+  }
+  UpdatePoll(interest_);
+  WaiterGuard guard(&zc_->waiter, self);
+  self->SetTimeoutMs(GetDeadlineMs());
+  self->Suspend(STATE_WAITING);
+  return self->GetEvent();
+}
 #else
-    new_s = ::accept(s_, (struct sockaddr*)&mem, &len);
+bool Socket::EnableZeroCopy() {
+  return false;
+}
+
+bool Socket::ReapZeroCopy() {
+  return false;
+}
+
+Event Socket::WaitErrQueue() {
+  return EVENT_POLLERR;
+}
 #endif
-    if (new_s != BAD_SOCKET) {
-      return SetNonblocking(SetNoSigPipe(new_s));
+
+int Socket::WriteZeroCopy(const char* data, int len, std::function<void()> release) {
+  if (len < kZeroCopyMin || !EnableZeroCopy()) {
+    int rc = WriteExactly(data, len);
+    if (release) {
+      release();
+    }
+    return rc;
+  }
+#if defined(COROS_ZEROCOPY)
+  uint32_t first = zc_->next;
+  int size = 0;
+  Coroutine* self = Coroutine::Self();
+  while (size < len) {
+    if (!self->CheckBuget()) {
+      self->Nice();
+    }
+    if (ready_ & UV_WRITABLE) {
+      int rc = ::send(s_, data + size, len - size, MSG_ZEROCOPY | MSG_NOSIGNAL);
+      if (rc > 0) {
+        zc_->next ++;
+        if (rc < len - size) {
+          ready_ &= ~UV_WRITABLE;
+        }
+        size += rc;
+        continue;
+      }
+      if (ErrorCode() == ENOBUFS) {
+        // Out of optmem for pinned pages: wait for releases, or copy the
+        // rest if nothing is in flight
+        if (zc_->next == zc_->released) {
+          size += WriteExactly(data + size, len - size);
+          break;
+        }
+        if (!ReapZeroCopy() && WaitErrQueue() != EVENT_WAKEUP) {
+          break;
+        }
+        continue;
+      }
+      if (!ReadWriteRetriable(ErrorCode())) {
+        break;
+      }
+    }
+    if (WaitWritable() != EVENT_WRITABLE) {
+      break;
+    }
+  }
+
+  uint32_t last = zc_->next;
+  if (first == last || zc_->Released(last - 1)) {
+    if (release) {
+      release();
     }
-    if (!AcceptRetriable(ErrorCode())) {
+    return size;
+  }
+  if (release) {
+    zc_->releases.emplace_back(last - 1, std::move(release));
+    ReapZeroCopy();
+    if (poll_inited_ && sched_ == self->GetScheduler()) {
+      UpdatePoll(interest_); // OnPoll() runs it once the completion arrives
+    }
+    return size;
+  }
+  while (!zc_->Released(last - 1)) {
+    if (!ReapZeroCopy() && WaitErrQueue() != EVENT_WAKEUP && !zc_->Released(last - 1)) {
+      return -1;
+    }
+  }
+  return size;
+#else
+  return -1;
+#endif
+}
+
+int Socket::WaitZeroCopy() {
+  if (!zc_ || s_ == BAD_SOCKET) {
+    return 0;
+  }
+  while (zc_->next != zc_->released) {
+    if (!ReapZeroCopy() && WaitErrQueue() != EVENT_WAKEUP && zc_->next != zc_->released) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// With io_uring there is no completion for "writable again", so the queue
+// waits on poll_ with either backend
+Socket::Outbound* Socket::GetOutbound() {
+  Coroutine* self = Coroutine::Self();
+  if (!out_) {
+    out_ = new Outbound();
+    out_->sched = self->GetScheduler();
+  }
+  assert(out_->sched == self->GetScheduler()); // producers share the socket's scheduler
+  EnsurePoll();
+  return out_;
+}
+
+// poll_ on the calling coroutine's loop, also with IO_BACKEND_URING where
+// only Enqueue and Select use it
+void Socket::EnsurePoll() {
+  Scheduler* sched = Coroutine::Self()->GetScheduler();
+  if (sched->uring_) {
+    if (!poll_inited_) {
+      sched_ = sched;
+      uv_poll_init_socket(sched_->GetLoop(), &poll_, s_);
+      poll_.data = this;
+      poll_inited_ = true;
+    }
+  } else if (!poll_inited_ || sched_ != sched) {
+    Rehome();
+  }
+}
+
+int Socket::Enqueue(const char* data, int len) {
+  if (s_ == BAD_SOCKET) {
+    return -1;
+  }
+  Outbound* out = GetOutbound();
+  while (out->queued >= out->high_water && !out->error) {
+    SendQueued();
+    if (out->queued < out->high_water) {
+      break;
+    }
+    if (WaitQueued() != EVENT_WRITABLE) {
+      return -1;
+    }
+  }
+  if (out->error) {
+    return -1;
+  }
+  out->Append(data, len);
+  if (!out->listed && !out->stalled) {
+    out->listed = true;
+    out->sched->flushing_.push_back(this);
+  }
+  return len;
+}
+
+int Socket::Flush() {
+  if (!out_) {
+    return 0;
+  }
+  while (out_->queued > 0 && !out_->error) {
+    SendQueued();
+    if (out_->queued == 0) {
+      break;
+    }
+    if (WaitQueued() != EVENT_WRITABLE) {
+      return -1;
+    }
+  }
+  return out_->error ? -1 : 0;
+}
+
+void Socket::SetHighWater(std::size_t bytes) {
+  GetOutbound()->high_water = bytes;
+}
+
+// Sends until the queue is empty or the kernel pushes back; never blocks,
+// it runs on the loop as well as in producers. MSG_MORE tells TCP another
+// batch follows straight away.
+void Socket::SendQueued() {
+  Outbound* out = out_;
+  while (out->queued > 0) {
+    uv_buf_t bufs[kMaxIov];
+    int n = 0;
+    std::size_t batch = 0;
+    std::size_t offset = out->offset;
+    for (auto i = out->blocks.begin(); i != out->blocks.end() && n < kMaxIov; ++i) {
+      bufs[n] = uv_buf_init(const_cast<char*>(i->data()) + offset, static_cast<unsigned int>(i->size() - offset));
+      batch += i->size() - offset;
+      offset = 0;
+      n ++;
+    }
+    int rc = SendV(s_, bufs, n, batch < out->queued ? MSG_MORE : 0);
+    if (rc < 0) {
+      if (!ReadWriteRetriable(ErrorCode())) {
+        DropQueued();
+        return;
+      }
+      ready_ &= ~UV_WRITABLE;
+      if (!out->stalled) {
+        out->stalled = true;
+        UpdatePoll(interest_ | UV_WRITABLE);
+      }
+      break;
+    }
+    out->Consume(rc);
+  }
+  if (out->queued <= out->high_water / 2) {
+    out->Wakeup(EVENT_WRITABLE);
+  }
+}
+
+// From Scheduler::FlushSockets(), which clears flushing_ afterwards
+void Socket::FlushQueued() {
+  out_->listed = false;
+  SendQueued();
+}
+
+// The connection is gone: what is queued can't be sent
+void Socket::DropQueued() {
+  out_->error = true;
+  out_->blocks.clear();
+  out_->offset = 0;
+  out_->queued = 0;
+  out_->Wakeup(EVENT_POLLERR);
+}
+
+Event Socket::WaitQueued() {
+  Coroutine* self = Coroutine::Self();
+  out_->blocked.push_back(self);
+  self->SetTimeoutMs(GetDeadlineMs());
+  bool unwound = false;
+  try {
+    self->Suspend(STATE_WAITING);
+  } catch (Unwind&) {
+    unwound = true;
+  }
+  Event ev = self->GetEvent();
+  if (ev != EVENT_WRITABLE && ev != EVENT_POLLERR) {
+    std::vector<Coroutine*>& blocked = out_->blocked;
+    blocked.erase(std::remove(blocked.begin(), blocked.end(), self), blocked.end());
+  }
+  if (unwound) {
+    throw Unwind();
+  }
+  return ev;
+}
+
+// A socket another coroutine is blocked on, with output queued or with
+// zerocopy sends in flight keeps its poll when its creator leaves the loop
+bool Socket::KeepPoll() const {
+  return reader_ || writer_ || (out_ && out_->queued > 0) || (zc_ && zc_->next != zc_->released);
+}
+
+uv_os_sock_t Socket::Accept() {
+  Coroutine* self = Coroutine::Self();
+  if (!self->CheckBuget()) {
+    self->Nice();
+  }
+  while (IoUring* uring = self->GetScheduler()->uring_) {
+    int new_s = uring->Accept(s_, accept_, GetDeadlineMs());
+    if (new_s >= 0) {
+      return SetNoSigPipe(new_s);
+    }
+    if (!AcceptRetriable(-new_s)) {
       return BAD_SOCKET;
     }
+  }
+  for (;;) {
+    if (ready_ & UV_READABLE) {
+      struct sockaddr_storage mem;
+      socklen_t len = sizeof(mem);
+      uv_os_sock_t new_s = BAD_SOCKET;
+#if defined(SOCK_CLOEXEC) && defined(SOCK_NONBLOCK)
+      new_s = accept4(s_, (struct sockaddr*)&mem, &len, SOCK_CLOEXEC | SOCK_NONBLOCK);
+#else
+      new_s = ::accept(s_, (struct sockaddr*)&mem, &len);
+#endif
+      if (new_s != BAD_SOCKET) {
+        return SetNonblocking(SetNoSigPipe(new_s));
+      }
+      if (!AcceptRetriable(ErrorCode())) {
+        return BAD_SOCKET;
+      }
+    }
     Event ev = WaitReadable();
     if (ev != EVENT_READABLE) {
       return BAD_SOCKET;
@@ -374,45 +1404,94 @@ uv_os_sock_t Socket::Accept() {
 }
 
 Event Socket::WaitWritable() {
-  int events = 0;
-  events |= UV_WRITABLE;
-  events |= UV_DISCONNECT;
-  uv_poll_start(&poll_, events, [](uv_poll_t* w, int status, int events) {
-    if (status != 0) {
-      ((Socket*)w->data)->coro_->Wakeup(EVENT_POLLERR);
-    } else if (events & UV_WRITABLE) {
-      ((Socket*)w->data)->coro_->Wakeup(EVENT_WRITABLE);
-    } else if (events & UV_DISCONNECT) {
-      ((Socket*)w->data)->coro_->Wakeup(EVENT_DISCONNECT);
+  return Wait(UV_WRITABLE, nullptr);
+}
+
+// ready_ only says a read or write is worth trying, so a set bit is
+// checked with the kernel; with IO_BACKEND_URING it isn't kept at all
+bool Socket::Watch(int direction, Coroutine* self) {
+  if (error_ || (direction == UV_READABLE && (ready_ & UV_DISCONNECT))) {
+    return true;
+  }
+  if ((ready_ & direction) || self->GetScheduler()->uring_) {
+#ifdef _WIN32
+    WSAPOLLFD fds;
+    fds.fd = s_;
+    fds.events = direction == UV_READABLE ? POLLRDNORM : POLLWRNORM;
+    fds.revents = 0;
+    if (WSAPoll(&fds, 1, 0) > 0) {
+#else
+    struct pollfd fds;
+    fds.fd = s_;
+    fds.events = direction == UV_READABLE ? POLLIN : POLLOUT;
+    fds.revents = 0;
+    if (::poll(&fds, 1, 0) > 0) {
+#endif
+      ready_ |= direction;
+      return true;
     }
-  });
-  coro_->SetTimeout(GetDeadline());
-  coro_->Suspend(STATE_WAITING);
-  uv_poll_stop(&poll_);
-  return coro_->GetEvent();
+  }
+  EnsurePoll();
+  Coroutine** waiter = direction == UV_READABLE ? &reader_ : &writer_;
+  assert(*waiter == nullptr); // one reader and one writer at a time
+  *waiter = self;
+  ready_ &= ~direction;
+  UpdatePoll(interest_ | direction);
+  return false;
+}
+
+bool Socket::Unwatch(int direction, Coroutine* self) {
+  Coroutine** waiter = direction == UV_READABLE ? &reader_ : &writer_;
+  int fires = direction == UV_READABLE ? UV_READABLE | UV_DISCONNECT : direction;
+  bool fired = *waiter != self || error_ || (ready_ & fires);
+  if (*waiter == self) {
+    *waiter = nullptr;
+  }
+  return fired;
 }
 
 Event Socket::WaitReadable(Condition* cond) {
-  int events = 0;
-  events |= UV_READABLE;
-  events |= UV_DISCONNECT;
-  uv_poll_start(&poll_, events, [](uv_poll_t* w, int status, int events) {
-    if (status != 0) {
-      ((Socket*)w->data)->coro_->Wakeup(EVENT_POLLERR);
-    } else if (events & UV_READABLE) {
-      ((Socket*)w->data)->coro_->Wakeup(EVENT_READABLE);
-    } else if (events & UV_DISCONNECT) {
-      ((Socket*)w->data)->coro_->Wakeup(EVENT_DISCONNECT);
+  return Wait(UV_READABLE, cond);
+}
+
+Event Socket::Wait(int direction, Condition* cond) {
+  if (error_) {
+    return EVENT_POLLERR;
+  }
+  if (direction == UV_READABLE && (ready_ & UV_DISCONNECT)) {
+    return EVENT_DISCONNECT;
+  }
+  Coroutine* self = Coroutine::Self();
+  if (!coro_) {
+    Link(); // its creator has exited, self takes it over
+  }
+  Coroutine** waiter = direction == UV_READABLE ? &reader_ : &writer_;
+  assert(*waiter == nullptr); // one reader and one writer at a time
+  WaiterGuard guard(waiter, self);
+  if (IoUring* uring = self->GetScheduler()->uring_) {
+    Event ev = uring->Poll(s_, direction, GetDeadlineMs(), cond);
+    while (ev == EVENT_POLLERR && zc_ && ReapZeroCopy()) {
+      ev = uring->Poll(s_, direction, GetDeadlineMs(), cond); // zerocopy completions
     }
-  });
-  coro_->SetTimeout(GetDeadline());
+    if (ev == EVENT_READABLE || ev == EVENT_WRITABLE) {
+      ready_ |= direction; // keeps the ready_ checks above the syscalls true
+    }
+    return ev;
+  }
+  if (!poll_inited_ || sched_ != self->GetScheduler()) {
+    // Not while the other direction is blocked on the old loop
+    assert(reader_ == nullptr || writer_ == nullptr);
+    Rehome();
+  }
+  ready_ &= ~direction;
+  UpdatePoll(interest_ | direction);
+  self->SetTimeoutMs(GetDeadlineMs());
   if (cond) {
-    cond->Wait(coro_);
+    cond->Wait(self);
   } else {
-    coro_->Suspend(STATE_WAITING);
+    self->Suspend(STATE_WAITING);
   }
-  uv_poll_stop(&poll_);
-  return coro_->GetEvent();
+  return self->GetEvent();
 }
 
 } // coros
@@ -0,0 +1,332 @@
+#include "coros.h"
+#include <cassert>
+#include <atomic>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace coros {
+
+static const std::size_t kMinSizeClass = 12; // 4KB
+static const std::size_t kMaxSizeClass = 30; // 1GB
+static const std::size_t kDefaultLowWatermark = 32;
+static const std::size_t kDefaultHighWatermark = 256;
+static const std::size_t kHugeSlabSize = 2 * 1024 * 1024;
+
+StackPool::StackPool(Scheduler* owner)
+  : owner_(owner),
+    low_watermark_(kDefaultLowWatermark),
+    high_watermark_(kDefaultHighWatermark) {
+  free_.resize(kMaxSizeClass + 1);
+}
+
+StackPool::~StackPool() {
+  DrainReturned();
+  for (auto& l : free_) {
+    for (auto& stack : l) {
+      if (!IsSlabStack(stack)) {
+        DeallocateStack(stack);
+      }
+    }
+    l.clear();
+  }
+#if !defined(_WIN32)
+  for (auto& slab : slabs_) {
+    munmap(slab.base, slab.size);
+  }
+#endif
+  slabs_.clear();
+}
+
+static std::size_t PageSize() {
+  static std::size_t page_size = boost::context::stack_traits::page_size();
+  return page_size;
+}
+
+bool StackPool::AllocateStack(std::size_t size, boost::context::stack_context& stack, bool guard_page) {
+#if !defined(_WIN32)
+  size = (size + PageSize() - 1) & ~(PageSize() - 1);
+  std::size_t total = size + PageSize();
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(MAP_NORESERVE)
+  flags |= MAP_NORESERVE;
+#endif
+#if defined(MAP_STACK)
+  flags |= MAP_STACK;
+#endif
+  void* base = mmap(nullptr, total, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (base == MAP_FAILED) {
+    stack.sp = nullptr;
+    stack.size = 0;
+    return false;
+  }
+  // Stack grows down: the lowest page is the guard. Without it the page is
+  // simply unused and the mapping can merge with its neighbours.
+  if (guard_page && mprotect(base, PageSize(), PROT_NONE) != 0) {
+    munmap(base, total); // e.g. vm.max_map_count reached
+    stack.sp = nullptr;
+    stack.size = 0;
+    return false;
+  }
+  stack.sp = static_cast<char*>(base) + total;
+  stack.size = size;
+  return true;
+#else
+  boost::context::fixedsize_stack stack_alloc(size);
+  stack = stack_alloc.allocate();
+  return stack.sp != nullptr;
+#endif
+}
+
+void StackPool::DeallocateStack(boost::context::stack_context& stack) {
+#if !defined(_WIN32)
+  std::size_t total = stack.size + PageSize();
+  munmap(static_cast<char*>(stack.sp) - total, total);
+#else
+  boost::context::fixedsize_stack stack_alloc(stack.size);
+  stack_alloc.deallocate(stack);
+#endif
+}
+
+std::size_t StackPool::SizeClass(std::size_t size) {
+  std::size_t cls = kMinSizeClass;
+  while (cls < kMaxSizeClass && (static_cast<std::size_t>(1) << cls) < size) {
+    cls ++;
+  }
+  return cls;
+}
+
+bool StackPool::Allocate(std::size_t size, boost::context::stack_context& stack) {
+  assert(Scheduler::Get() == owner_);
+  if (!enabled_) {
+    misses_ ++;
+    if (!AllocateStack(size, stack, guard_pages_)) {
+      return false;
+    }
+    outstanding_ ++;
+    return true;
+  }
+
+  std::size_t cls = SizeClass(size);
+  StackList& l = free_[cls];
+  if (l.empty() && has_returned_) {
+    DrainReturned();
+  }
+  if (!l.empty()) {
+    hits_ ++;
+    cached_ --;
+    outstanding_ ++;
+    stack = l.back();
+    l.pop_back();
+    return true;
+  }
+
+  misses_ ++;
+  if (huge_pages_ && AllocateSlab(cls)) {
+    cached_ --;
+    outstanding_ ++;
+    stack = l.back();
+    l.pop_back();
+    return true;
+  }
+  if (!AllocateStack(static_cast<std::size_t>(1) << cls, stack, guard_pages_)) {
+    return false;
+  }
+  outstanding_ ++;
+  return true;
+}
+
+void StackPool::Deallocate(boost::context::stack_context& stack) {
+  if (!owner_ || Scheduler::Get() != owner_) {
+    bool last = false;
+    {
+      std::lock_guard<std::mutex> l(lock_);
+      if (!orphaned_) {
+        returned_.push_back(stack);
+        has_returned_ = true;
+        returned_n_ ++;
+        outstanding_ --;
+        return;
+      }
+      // Nobody picks returned stacks up any more
+      if (!IsSlabStack(stack)) {
+        Release(stack);
+      }
+      last = -- outstanding_ == 0;
+    }
+    if (last) {
+      delete this;
+    }
+    return;
+  }
+  outstanding_ --;
+  Put(stack);
+}
+
+void StackPool::Orphan() {
+  bool last;
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    orphaned_ = true;
+    owner_ = nullptr;
+    last = outstanding_ == 0;
+  }
+  if (last) {
+    delete this;
+  }
+}
+
+void StackPool::Put(boost::context::stack_context& stack) {
+  std::size_t cls = SizeClass(stack.size);
+  if (!IsSlabStack(stack) &&
+      (!enabled_ || (static_cast<std::size_t>(1) << cls) != stack.size)) {
+    Release(stack);
+    return;
+  }
+  StackList& l = free_[cls];
+  l.push_back(stack);
+  cached_ ++;
+  if (l.size() <= high_watermark_) {
+    return;
+  }
+  // Trim back to the low watermark so that a burst of exits does not pin
+  // memory, while avoiding release/allocate ping-pong at the boundary.
+  StackList kept;
+  while (l.size() > low_watermark_) {
+    boost::context::stack_context s = l.back();
+    l.pop_back();
+    if (IsSlabStack(s)) {
+      kept.push_back(s);
+    } else {
+      cached_ --;
+      Release(s);
+    }
+  }
+  l.insert(l.end(), kept.begin(), kept.end());
+}
+
+void StackPool::Release(boost::context::stack_context& stack) {
+  released_ ++;
+  DeallocateStack(stack);
+}
+
+void StackPool::DrainReturned() {
+  StackList returned;
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    returned.swap(returned_);
+    has_returned_ = false;
+  }
+  for (auto& stack : returned) {
+    Put(stack);
+  }
+}
+
+bool StackPool::AllocateSlab(std::size_t cls) {
+#if !defined(_WIN32)
+  std::size_t stack_size = static_cast<std::size_t>(1) << cls;
+  if (stack_size >= kHugeSlabSize) {
+    return false;
+  }
+  void* base = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+  base = mmap(nullptr, kHugeSlabSize, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  if (base == MAP_FAILED) {
+    // No reserved hugetlb pages, fall back to transparent huge pages
+    base = mmap(nullptr, kHugeSlabSize, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+      return false;
+    }
+#if defined(MADV_HUGEPAGE)
+    madvise(base, kHugeSlabSize, MADV_HUGEPAGE);
+#endif
+  }
+
+  // Slab stacks share huge pages and so carry no guard page
+  Slab slab;
+  slab.base = static_cast<char*>(base);
+  slab.size = kHugeSlabSize;
+  slabs_.push_back(slab);
+
+  StackList& l = free_[cls];
+  for (std::size_t offset = kHugeSlabSize; offset >= stack_size; offset -= stack_size) {
+    boost::context::stack_context stack;
+    stack.sp = slab.base + offset;
+    stack.size = stack_size;
+    l.push_back(stack);
+    cached_ ++;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool StackPool::IsSlabStack(const boost::context::stack_context& stack) const {
+  char* top = static_cast<char*>(stack.sp);
+  for (auto& slab : slabs_) {
+    if (top > slab.base && top <= slab.base + slab.size) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void StackPool::SetEnabled(bool enabled) {
+  enabled_ = enabled;
+}
+
+void StackPool::SetWatermarks(std::size_t low, std::size_t high) {
+  assert(low <= high);
+  low_watermark_ = low;
+  high_watermark_ = high;
+}
+
+void StackPool::SetHugePages(bool huge_pages) {
+  huge_pages_ = huge_pages;
+}
+
+void StackPool::SetGuardPages(bool guard_pages) {
+  guard_pages_ = guard_pages;
+}
+
+void StackPool::SetProfileRate(unsigned rate) {
+  profile_rate_ = rate;
+}
+
+bool StackPool::ShouldProfile() {
+  if (profile_rate_ == 0) {
+    return false;
+  }
+  if (++ profile_tick_ < profile_rate_) {
+    return false;
+  }
+  profile_tick_ = 0;
+  return true;
+}
+
+void StackPool::ReportStackUsed(std::size_t used) {
+  profiled_ ++;
+  std::size_t max_used = max_used_;
+  while (used > max_used && !max_used_.compare_exchange_weak(max_used, used)) {
+  }
+}
+
+StackPoolStats StackPool::GetStats() const {
+  StackPoolStats stats;
+  stats.hits = hits_;
+  stats.misses = misses_;
+  stats.returned = returned_n_;
+  stats.released = released_;
+  stats.cached = cached_;
+  stats.profiled = profiled_;
+  stats.max_used = max_used_;
+  return stats;
+}
+
+} // coros
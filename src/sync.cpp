@@ -0,0 +1,606 @@
+#include "coros.h"
+#include <cassert>
+#include <algorithm>
+
+namespace coros {
+
+enum {
+  WAITER_PARKED = 0,
+  WAITER_CLAIMED = 1,
+  WAITER_ABANDONED = 2,
+};
+
+static const uint64_t kMutexStarvingNs = 1000000;
+
+bool WaitQueue::Park(Waiter* w, std::unique_lock<std::mutex>& lock, long timeout_ms) {
+  Coroutine* self = w->coro;
+  assert(self->GetScheduler() == Scheduler::Get()); // not in an offloaded compute section
+  uv_loop_t* loop = self->GetScheduler()->GetLoop();
+  uint64_t deadline = timeout_ms > 0 ? uv_now(loop) + timeout_ms : 0;
+  self->sync_woken_ = false;
+  self->sync_parked_ = true;
+  self->event_ = EVENT_WAKEUP;
+  self->SetTimeoutMs(timeout_ms);
+  lock.unlock();
+  for (;;) {
+    try {
+      self->Suspend(STATE_WAITING);
+    } catch (Unwind& uw) {
+      w->cancelled = true;
+    }
+    if (self->sync_woken_) {
+      self->sync_parked_ = false;
+      return true;
+    }
+    uint64_t now = uv_now(loop);
+    bool expired = self->event_ == EVENT_TIMEOUT || (deadline != 0 && now >= deadline);
+    int expected = WAITER_PARKED;
+    if ((expired || w->cancelled) && w->state.compare_exchange_strong(expected, WAITER_ABANDONED)) {
+      lock.lock();
+      if (w->queued) {
+        Remove(w);
+      }
+      lock.unlock();
+      self->sync_parked_ = false;
+      return false;
+    }
+    // A stray wakeup, or claimed with the wakeup still on its way from
+    // another thread: it must land here, not in the coroutine's next wait
+    self->event_ = EVENT_WAKEUP;
+    if (deadline != 0 && !expired) {
+      self->SetTimeoutMs(static_cast<long>(deadline - now)); // the wakeup disarmed it
+    }
+  }
+}
+
+bool WaitQueue::ParkLocal(Waiter* w) {
+  Coroutine* self = w->coro;
+  self->event_ = EVENT_WAKEUP;
+  self->sync_parked_ = true;
+  while (w->queued) {
+    try {
+      self->Suspend(STATE_WAITING);
+    } catch (Unwind& uw) {
+      w->cancelled = true;
+      if (w->queued) {
+        Remove(w);
+        self->sync_parked_ = false;
+        return false;
+      }
+    }
+  }
+  self->sync_parked_ = false;
+  return true;
+}
+
+bool WaitQueue::Claim(Waiter* w) {
+  int expected = WAITER_PARKED;
+  return (w->claim ? *w->claim : w->state).compare_exchange_strong(expected, WAITER_CLAIMED);
+}
+
+void WaitQueue::Wake(Coroutine* coro) {
+  Scheduler* sched = coro->GetScheduler();
+  if (sched == Scheduler::Get()) {
+    coro->sync_woken_ = true;
+    if (coro->GetState() == STATE_WAITING) {
+      coro->Wakeup(EVENT_COND);
+    }
+  } else {
+    coro->sync_posted_ = true;
+    sched->PostCoroutine(coro); // sets sync_woken_ there, see DrainInbox
+  }
+}
+
+void WaitQueue::WakeAll() {
+  while (Waiter* w = PopFront()) {
+    Wake(w->coro); // w may be gone once woken
+  }
+}
+
+bool Mutex::LockSlow(long timeout_ms) {
+  uint64_t deadline = timeout_ms > 0 ? uv_hrtime() + static_cast<uint64_t>(timeout_ms) * 1000000 : 0;
+  WaitQueue::Waiter w;
+  w.coro = Coroutine::Self();
+  bool woken = false;
+  for (;;) {
+    if (Barge(woken)) {
+      return true;
+    }
+    long wait_ms = -1;
+    if (timeout_ms > 0) {
+      uint64_t now = uv_hrtime();
+      if (now >= deadline) {
+        if (woken) {
+          PassWakeup();
+        }
+        return false;
+      }
+      wait_ms = static_cast<long>((deadline - now + 999999) / 1000000);
+    }
+    std::unique_lock<std::mutex> lock(lock_);
+    // Taken over the wakeup by queueing, unless released meanwhile
+    int s = state_.load();
+    while ((s & MUTEX_LOCKED) && !state_.compare_exchange_weak(s, (s | MUTEX_QUEUED) & ~(woken ? MUTEX_WOKEN : 0))) {
+    }
+    if (!(s & MUTEX_LOCKED)) {
+      continue;
+    }
+    woken = false;
+    w.state.store(WAITER_PARKED);
+    w.n = 0;
+    if (w.since == 0) {
+      w.since = uv_hrtime();
+      waiters_.PushBack(&w);
+    } else {
+      waiters_.PushFront(&w); // keeps its place
+    }
+    bool claimed = waiters_.Park(&w, lock, wait_ms);
+    if (w.cancelled) {
+      if (claimed && w.n) {
+        Unlock();
+      } else if (claimed) {
+        PassWakeup();
+      }
+      throw Unwind();
+    }
+    if (!claimed) {
+      return false;
+    }
+    if (w.n) {
+      return true; // handed over
+    }
+    woken = true;
+  }
+}
+
+void Mutex::UnlockSlow() {
+  Coroutine* next = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    // Nothing else changes state_ while locked and lock_ is held
+    int s = state_.load();
+    WaitQueue::Waiter* w = nullptr;
+    if (!(s & MUTEX_WOKEN)) {
+      while ((w = waiters_.PopFront()) && !WaitQueue::Claim(w)) {
+      }
+    }
+    if (waiters_.Empty()) {
+      s &= ~MUTEX_QUEUED;
+    }
+    if (w && uv_hrtime() - w->since >= kMutexStarvingNs) {
+      w->n = 1; // still locked, for w
+      state_.store(s);
+    } else {
+      state_.store((s & ~MUTEX_LOCKED) | (w ? MUTEX_WOKEN : 0));
+    }
+    next = w ? w->coro : nullptr;
+  }
+  if (next) {
+    WaitQueue::Wake(next);
+  }
+}
+
+// A woken waiter leaving without the lock wakes the next one, unless the
+// lock is held and its Unlock will
+void Mutex::PassWakeup() {
+  Coroutine* next = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    int s = state_.load();
+    while (!state_.compare_exchange_weak(s, s & ~MUTEX_WOKEN)) {
+    }
+    if (!(s & MUTEX_LOCKED)) {
+      WaitQueue::Waiter* w = nullptr;
+      while ((w = waiters_.PopFront()) && !WaitQueue::Claim(w)) {
+      }
+      if (w) {
+        next = w->coro;
+        state_.fetch_or(MUTEX_WOKEN);
+      }
+    }
+  }
+  if (next) {
+    WaitQueue::Wake(next);
+  }
+}
+
+bool Semaphore::AcquireSlow(long timeout_ms) {
+  std::unique_lock<std::mutex> lock(lock_);
+  waiting_ ++;
+  if (waiters_.Empty() && Take()) {
+    waiting_ --;
+    return true;
+  }
+  WaitQueue::Waiter w;
+  w.coro = Coroutine::Self();
+  waiters_.PushBack(&w);
+  bool acquired = waiters_.Park(&w, lock, timeout_ms);
+  waiting_ --;
+  if (w.cancelled) {
+    if (acquired) {
+      Release(1);
+    }
+    throw Unwind();
+  }
+  return acquired;
+}
+
+void Semaphore::Grant() {
+  WaitQueue woken;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    while (!waiters_.Empty() && Take()) {
+      WaitQueue::Waiter* w = waiters_.PopFront();
+      if (WaitQueue::Claim(w)) {
+        woken.PushBack(w);
+      } else {
+        count_.fetch_add(1);
+      }
+    }
+  }
+  woken.WakeAll();
+}
+
+bool RWLock::LockSlow(bool shared, long timeout_ms) {
+  std::unique_lock<std::mutex> lock(lock_);
+  waiting_ ++;
+  if (waiters_.Empty() && TryAcquire(shared)) {
+    waiting_ --;
+    return true;
+  }
+  WaitQueue::Waiter w;
+  w.coro = Coroutine::Self();
+  w.n = shared ? 1 : 0;
+  waiters_.PushBack(&w);
+  bool locked = waiters_.Park(&w, lock, timeout_ms);
+  waiting_ --;
+  if (w.cancelled) {
+    if (locked) {
+      if (shared) {
+        UnlockShared();
+      } else {
+        Unlock();
+      }
+    }
+    throw Unwind();
+  }
+  return locked;
+}
+
+// Grants in queue order: a writer alone, or the readers up to the next one
+void RWLock::Grant() {
+  WaitQueue woken;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    while (WaitQueue::Waiter* w = waiters_.Front()) {
+      bool shared = (w->n != 0);
+      if (!TryAcquire(shared)) {
+        break;
+      }
+      waiters_.PopFront();
+      if (WaitQueue::Claim(w)) {
+        woken.PushBack(w);
+      } else if (shared) {
+        state_.fetch_sub(1);
+      } else {
+        state_.store(0);
+      }
+    }
+  }
+  woken.WakeAll();
+}
+
+bool WaitGroup::WaitSlow(long timeout_ms) {
+  std::unique_lock<std::mutex> lock(lock_);
+  waiting_ ++;
+  if (count_.load() == 0) {
+    waiting_ --;
+    return true;
+  }
+  WaitQueue::Waiter w;
+  w.coro = Coroutine::Self();
+  waiters_.PushBack(&w);
+  bool done = waiters_.Park(&w, lock, timeout_ms);
+  waiting_ --;
+  if (w.cancelled) {
+    throw Unwind();
+  }
+  return done;
+}
+
+void WaitGroup::NotifyAll() {
+  WaitQueue woken;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    while (WaitQueue::Waiter* w = waiters_.PopFront()) {
+      if (WaitQueue::Claim(w)) {
+        woken.PushBack(w);
+      }
+    }
+  }
+  woken.WakeAll();
+}
+
+bool ChannelBase::Watch(WaitQueue::Waiter* w) {
+  std::unique_lock<std::mutex> lock(lock_, std::defer_lock);
+  if (!local_) {
+    lock.lock();
+  }
+  if (closed_ || !Empty() || !senders_.Empty()) {
+    return true;
+  }
+  receivers_.PushBack(w);
+  return false;
+}
+
+bool ChannelBase::Unwatch(WaitQueue::Waiter* w) {
+  std::unique_lock<std::mutex> lock(lock_, std::defer_lock);
+  if (!local_) {
+    lock.lock();
+  }
+  if (w->queued) {
+    receivers_.Remove(w);
+  }
+  return w->n != 0;
+}
+
+bool FutureBase::Done() {
+  std::lock_guard<std::mutex> lock(lock_);
+  return done_;
+}
+
+bool FutureBase::Cancelled() {
+  std::lock_guard<std::mutex> lock(lock_);
+  return cancelled_;
+}
+
+void FutureBase::Wait() {
+  std::unique_lock<std::mutex> lock(lock_);
+  if (done_) {
+    return;
+  }
+  WaitQueue::Waiter w;
+  w.coro = Coroutine::Self();
+  waiters_.PushBack(&w);
+  waiters_.Park(&w, lock, -1);
+  if (w.cancelled) {
+    Cancel();
+    throw Unwind();
+  }
+}
+
+void FutureBase::Cancel() {
+  Scheduler* sched;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (done_ || cancel_) {
+      return;
+    }
+    cancel_ = true;
+    sched = sched_;
+  }
+  if (sched) {
+    // Only the child's own scheduler may wake it
+    std::shared_ptr<FutureBase> self = shared_from_this();
+    Coroutine::Create(sched, [self]() {
+      self->CancelHere();
+    }, [](Coroutine* c) {});
+  } // else Begin() sees cancel_
+}
+
+void FutureBase::CancelHere() {
+  Coroutine* self = Coroutine::Self();
+  self->SetPinned(true);
+  self->MoveTo(sched_); // if stolen on the way
+  std::lock_guard<std::mutex> lock(lock_);
+  if (coro_) {
+    // A ready child throws when it resumes, one in a compute section once
+    // it is back
+    coro_->Cancel();
+  }
+}
+
+bool FutureBase::Begin(Coroutine* coro) {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (!cancel_) {
+      coro_ = coro;
+      sched_ = coro->GetScheduler();
+      return true;
+    }
+  }
+  Finish(true, nullptr);
+  return false;
+}
+
+void FutureBase::Finish(bool cancelled, std::exception_ptr error) {
+  WaitQueue woken;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    done_ = true;
+    cancelled_ = cancelled;
+    error_ = error;
+    coro_ = nullptr;
+    while (WaitQueue::Waiter* w = waiters_.PopFront()) {
+      if (WaitQueue::Claim(w)) {
+        w->n = 1;
+        woken.PushBack(w);
+      }
+    }
+  }
+  woken.WakeAll();
+}
+
+bool FutureBase::Watch(WaitQueue::Waiter* w) {
+  std::lock_guard<std::mutex> lock(lock_);
+  if (done_) {
+    return true;
+  }
+  waiters_.PushBack(w);
+  return false;
+}
+
+bool FutureBase::Unwatch(WaitQueue::Waiter* w) {
+  std::lock_guard<std::mutex> lock(lock_);
+  if (w->queued) {
+    waiters_.Remove(w);
+  }
+  return w->n != 0;
+}
+
+int Select::Add(Kind kind, void* target) {
+  cases_.emplace_back();
+  Case& c = cases_.back();
+  c.kind = kind;
+  c.target = target;
+  return static_cast<int>(cases_.size()) - 1;
+}
+
+bool Select::Arm(Case& c, Coroutine* self) {
+  c.fired = false;
+  switch (c.kind) {
+  case CASE_READABLE:
+    c.fired = static_cast<Socket*>(c.target)->Watch(UV_READABLE, self);
+    break;
+  case CASE_WRITABLE:
+    c.fired = static_cast<Socket*>(c.target)->Watch(UV_WRITABLE, self);
+    break;
+  case CASE_NOTIFIED:
+    static_cast<Condition*>(c.target)->waiting_.push_back(self);
+    break;
+  case CASE_JOINED: {
+    Coroutine* coro = static_cast<Coroutine*>(c.target);
+    if (coro->GetState() == STATE_DONE) {
+      c.fired = true;
+    } else {
+      assert(coro->joined_ == nullptr); // one joiner at a time
+      coro->joined_ = self;
+      coro->join_fired_ = &c.fired;
+    }
+    break;
+  }
+  case CASE_RECEIVED:
+  case CASE_COMPLETED:
+    c.waiter.coro = self;
+    c.waiter.claim = &claim_;
+    c.waiter.data = nullptr;
+    c.waiter.n = 0;
+    if (c.kind == CASE_RECEIVED) {
+      c.fired = static_cast<ChannelBase*>(c.target)->Watch(&c.waiter);
+    } else {
+      c.fired = static_cast<FutureBase*>(c.target)->Watch(&c.waiter);
+    }
+    break;
+  case CASE_TIMEOUT:
+    c.fired = uv_now(self->GetScheduler()->GetLoop()) >= deadline_;
+    break;
+  }
+  c.armed = !c.fired;
+  return c.fired;
+}
+
+bool Select::Disarm(Case& c, Coroutine* self) {
+  c.armed = false;
+  switch (c.kind) {
+  case CASE_READABLE:
+    return static_cast<Socket*>(c.target)->Unwatch(UV_READABLE, self);
+  case CASE_WRITABLE:
+    return static_cast<Socket*>(c.target)->Unwatch(UV_WRITABLE, self);
+  case CASE_NOTIFIED: {
+    // Notified ones have been taken off the list
+    CoroutineList& waiting = static_cast<Condition*>(c.target)->waiting_;
+    auto it = std::find(waiting.begin(), waiting.end(), self);
+    if (it == waiting.end()) {
+      return true;
+    }
+    waiting.erase(it);
+    return false;
+  }
+  case CASE_JOINED:
+    if (!c.fired) {
+      Coroutine* coro = static_cast<Coroutine*>(c.target);
+      coro->joined_ = nullptr;
+      coro->join_fired_ = nullptr;
+    }
+    return c.fired; // the coroutine is gone if set
+  case CASE_RECEIVED:
+    return static_cast<ChannelBase*>(c.target)->Unwatch(&c.waiter);
+  case CASE_COMPLETED:
+    return static_cast<FutureBase*>(c.target)->Unwatch(&c.waiter);
+  case CASE_TIMEOUT:
+    self->GetScheduler()->RemoveTimer(&self->timer_);
+    return uv_now(self->GetScheduler()->GetLoop()) >= deadline_;
+  }
+  return false;
+}
+
+int Select::Wait() {
+  Coroutine* self = Coroutine::Self();
+  assert(self->GetScheduler() == Scheduler::Get()); // not in an offloaded compute section
+  uv_loop_t* loop = self->GetScheduler()->GetLoop();
+  long timeout_ms = -1;
+  for (auto it = cases_.begin(); it != cases_.end(); ++it) {
+    if (it->kind == CASE_TIMEOUT) {
+      timeout_ms = it->millisecs > 0 ? it->millisecs : 0;
+      deadline_ = uv_now(loop) + timeout_ms;
+    }
+  }
+  for (;;) {
+    claim_.store(WAITER_PARKED);
+    self->sync_woken_ = false;
+    self->sync_parked_ = true;
+    // Arm in order up to the first that is ready already
+    bool ready = false;
+    for (auto it = cases_.begin(); it != cases_.end(); ++it) {
+      it->fired = false;
+      if (!ready) {
+        ready = Arm(*it, self);
+      }
+    }
+    bool cancelled = false;
+    if (!ready) {
+      self->event_ = EVENT_WAKEUP;
+      if (timeout_ms >= 0) {
+        uint64_t now = uv_now(loop);
+        self->SetTimeoutMs(deadline_ > now ? static_cast<long>(deadline_ - now) : 1);
+      }
+      try {
+        self->Suspend(STATE_WAITING);
+      } catch (Unwind& uw) {
+        cancelled = true;
+      }
+    }
+    // Channels claim through claim_; one that got there first may still
+    // have its wakeup on the way from another thread
+    int expected = WAITER_PARKED;
+    if (!claim_.compare_exchange_strong(expected, WAITER_ABANDONED)) {
+      while (!self->sync_woken_) {
+        self->event_ = EVENT_WAKEUP;
+        try {
+          self->Suspend(STATE_WAITING);
+        } catch (Unwind& uw) {
+          cancelled = true;
+        }
+      }
+    }
+    int first = -1;
+    for (std::size_t i = 0; i < cases_.size(); i++) {
+      Case& c = cases_[i];
+      if (c.armed) {
+        c.fired = Disarm(c, self);
+      }
+      if (c.fired && first < 0) {
+        first = static_cast<int>(i);
+      }
+    }
+    self->sync_parked_ = false;
+    if (cancelled) {
+      throw Unwind();
+    }
+    if (first >= 0) {
+      return first;
+    }
+  }
+}
+
+} // coros
@@ -0,0 +1,149 @@
+#include "coros.h"
+#include <cassert>
+
+namespace coros {
+
+inline void InitHead(Timer& head) {
+  head.prev = head.next = &head;
+}
+
+inline bool IsEmpty(const Timer& head) {
+  return head.next == &head;
+}
+
+inline void LinkTail(Timer& head, Timer* t) {
+  t->prev = head.prev;
+  t->next = &head;
+  head.prev->next = t;
+  head.prev = t;
+}
+
+inline void Unlink(Timer* t) {
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->prev = t->next = nullptr;
+}
+
+// Moves all of `from` onto `to`, leaving `from` empty
+inline void Splice(Timer& from, Timer& to) {
+  InitHead(to);
+  if (!IsEmpty(from)) {
+    to.next = from.next;
+    to.prev = from.prev;
+    to.next->prev = &to;
+    to.prev->next = &to;
+    InitHead(from);
+  }
+}
+
+TimerWheel::TimerWheel() {
+  InitHead(due_);
+  for (int l = 0; l < kLevels; l++) {
+    for (int i = 0; i < kSlots; i++) {
+      InitHead(slots_[l][i]);
+    }
+  }
+}
+
+void TimerWheel::Add(Timer* t, uint64_t expire) {
+  assert(!t->IsArmed());
+  t->expire = expire;
+  count_ ++;
+  if (expire <= now_) {
+    LinkTail(due_, t);
+  } else {
+    Place(t);
+  }
+}
+
+void TimerWheel::Remove(Timer* t) {
+  assert(t->IsArmed());
+  Unlink(t);
+  count_ --;
+}
+
+void TimerWheel::Place(Timer* t) {
+  uint64_t delta = t->expire - now_;
+  static const uint64_t kMaxDelta = (static_cast<uint64_t>(1) << (kBits * kLevels)) - 1;
+  if (delta > kMaxDelta) {
+    t->expire = now_ + kMaxDelta;
+    delta = kMaxDelta;
+  }
+  int level = 0;
+  while (level < kLevels - 1 && delta >= (static_cast<uint64_t>(1) << (kBits * (level + 1)))) {
+    level ++;
+  }
+  int slot = (t->expire >> (kBits * level)) & (kSlots - 1);
+  LinkTail(slots_[level][slot], t);
+}
+
+void TimerWheel::Cascade(int level) {
+  int slot = (now_ >> (kBits * level)) & (kSlots - 1);
+  if (slot == 0 && level < kLevels - 1) {
+    Cascade(level + 1);
+  }
+  Timer pending;
+  Splice(slots_[level][slot], pending);
+  while (!IsEmpty(pending)) {
+    Timer* t = pending.next;
+    Unlink(t);
+    Place(t);
+  }
+}
+
+void TimerWheel::Fire(Timer& head) {
+  // Callbacks may re-arm timers, so detach the list first
+  Timer pending;
+  Splice(head, pending);
+  while (!IsEmpty(pending)) {
+    Timer* t = pending.next;
+    Unlink(t);
+    count_ --;
+    t->fn(t);
+  }
+}
+
+void TimerWheel::Advance(uint64_t now) {
+  if (count_ == 0) {
+    now_ = now > now_ ? now : now_;
+    return;
+  }
+  Fire(due_);
+  while (now_ < now && count_ > 0) {
+    now_ ++;
+    int slot = now_ & (kSlots - 1);
+    if (slot == 0) {
+      Cascade(1);
+    }
+    Fire(slots_[0][slot]);
+  }
+  if (now_ < now) {
+    now_ = now;
+  }
+}
+
+long TimerWheel::NextTimeout(uint64_t now) const {
+  if (count_ == 0) {
+    return -1;
+  }
+  if (!IsEmpty(due_)) {
+    return 0;
+  }
+  // Earliest point at which a level-0 slot fires or a higher slot cascades
+  uint64_t next = UINT64_MAX;
+  for (int l = 0; l < kLevels; l++) {
+    uint64_t block = now_ >> (kBits * l);
+    for (int d = 1; d <= kSlots; d++) {
+      if (!IsEmpty(slots_[l][(block + d) & (kSlots - 1)])) {
+        uint64_t at = (block + d) << (kBits * l);
+        if (at < next) {
+          next = at;
+        }
+        break;
+      }
+    }
+  }
+  return next > now ? static_cast<long>(next - now) : 0;
+}
+
+} // coros
@@ -4,8 +4,16 @@ target("coros")
     set_kind("static")
 
     add_files("coroutine.cpp")
+    add_files("executor.cpp")
+    add_files("find_byte.cpp")
+    add_files("io_uring.cpp")
+    add_files("resolver.cpp")
+    add_files("ring_buffer.cpp")
     add_files("scheduler.cpp")
     add_files("socket.cpp")
+    add_files("stack_pool.cpp")
+    add_files("sync.cpp")
+    add_files("timer_wheel.cpp")
 
     set_warnings("all", "error")
     set_languages("c++11")
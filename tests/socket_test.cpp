@@ -0,0 +1,226 @@
+#include "coros.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#if !defined(_WIN32)
+#include <arpa/inet.h>
+#endif
+
+// Socket ownership and cancellation: a socket outlives the coroutine that
+// created it once it has been handed to another one, and a waiter cancelled
+// while parked on a socket leaves nothing behind. Pass "uring" to run on
+// IO_BACKEND_URING. Exits non-zero if a check failed.
+static int failures = 0;
+
+#define CHECK(cond) \
+  if (!(cond)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    failures++; \
+  }
+
+void ExitFn(coros::Coroutine* c) {
+}
+
+// A connected pair over loopback; *server is the accepted end
+bool Connect(coros::Socket* client, uv_os_sock_t* server) {
+  coros::Socket listener;
+  if (!listener.ListenByIp("127.0.0.1", 0)) {
+    return false;
+  }
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  getsockname(listener.GetSocket(), (struct sockaddr*)&addr, &addrlen);
+  bool ok = client->ConnectIp("127.0.0.1", ntohs(addr.sin_port));
+  *server = ok ? listener.Accept() : BAD_SOCKET;
+  listener.Close();
+  return ok && *server != BAD_SOCKET;
+}
+
+// The creator exits while the socket is in use elsewhere
+void TestHandedOver(coros::Scheduler* sched) {
+  coros::Coroutine* self = coros::Coroutine::Self();
+  coros::Socket peer;
+  uv_os_sock_t fd;
+  if (!Connect(&peer, &fd)) {
+    CHECK(false);
+    return;
+  }
+  coros::Socket* handed = nullptr;
+  coros::Coroutine::Create(sched, [&]() {
+    handed = new coros::Socket(fd);
+    handed->SetDeadlineMs(1000);
+  }, ExitFn);
+  self->Wait(10);
+  CHECK(peer.WriteExactly("ping", 4) == 4);
+  char buf[8];
+  CHECK(handed->ReadSome(buf, sizeof(buf)) == 4);
+  CHECK(handed->WriteExactly("pong", 4) == 4);
+  handed->Close();
+  delete handed;
+  peer.SetDeadlineMs(1000);
+  CHECK(peer.ReadSome(buf, sizeof(buf)) == 4);
+  peer.Close();
+}
+
+// Another coroutine is parked reading when the creator exits
+void TestCreatorExitsUnderReader(coros::Scheduler* sched) {
+  coros::Coroutine* self = coros::Coroutine::Self();
+  coros::Socket peer;
+  uv_os_sock_t fd;
+  if (!Connect(&peer, &fd)) {
+    CHECK(false);
+    return;
+  }
+  coros::Socket* handed = nullptr;
+  int n = 0;
+  bool done = false;
+  coros::Coroutine::Create(sched, [&]() {
+    handed = new coros::Socket(fd);
+    handed->SetDeadlineMs(1000);
+    coros::Coroutine::Create(sched, [&]() {
+      char buf[8];
+      n = handed->ReadSome(buf, sizeof(buf));
+      done = true;
+    }, ExitFn);
+  }, ExitFn);
+  self->Wait(10);
+  CHECK(peer.WriteExactly("ping", 4) == 4);
+  self->Wait(100); // well short of the reader's deadline
+  CHECK(done && n == 4);
+  while (!done) {
+    self->Wait(10);
+  }
+  handed->Close();
+  delete handed;
+  peer.Close();
+}
+
+// A reader cancelled while parked, then the socket is read again and closed
+void TestCancelledReader(coros::Scheduler* sched, bool read_again) {
+  coros::Coroutine* self = coros::Coroutine::Self();
+  coros::Socket peer;
+  uv_os_sock_t fd;
+  if (!Connect(&peer, &fd)) {
+    CHECK(false);
+    return;
+  }
+  coros::Socket s(fd);
+  int unwound = 0;
+  coros::Coroutine* reader = coros::Coroutine::Create(sched, [&]() {
+    char buf[8];
+    try {
+      s.ReadSome(buf, sizeof(buf));
+    } catch (coros::Unwind&) {
+      unwound++;
+      throw;
+    }
+  }, ExitFn);
+  self->Wait(10);
+  reader->Cancel();
+  self->Wait(10);
+  CHECK(unwound == 1);
+  if (read_again) {
+    char buf[8];
+    s.SetDeadlineMs(1000);
+    CHECK(peer.WriteExactly("ping", 4) == 4);
+    CHECK(s.ReadSome(buf, sizeof(buf)) == 4);
+  }
+  s.Close();
+  peer.Close();
+}
+
+// A producer cancelled while Enqueue() waits for the queue to drain
+void TestCancelledProducer(coros::Scheduler* sched) {
+  coros::Coroutine* self = coros::Coroutine::Self();
+  coros::Socket peer;
+  uv_os_sock_t fd;
+  if (!Connect(&peer, &fd)) {
+    CHECK(false);
+    return;
+  }
+  coros::Socket s(fd);
+  s.SetHighWater(64 * 1024);
+  static char chunk[16 * 1024];
+  int queued = 0;
+  int unwound = 0;
+  coros::Coroutine* producer = coros::Coroutine::Create(sched, [&]() {
+    try {
+      while (s.Enqueue(chunk, sizeof(chunk)) > 0) {
+        queued += sizeof(chunk);
+      }
+    } catch (coros::Unwind&) {
+      unwound++;
+      throw;
+    }
+  }, ExitFn);
+  self->Wait(20); // the peer isn't reading, so the queue fills up
+  producer->Cancel();
+  self->Wait(10);
+  CHECK(unwound == 1);
+  static char buf[64 * 1024];
+  int got = 0;
+  peer.SetDeadlineMs(100);
+  for (int n; (n = peer.ReadSome(buf, sizeof(buf))) > 0; ) {
+    got += n;
+  }
+  CHECK(s.Flush() == 0 && got == queued);
+  s.Close();
+  peer.Close();
+}
+
+// A read raced against a timer with WhenAny(); the timer wins, the read is
+// cancelled and the socket closed, after the read unwound or right away
+void TestReadOrTimer(coros::Scheduler* sched, bool close_first) {
+  coros::Socket peer;
+  uv_os_sock_t fd;
+  if (!Connect(&peer, &fd)) {
+    CHECK(false);
+    return;
+  }
+  coros::Socket s(fd);
+  std::vector<coros::Future<int> > futures;
+  futures.push_back(coros::Spawn(sched, [&]() {
+    char buf[8];
+    return s.ReadSome(buf, sizeof(buf));
+  }));
+  futures.push_back(coros::Spawn(sched, []() {
+    coros::Coroutine::Self()->Wait(20);
+    return 0;
+  }));
+  CHECK(coros::WhenAny(futures) == 1);
+  futures[0].Cancel();
+  if (close_first) {
+    s.Close();
+  }
+  futures[0].Wait();
+  CHECK(futures[0].Cancelled() || futures[0].Get() < 0);
+  s.Close();
+  peer.Close();
+}
+
+void MainFn(coros::Scheduler* sched) {
+  TestHandedOver(sched);
+  TestCreatorExitsUnderReader(sched);
+  TestCancelledReader(sched, true);
+  TestCancelledReader(sched, false);
+  TestCancelledProducer(sched);
+  TestReadOrTimer(sched, false);
+  TestReadOrTimer(sched, true);
+  sched->Stop();
+}
+
+int main(int argc, char** argv) {
+  coros::Scheduler sched(true);
+  // Exited coroutines' stacks are unmapped, so stale pointers into them fault
+  sched.GetStackPool().SetEnabled(false);
+  if (argc > 1 && strcmp(argv[1], "uring") == 0 && !sched.SetIoBackend(coros::IO_BACKEND_URING)) {
+    printf("io_uring unavailable, skipped\n");
+    return 0;
+  }
+  coros::Coroutine::Create(&sched, std::bind(MainFn, &sched), ExitFn);
+  sched.Run();
+  if (failures == 0) {
+    printf("all checks passed\n");
+  }
+  return failures == 0 ? 0 : 1;
+}
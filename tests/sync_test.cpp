@@ -0,0 +1,86 @@
+#include "coros.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+// Synchronisation across a stealing Schedulers group: coroutines in timed
+// waits on a Semaphore, released from plain threads while peers steal them.
+// Exits non-zero if a check failed.
+static int failures = 0;
+
+#define CHECK(cond) \
+  if (!(cond)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    failures++; \
+  }
+
+void ExitFn(coros::Coroutine* c) {
+}
+
+static coros::Semaphore sem;
+static coros::Scheduler* home = nullptr;
+static std::atomic<bool> stop{ false };
+static std::atomic<int> running{ 0 };
+static std::atomic<long> acquired{ 0 };
+static std::atomic<long> released{ 0 };
+
+// Spins on timed acquires, going back home now and then so peers keep stealing
+void WaiterFn() {
+  coros::Coroutine* self = coros::Coroutine::Self();
+  for (long k = 0; !stop; k++) {
+    if (sem.AcquireFor(1)) {
+      acquired++;
+    }
+    self->Nice();
+    if (k % 16 == 0 && self->GetScheduler() != home) {
+      self->MoveTo(home);
+    }
+  }
+  running--;
+}
+
+void ReleaserFn() {
+  while (!stop) {
+    sem.Release();
+    if (++released % 64 == 0) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  coros::Schedulers scheds(4);
+  scheds.SetStealing(true);
+  home = scheds.GetNext();
+  const int kWaiters = 400;
+  running = kWaiters;
+  for (int i = 0; i < kWaiters; i++) {
+    coros::Coroutine::Create(home, WaiterFn, ExitFn);
+  }
+  std::vector<std::thread> releasers;
+  for (int i = 0; i < 3; i++) {
+    releasers.emplace_back(ReleaserFn);
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(2));
+  stop = true;
+  for (auto& t : releasers) {
+    t.join();
+  }
+  // Every waiter finishes, none is left behind on a loop gone idle
+  for (int i = 0; running > 0 && i < 500; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  CHECK(running == 0);
+  long left = 0;
+  while (sem.TryAcquire()) {
+    left++;
+  }
+  CHECK(acquired + left == released);
+  scheds.Stop();
+  if (failures == 0) {
+    printf("all checks passed\n");
+  }
+  return failures == 0 ? 0 : 1;
+}
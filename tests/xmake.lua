@@ -0,0 +1,16 @@
+add_links("uv")
+if is_plat("windows", "mingw", "msys") then
+    add_links("boost_context-mt")
+    add_syslinks("ws2_32")
+end
+set_warnings("all", "error")
+set_languages("c++11")
+add_deps("coros")
+
+target("socket_test")
+    set_kind("binary")
+    add_files("socket_test.cpp")
+
+target("sync_test")
+    set_kind("binary")
+    add_files("sync_test.cpp")
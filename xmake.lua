@@ -1,3 +1,4 @@
 add_subdirs("deps/malog/src")
 add_subdirs("src")
 add_subdirs("examples")
+add_subdirs("tests")